@@ -9,5 +9,5 @@
 # Exit early if any commands fail
 set -e
 
-gcc -ggdb -fsanitize=address -Wall -Wpedantic app/*.c -o /tmp/shell-target || \
-    gcc -ggdb -Wall -Wpedantic app/*.c -o /tmp/shell-target
+gcc -ggdb -fsanitize=address -pthread -Wall -Wpedantic app/*.c -o /tmp/shell-target || \
+    gcc -ggdb -pthread -Wall -Wpedantic app/*.c -o /tmp/shell-target
@@ -1,27 +1,159 @@
+#define _GNU_SOURCE
 #include <sys/stat.h>
 #include <ctype.h>
 #include <assert.h>
 #include <poll.h>
 #include <termios.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <pwd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#include <time.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <linux/io_uring.h>
 
 #define CTRL_C 003
 #define CTRL_D 004
 
 struct termios *old_termios_ptr = NULL;
 
+// Counts of allocations and I/O, for shellstats. Allocations are counted
+// through the ARRAY_* macros, char_array_reserve() and the wrappers of
+// strdup, strndup and asprintf below; syscalls through the wrappers of
+// read, write, poll, splice, tee and fork. Macros route every call in the
+// shell through them.
+typedef enum {
+  STAT_ALLOCS,
+  STAT_ALLOC_BYTES,
+  STAT_ARRAY_GROWS,
+  STAT_READS,
+  STAT_WRITES,
+  STAT_POLLS,
+  STAT_SPLICES,
+  STAT_URING_ENTERS,
+  STAT_RELAYED_BYTES,
+  STAT_SPAWNS,
+  STAT_COUNT,
+} stat_counter;
+
+const struct {
+  const char *name;
+  const char *help;
+} stat_info[STAT_COUNT] = {
+  [STAT_ALLOCS] = { "allocations", "Allocations made by the shell." },
+  [STAT_ALLOC_BYTES] = { "allocated_bytes", "Bytes allocated by the shell." },
+  [STAT_ARRAY_GROWS] = { "array_grows", "Reallocations from growing arrays." },
+  [STAT_READS] = { "read_syscalls", "read() calls." },
+  [STAT_WRITES] = { "write_syscalls", "write() calls." },
+  [STAT_POLLS] = { "poll_syscalls", "poll() calls." },
+  [STAT_SPLICES] = { "splice_syscalls", "splice() and tee() calls." },
+  [STAT_URING_ENTERS] = { "io_uring_enter_syscalls", "io_uring_enter() calls." },
+  [STAT_RELAYED_BYTES] = { "relayed_bytes", "Bytes of command output relayed by the shell." },
+  [STAT_SPAWNS] = { "spawns", "Child processes forked." },
+};
+
+uint64_t stats[STAT_COUNT] = {0};
+// What the last command line used
+uint64_t stats_last[STAT_COUNT] = {0};
+// Set by `shellstats -o FILE`, written by the shell itself on exit
+char *stats_exit_path = NULL;
+pid_t stats_pid = 0;
+
+// Atomic, as builtins in a pipeline can run on threads
+#define STAT_ADD(stat, n) __atomic_fetch_add(&stats[(stat)], (n), __ATOMIC_RELAXED)
+
+char *stat_strdup(const char *s) {
+  char *ret = strdup(s);
+  STAT_ADD(STAT_ALLOCS, 1);
+  if (ret != NULL) STAT_ADD(STAT_ALLOC_BYTES, strlen(ret) + 1);
+  return ret;
+}
+
+char *stat_strndup(const char *s, size_t n) {
+  char *ret = strndup(s, n);
+  STAT_ADD(STAT_ALLOCS, 1);
+  if (ret != NULL) STAT_ADD(STAT_ALLOC_BYTES, strlen(ret) + 1);
+  return ret;
+}
+
+__attribute__((format(printf, 2, 3)))
+int stat_asprintf(char **strp, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int ret = vasprintf(strp, fmt, ap);
+  va_end(ap);
+  STAT_ADD(STAT_ALLOCS, 1);
+  if (ret >= 0) STAT_ADD(STAT_ALLOC_BYTES, ret + 1);
+  return ret;
+}
+
+ssize_t stat_read(int fd, void *buf, size_t count) {
+  STAT_ADD(STAT_READS, 1);
+  return read(fd, buf, count);
+}
+
+ssize_t stat_write(int fd, const void *buf, size_t count) {
+  STAT_ADD(STAT_WRITES, 1);
+  return write(fd, buf, count);
+}
+
+int stat_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  STAT_ADD(STAT_POLLS, 1);
+  return poll(fds, nfds, timeout);
+}
+
+ssize_t stat_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags) {
+  STAT_ADD(STAT_SPLICES, 1);
+  return splice(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+ssize_t stat_tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+  STAT_ADD(STAT_SPLICES, 1);
+  return tee(fd_in, fd_out, len, flags);
+}
+
+pid_t stat_fork(void) {
+  STAT_ADD(STAT_SPAWNS, 1);
+  return fork();
+}
+
+#undef strdup
+#undef strndup
+#define strdup(s) stat_strdup(s)
+#define strndup(s, n) stat_strndup(s, n)
+#define asprintf(...) stat_asprintf(__VA_ARGS__)
+#define read(fd, buf, count) stat_read(fd, buf, count)
+#define write(fd, buf, count) stat_write(fd, buf, count)
+#define poll(fds, nfds, timeout) stat_poll(fds, nfds, timeout)
+#define splice(...) stat_splice(__VA_ARGS__)
+#define tee(...) stat_tee(__VA_ARGS__)
+#define fork() stat_fork()
+
 typedef enum {
   UNQUOTED,
   SINGLE,
@@ -39,12 +171,14 @@ typedef ARRAY(char *) str_arr;
 
 #define ARRAY_ENSURE_CAPACITY(arr, cap) do { \
   if ((cap) > (arr).capacity) { \
+    STAT_ADD((arr).capacity == 0 ? STAT_ALLOCS : STAT_ARRAY_GROWS, 1); \
+    STAT_ADD(STAT_ALLOC_BYTES, sizeof((arr).data[0]) * (cap)); \
     (arr).data = realloc((arr).data, sizeof((arr).data[0]) * (cap)); \
     if ((arr).data == NULL) { \
         perror("ARRAY_ENSURE_CAPACITY realloc"); \
         ABORT(); \
     } \
-    memset((arr).data + sizeof((arr).data[0]) * (arr).capacity, \
+    memset((arr).data + (arr).capacity, \
         '\0', sizeof((arr).data[0]) * ((cap) - (arr).capacity)); \
     (arr).capacity = (cap); \
   } \
@@ -67,11 +201,69 @@ typedef ARRAY(char *) str_arr;
   } \
 } while (false)
 
+// An ARRAY that keeps its first N elements inline, only going to the heap
+// once it outgrows them. data points into the struct itself, so one has to
+// be set up with SBO_ARRAY_INIT and never copied.
+// Left as {0} it works the same as a plain ARRAY.
+#define SBO_ARRAY(X, N) \
+struct { \
+  size_t capacity; \
+  size_t size; \
+  X *data; \
+  X inline_data[N]; \
+}
+
+#define SBO_INLINE(arr) ((arr).data == (arr).inline_data)
+#define SBO_INLINE_CAPACITY(arr) (sizeof((arr).inline_data) / sizeof((arr).inline_data[0]))
+
+#define SBO_ARRAY_INIT(arr) do { \
+  (arr).capacity = SBO_INLINE_CAPACITY(arr); \
+  (arr).size = 0; \
+  (arr).data = (arr).inline_data; \
+} while (false)
+
+#define SBO_ARRAY_ENSURE_CAPACITY(arr, cap) do { \
+  if ((cap) > (arr).capacity && SBO_INLINE(arr)) { \
+    (arr).data = NULL; \
+    (arr).capacity = 0; \
+    ARRAY_ENSURE_CAPACITY((arr), (cap)); \
+    memcpy((arr).data, (arr).inline_data, sizeof((arr).inline_data)); \
+  } \
+  ARRAY_ENSURE_CAPACITY((arr), (cap)); \
+} while (false)
+
+#define SBO_ARRAY_ADD(arr, value) do { \
+  if ((arr).size + 1 > (arr).capacity) { \
+    size_t new_capacity = (arr).capacity == 0 ? 16 : (arr).capacity * 2; \
+    SBO_ARRAY_ENSURE_CAPACITY((arr), (new_capacity)); \
+  } \
+  (arr).data[(arr).size ++] = (value); \
+} while (false)
+
+// Moves inline elements to a heap block of their own, for handing data on
+#define SBO_ARRAY_DETACH(arr) do { \
+  if (SBO_INLINE(arr)) { \
+    size_t size = (arr).size; \
+    (arr).data = NULL; \
+    (arr).capacity = 0; \
+    ARRAY_ENSURE_CAPACITY((arr), size > 0 ? size : 1); \
+    memcpy((arr).data, (arr).inline_data, sizeof((arr).inline_data[0]) * size); \
+  } \
+} while (false)
+
+#define SBO_ARRAY_FREE(arr) do { \
+  if (!SBO_INLINE(arr)) free((arr).data); \
+  SBO_ARRAY_INIT(arr); \
+} while (false)
+
 typedef ARRAY(char *) string_array;
+typedef ARRAY(char) char_array;
 typedef struct {
   char *command;
   char *description;
   int (*function)(string_array args);
+  bool pure; // doesn't change the shell, so $(...) can run it in-process
+  bool threaded; // only uses its own files, so a pipeline can run it on a thread
 } command_t;
 
 #define COMMAND(name, desc) (command_t){ \
@@ -80,8 +272,29 @@ typedef struct {
     .function = name ## _command \
 }
 
+#define PURE_COMMAND(name, desc) (command_t){ \
+    .command = #name, \
+    .description = (desc), \
+    .function = name ## _command, \
+    .pure = true \
+}
+
+#define THREADED_COMMAND(name, desc) (command_t){ \
+    .command = #name, \
+    .description = (desc), \
+    .function = name ## _command, \
+    .pure = true, \
+    .threaded = true \
+}
+
+typedef ARRAY(FILE *) file_array;
+
 ARRAY(command_t) builtins = {0};
-ARRAY(FILE *) files = {0};
+// Each thread running a builtin of a pipeline has its own
+_Thread_local file_array files = {0};
+
+// Output of commands goes here instead of stdout while running $(...)
+char_array *capture = NULL;
 
 void close_open_files(void) {
   for (size_t i = 0; i < files.size; i ++) {
@@ -92,22 +305,357 @@ void close_open_files(void) {
   }
 }
 
+void vars_free(void);
+void glob_cache_free(void);
+void arith_cache_free(void);
+void io_ring_free(void);
+void prompt_free(void);
+void dirs_free(void);
+void functions_free(void);
+void path_hash_clear(void);
+void stats_write_exit_file(void);
+void record_close(void);
+void coprocs_free(void);
+void paste_mode(bool on);
+void paste_free(void);
+
 void cleanup(void) {
+  stats_write_exit_file();
   close_open_files();
   ARRAY_FREE(files);
   ARRAY_FREE(builtins);
+  vars_free();
+  glob_cache_free();
+  arith_cache_free();
+  io_ring_free();
+  prompt_free();
+  dirs_free();
+  functions_free();
+  path_hash_clear();
+  record_close();
+  coprocs_free();
+  paste_free();
   if (old_termios_ptr != NULL) {
+    paste_mode(false);
     if (tcsetattr(STDIN_FILENO, TCSANOW, old_termios_ptr) != 0) perror("cleanup tcsetattr");
   }
 }
 
 int exit_command(string_array args);
+int execute_command(string_array words, string_array assigns);
+void server_reply(int status);
 
 #define ABORT() do { cleanup(); abort(); } while (0)
 
 #define UNIMPLEMENTED(msg) do { fprintf(stderr, "%s:%d: UNIMPLEMENTED: %s", __FILE__, __LINE__, msg); ABORT(); } while (false)
 #define UNREACHABLE() do { fprintf(stderr, "%s:%d: UNREACHABLE", __FILE__, __LINE__); ABORT(); } while (false)
 
+// Makes room for at least `extra` more elements, growing geometrically
+void char_array_reserve(char_array *arr, size_t extra) {
+  if (arr->size + extra <= arr->capacity) return;
+  size_t cap = arr->capacity == 0 ? 16 : arr->capacity * 2;
+  while (cap < arr->size + extra) cap *= 2;
+  STAT_ADD(arr->capacity == 0 ? STAT_ALLOCS : STAT_ARRAY_GROWS, 1);
+  STAT_ADD(STAT_ALLOC_BYTES, cap);
+  arr->data = realloc(arr->data, cap);
+  if (arr->data == NULL) {
+    perror("char_array_reserve realloc");
+    ABORT();
+  }
+  arr->capacity = cap;
+}
+
+typedef struct variable {
+  char *name;
+  char *value;
+  char *env_entry; // cached "name=value", only built for the environment
+  bool exported;
+  struct variable *next;
+} variable;
+
+struct {
+  size_t capacity;
+  size_t size;
+  variable **buckets;
+} vars = {0};
+
+// NULL terminated "name=value" pointers of exported variables, owned by the
+// variables themselves. Rebuilt lazily when an exported variable changes.
+string_array env_cache = {0};
+bool env_dirty = true;
+
+int last_status = 0;
+// Set by ^C, stops any loops and lists that are running
+bool interrupted = false;
+char *shell_name = NULL;
+// $1, $2, ... of the script or the function being run
+string_array positional = {0};
+
+uint64_t hash_string(const char *s) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  while (*s != '\0') {
+    hash ^= (unsigned char)*s++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+void free_string_array(string_array *arr) {
+  for (size_t i = 0; i < arr->size; i ++) {
+    free(arr->data[i]);
+    arr->data[i] = NULL;
+  }
+  ARRAY_FREE(*arr);
+}
+
+bool is_name(const char *s, size_t len) {
+  if (len == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_')) return false;
+  for (size_t i = 1; i < len; i ++) {
+    if (!(isalnum((unsigned char)s[i]) || s[i] == '_')) return false;
+  }
+  return true;
+}
+
+variable *var_lookup(const char *name) {
+  if (vars.capacity == 0) return NULL;
+  variable *var = vars.buckets[hash_string(name) & (vars.capacity - 1)];
+  while (var != NULL && strcmp(var->name, name) != 0) var = var->next;
+  return var;
+}
+
+char *var_get(const char *name) {
+  variable *var = var_lookup(name);
+  return var == NULL ? NULL : var->value;
+}
+
+void vars_grow(void) {
+  size_t new_capacity = vars.capacity == 0 ? 64 : vars.capacity * 2;
+  variable **buckets = calloc(new_capacity, sizeof(variable *));
+  if (buckets == NULL) {
+    perror("vars_grow calloc");
+    ABORT();
+  }
+  for (size_t i = 0; i < vars.capacity; i ++) {
+    variable *var = vars.buckets[i];
+    while (var != NULL) {
+      variable *next = var->next;
+      size_t idx = hash_string(var->name) & (new_capacity - 1);
+      var->next = buckets[idx];
+      buckets[idx] = var;
+      var = next;
+    }
+  }
+  free(vars.buckets);
+  vars.buckets = buckets;
+  vars.capacity = new_capacity;
+}
+
+variable *var_create(const char *name) {
+  variable *var = var_lookup(name);
+  if (var != NULL) return var;
+  if ((vars.size + 1) * 4 > vars.capacity * 3) vars_grow();
+  var = calloc(1, sizeof(variable));
+  assert(var != NULL);
+  var->name = strdup(name);
+  size_t idx = hash_string(name) & (vars.capacity - 1);
+  var->next = vars.buckets[idx];
+  vars.buckets[idx] = var;
+  vars.size ++;
+  return var;
+}
+
+void var_env_changed(variable *var) {
+  free(var->env_entry);
+  var->env_entry = NULL;
+  env_dirty = true;
+}
+
+void var_set(const char *name, const char *value) {
+  variable *var = var_create(name);
+  if (var->value == value) return;
+  if (var->value != NULL && value != NULL && strcmp(var->value, value) == 0) return;
+  free(var->value);
+  var->value = value == NULL ? NULL : strdup(value);
+  if (var->exported) var_env_changed(var);
+}
+
+void var_export(const char *name, bool exported) {
+  variable *var = var_create(name);
+  if (var->exported == exported) return;
+  var->exported = exported;
+  var_env_changed(var);
+}
+
+void var_unset(const char *name) {
+  if (vars.capacity == 0) return;
+  variable **ptr = &vars.buckets[hash_string(name) & (vars.capacity - 1)];
+  while (*ptr != NULL && strcmp((*ptr)->name, name) != 0) ptr = &(*ptr)->next;
+  variable *var = *ptr;
+  if (var == NULL) return;
+  *ptr = var->next;
+  if (var->exported) env_dirty = true;
+  free(var->name);
+  free(var->value);
+  free(var->env_entry);
+  free(var);
+  vars.size --;
+}
+
+void vars_free(void) {
+  for (size_t i = 0; i < vars.capacity; i ++) {
+    variable *var = vars.buckets[i];
+    while (var != NULL) {
+      variable *next = var->next;
+      free(var->name);
+      free(var->value);
+      free(var->env_entry);
+      free(var);
+      var = next;
+    }
+  }
+  free(vars.buckets);
+  vars.buckets = NULL;
+  vars.capacity = 0;
+  vars.size = 0;
+  ARRAY_FREE(env_cache);
+  env_dirty = true;
+}
+
+void vars_import(char **env) {
+  for (char **e = env; *e != NULL; e ++) {
+    char *eq = strchr(*e, '=');
+    if (eq == NULL || !is_name(*e, eq - *e)) continue;
+    char *name = strndup(*e, eq - *e);
+    var_set(name, eq + 1);
+    var_export(name, true);
+    free(name);
+  }
+}
+
+char **shell_environ(void) {
+  if (!env_dirty) return env_cache.data;
+  env_cache.size = 0;
+  for (size_t i = 0; i < vars.capacity; i ++) {
+    for (variable *var = vars.buckets[i]; var != NULL; var = var->next) {
+      if (!var->exported || var->value == NULL) continue;
+      if (var->env_entry == NULL) {
+        assert(asprintf(&var->env_entry, "%s=%s", var->name, var->value) != -1);
+      }
+      ARRAY_ADD(env_cache, var->env_entry);
+    }
+  }
+  ARRAY_ADD(env_cache, NULL);
+  env_dirty = false;
+  return env_cache.data;
+}
+
+// Environment for a single command, with `assigns` ("name=value") overriding
+// the exported variables. Only the returned array needs to be freed.
+char **shell_environ_with(string_array assigns) {
+  char **env = shell_environ();
+  string_array ret = {0};
+  for (size_t i = 0; env[i] != NULL; i ++) {
+    size_t len = strchr(env[i], '=') - env[i] + 1;
+    bool overridden = false;
+    for (size_t a = 0; a < assigns.size && !overridden; a ++) {
+      overridden = strncmp(env[i], assigns.data[a], len) == 0;
+    }
+    if (!overridden) ARRAY_ADD(ret, env[i]);
+  }
+  for (size_t a = 0; a < assigns.size; a ++) {
+    ARRAY_ADD(ret, assigns.data[a]);
+  }
+  ARRAY_ADD(ret, NULL);
+  return ret.data;
+}
+
+// Hash table of names, for functions and hashed commands
+typedef struct table_entry {
+  char *name;
+  void *value;
+  size_t hits;
+  struct table_entry *next;
+} table_entry;
+
+typedef struct {
+  size_t capacity;
+  size_t size;
+  table_entry **buckets;
+} table;
+
+table_entry *table_lookup(table *t, const char *name) {
+  if (t->capacity == 0) return NULL;
+  table_entry *entry = t->buckets[hash_string(name) & (t->capacity - 1)];
+  while (entry != NULL && strcmp(entry->name, name) != 0) entry = entry->next;
+  return entry;
+}
+
+// Finds the entry for `name`, adding an empty one if there isn't one
+table_entry *table_insert(table *t, const char *name) {
+  table_entry *entry = table_lookup(t, name);
+  if (entry != NULL) return entry;
+  if ((t->size + 1) * 4 > t->capacity * 3) {
+    size_t new_capacity = t->capacity == 0 ? 64 : t->capacity * 2;
+    table_entry **buckets = calloc(new_capacity, sizeof(table_entry *));
+    if (buckets == NULL) {
+      perror("table_insert calloc");
+      ABORT();
+    }
+    for (size_t i = 0; i < t->capacity; i ++) {
+      while (t->buckets[i] != NULL) {
+        table_entry *e = t->buckets[i];
+        t->buckets[i] = e->next;
+        size_t idx = hash_string(e->name) & (new_capacity - 1);
+        e->next = buckets[idx];
+        buckets[idx] = e;
+      }
+    }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->capacity = new_capacity;
+  }
+  entry = calloc(1, sizeof(table_entry));
+  assert(entry != NULL);
+  entry->name = strdup(name);
+  size_t idx = hash_string(name) & (t->capacity - 1);
+  entry->next = t->buckets[idx];
+  t->buckets[idx] = entry;
+  t->size ++;
+  return entry;
+}
+
+bool table_remove(table *t, const char *name, void (*free_value)(void *)) {
+  if (t->capacity == 0) return false;
+  table_entry **ptr = &t->buckets[hash_string(name) & (t->capacity - 1)];
+  while (*ptr != NULL && strcmp((*ptr)->name, name) != 0) ptr = &(*ptr)->next;
+  table_entry *entry = *ptr;
+  if (entry == NULL) return false;
+  *ptr = entry->next;
+  free_value(entry->value);
+  free(entry->name);
+  free(entry);
+  t->size --;
+  return true;
+}
+
+void table_clear(table *t, void (*free_value)(void *)) {
+  for (size_t i = 0; i < t->capacity; i ++) {
+    while (t->buckets[i] != NULL) {
+      table_entry *entry = t->buckets[i];
+      t->buckets[i] = entry->next;
+      free_value(entry->value);
+      free(entry->name);
+      free(entry);
+    }
+  }
+  free(t->buckets);
+  *t = (table){0};
+}
+
 
 typedef struct {
   char buffer[4097];
@@ -115,16 +663,263 @@ typedef struct {
   size_t offset;
   int fd;
   bool eof;
+  bool echo;
+  // In-memory source when fd is -1, see read_buffer_string()
+  const char *src;
+  size_t src_size;
+  size_t src_offset;
+  // Bracketed paste, see paste_ingest(). The rest of a paste waiting to be
+  // moved into buffer, the first paste_len bytes of which were pasted, and
+  // where in buffer the pasted bytes are and have been echoed up to
+  char_array paste;
+  size_t paste_offset;
+  size_t paste_len;
+  size_t paste_begin;
+  size_t paste_end;
+  size_t paste_echoed;
 } read_buffer;
 read_buffer stdin_buf = {
   .fd = STDIN_FILENO,
+  .echo = true,
 };
 
+// Where the lexer reads commands from
+read_buffer *input = &stdin_buf;
+
+// With --record, every read of stdin is logged as a line of the microseconds
+// since the shell started and the bytes in hex, for --replay
+FILE *record_file = NULL;
+struct timespec record_start;
+
+uint64_t usec_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+void record_input(const char *data, size_t len) {
+  fprintf(record_file, "%" PRIu64 " ", usec_since(&record_start));
+  for (size_t i = 0; i < len; i ++) fprintf(record_file, "%02x", (unsigned char)data[i]);
+  fputc('\n', record_file);
+  fflush(record_file);
+}
+
+void record_close(void) {
+  if (record_file == NULL) return;
+  fclose(record_file);
+  record_file = NULL;
+}
+
+// Other fds serviced while the shell waits on its terminal input
+typedef struct {
+  int fd;
+  void (*callback)(int fd);
+} event_source;
+ARRAY(event_source) event_sources = {0};
+ARRAY(struct pollfd) event_pollfds = {0};
+
+void event_source_add(int fd, void (*callback)(int fd)) {
+  ARRAY_ADD(event_sources, ((event_source){ .fd = fd, .callback = callback }));
+}
+
+void event_source_remove(int fd) {
+  for (size_t i = 0; i < event_sources.size; i ++) {
+    if (event_sources.data[i].fd == fd) {
+      event_sources.data[i] = event_sources.data[-- event_sources.size];
+      return;
+    }
+  }
+}
+
+// poll() for a single fd, running callbacks of event sources that become
+// ready in the mean time
+int poll_events(struct pollfd *pfd, int timeout) {
+  while (true) {
+    event_pollfds.size = 0;
+    ARRAY_ADD(event_pollfds, *pfd);
+    for (size_t i = 0; i < event_sources.size; i ++) {
+      ARRAY_ADD(event_pollfds, ((struct pollfd){ .fd = event_sources.data[i].fd, .events = POLLIN }));
+    }
+    int p = poll(event_pollfds.data, event_pollfds.size, timeout);
+    if (p <= 0) return p;
+    for (size_t i = 1; i < event_pollfds.size; i ++) {
+      if (event_pollfds.data[i].revents == 0) continue;
+      // callbacks can remove sources, so look it up again
+      for (size_t s = 0; s < event_sources.size; s ++) {
+        if (event_sources.data[s].fd == event_pollfds.data[i].fd) {
+          event_sources.data[s].callback(event_sources.data[s].fd);
+          break;
+        }
+      }
+    }
+    pfd->revents = event_pollfds.data[0].revents;
+    if (pfd->revents != 0) return 1;
+    if (timeout == 0) return 0;
+  }
+}
+
+// What has been echoed since the PS1 prompt was shown, so it can be redrawn
+bool prompt_active = false;
+char_array prompt_line = {0};
+
+read_buffer read_buffer_string(const char *src, size_t size) {
+  return (read_buffer){
+    .fd = -1,
+    .src = src,
+    .src_size = size,
+  };
+}
+
+// Makes room at the end of buffer by dropping what has been read, once that
+// is over half of it or with `all`
+void read_buffer_compact(read_buffer *buf, bool all) {
+  size_t shift = 0;
+  if (buf->offset > 0 && buf->offset == buf->capacity) {
+    shift = buf->offset;
+    buf->offset = 0;
+    buf->capacity = 0;
+  }
+  assert(buf->offset <= buf->capacity);
+  if (buf->offset > 0 && (all || buf->offset > sizeof(buf->buffer) / 2)) {
+    shift = buf->offset;
+    size_t cap = buf->capacity - buf->offset;
+    memmove(buf->buffer, buf->buffer + buf->offset, cap);
+    buf->offset = 0;
+    buf->capacity = cap;
+  }
+  buf->paste_begin = buf->paste_begin > shift ? buf->paste_begin - shift : 0;
+  buf->paste_end = buf->paste_end > shift ? buf->paste_end - shift : 0;
+  buf->paste_echoed = buf->paste_echoed > shift ? buf->paste_echoed - shift : 0;
+}
+
+// Bracketed paste: the terminal sends a paste between ESC[200~ and ESC[201~.
+// The whole of it is read in at once and moved into buffer a block at a
+// time, so a large paste isn't polled for byte by byte, is echoed a block
+// at a time, and its tabs are blanks rather than completions.
+#define PASTE_START "\033[200~"
+#define PASTE_END "\033[201~"
+#define PASTE_MARKER_SIZE 6
+#define PASTE_READ_SIZE 65536
+#define PASTE_TIMEOUT_MS 1000
+
+// Whether paste mode is on at the terminal
+bool paste_enabled = false;
+
+// Only on while the shell reads a command line, so programs it runs never
+// see the markers
+void paste_mode(bool on) {
+  if (old_termios_ptr == NULL || on == paste_enabled) return;
+  printf("%s", on ? "\033[?2004h" : "\033[?2004l");
+  paste_enabled = on;
+}
+
+void paste_free(void) {
+  ARRAY_FREE(stdin_buf.paste);
+}
+
+// Whether the next byte of input was pasted
+bool input_pasted(read_buffer *buf) {
+  return buf->offset >= buf->paste_begin && buf->offset < buf->paste_end;
+}
+
+// Whether some of a paste is still to be read
+bool input_pasting(read_buffer *buf) {
+  return input_pasted(buf) || buf->paste_offset < buf->paste_len;
+}
+
+// Moves as much of the rest of a paste as fits into buffer
+void paste_serve(read_buffer *buf) {
+  size_t n = sizeof(buf->buffer) - buf->capacity - 1;
+  if (n > buf->paste.size - buf->paste_offset) n = buf->paste.size - buf->paste_offset;
+  size_t pasted = buf->paste_offset < buf->paste_len ? buf->paste_len - buf->paste_offset : 0;
+  if (pasted > n) {
+    // Whole lines, so the block is echoed before what its commands print
+    char *nl = memrchr(buf->paste.data + buf->paste_offset, '\n', n);
+    if (nl != NULL) n = nl - (buf->paste.data + buf->paste_offset) + 1;
+    pasted = n;
+  }
+  if (pasted > 0) {
+    if (buf->paste_end != buf->capacity) {
+      buf->paste_begin = buf->capacity;
+      buf->paste_echoed = buf->capacity;
+    }
+    buf->paste_end = buf->capacity + pasted;
+  }
+  memcpy(buf->buffer + buf->capacity, buf->paste.data + buf->paste_offset, n);
+  buf->capacity += n;
+  buf->paste_offset += n;
+  if (buf->paste_offset == buf->paste.size) {
+    buf->paste.size = 0;
+    buf->paste_offset = 0;
+    buf->paste_len = 0;
+  }
+}
+
+// Takes a paste starting in what was just read out of buffer, along with
+// the rest of it from the terminal, and serves the start of it
+void paste_ingest(read_buffer *buf, size_t from) {
+  if (buf->paste_offset < buf->paste.size) return;
+  char *start = memmem(buf->buffer + from, buf->capacity - from, PASTE_START, PASTE_MARKER_SIZE);
+  if (start == NULL) return;
+  size_t at = start - buf->buffer;
+  char_array *paste = &buf->paste;
+  paste->size = 0;
+  char_array_reserve(paste, buf->capacity - at);
+  memcpy(paste->data, start + PASTE_MARKER_SIZE, buf->capacity - at - PASTE_MARKER_SIZE);
+  paste->size = buf->capacity - at - PASTE_MARKER_SIZE;
+  buf->capacity = at;
+  char *end = NULL;
+  size_t scanned = 0;
+  while ((end = memmem(paste->data + scanned, paste->size - scanned, PASTE_END, PASTE_MARKER_SIZE)) == NULL) {
+    if (paste->size >= PASTE_MARKER_SIZE) scanned = paste->size - PASTE_MARKER_SIZE + 1;
+    struct pollfd fd = { .fd = buf->fd, .events = POLLIN };
+    int p = poll(&fd, 1, PASTE_TIMEOUT_MS);
+    if (p == -1 && errno == EINTR) continue;
+    // The end marker never came, take what did as the paste
+    if (p <= 0 || (fd.revents & POLLIN) == 0) break;
+    char_array_reserve(paste, PASTE_READ_SIZE);
+    ssize_t n = read(buf->fd, paste->data + paste->size, PASTE_READ_SIZE);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    if (record_file != NULL) record_input(paste->data + paste->size, n);
+    paste->size += n;
+  }
+  if (end != NULL) {
+    buf->paste_len = end - paste->data;
+    memmove(end, end + PASTE_MARKER_SIZE, paste->size - buf->paste_len - PASTE_MARKER_SIZE);
+    paste->size -= PASTE_MARKER_SIZE;
+  } else {
+    buf->paste_len = paste->size;
+  }
+  buf->paste_offset = 0;
+  if (paste->size == 0) return;
+  read_buffer_compact(buf, true);
+  paste_serve(buf);
+}
 
 bool read_input(read_buffer *buf, bool block) {
   if (buf->eof) return buf->offset < buf->capacity;
   if (block && buf->offset < buf->capacity) return true;
+  if (buf->fd == -1) {
+    if (buf->offset < buf->capacity) return true;
+    size_t n = buf->src_size - buf->src_offset;
+    if (n == 0) {
+      buf->eof = true;
+      return false;
+    }
+    if (n > sizeof(buf->buffer) - 1) n = sizeof(buf->buffer) - 1;
+    memcpy(buf->buffer, buf->src + buf->src_offset, n);
+    buf->src_offset += n;
+    buf->offset = 0;
+    buf->capacity = n;
+    return true;
+  }
   size_t cur_size = buf->capacity - buf->offset;
+  if (cur_size < sizeof(buf->buffer) / 2 && buf->paste_offset < buf->paste.size) {
+    read_buffer_compact(buf, true);
+    paste_serve(buf);
+    return true;
+  }
   if (cur_size < sizeof(buf->buffer) / 2) {
     struct pollfd fd = {
         .fd = buf->fd,
@@ -132,7 +927,7 @@ bool read_input(read_buffer *buf, bool block) {
     };
     int p = 0;
     while (p == 0) {
-      p = poll(&fd, 1, block ? -1 : 0);
+      p = buf == &stdin_buf ? poll_events(&fd, block ? -1 : 0) : poll(&fd, 1, block ? -1 : 0);
       if (p == -1) {
         switch (errno) {
           case EINTR:
@@ -156,29 +951,25 @@ bool read_input(read_buffer *buf, bool block) {
       }
     }
     if ((fd.revents & (POLLIN|POLLHUP)) != 0) {
-      if (buf->offset > 0 && buf->offset == buf->capacity) {
-        buf->offset = 0;
-        buf->capacity = 0;
-      }
-      assert(buf->offset <= buf->capacity);
-      if (buf->offset > sizeof(buf->buffer) / 2) {
-        size_t cap = buf->capacity - buf->offset;
-        memcpy(buf->buffer, buf->buffer + buf->offset, cap);
-        buf->offset = 0;
-      }
+      read_buffer_compact(buf, false);
       ssize_t n = read(buf->fd, buf->buffer + buf->capacity, sizeof(buf->buffer) - buf->capacity - 1);
       if (n < 0) {
         perror("read");
         ABORT();
       }
       if (n == 0) {
-        if (block && (fd.revents & POLLIN) == 0) {
+        // A raw terminal reads nothing when there is no input, anything
+        // else is at its end
+        bool raw_terminal = buf == &stdin_buf && old_termios_ptr != NULL;
+        if (!raw_terminal || (block && (fd.revents & POLLIN) == 0)) {
           buf->eof = true;
           return buf->offset < buf->capacity;
         }
         return !buf->eof || buf->offset < buf->capacity;
       }
+      if (buf == &stdin_buf && record_file != NULL) record_input(buf->buffer + buf->capacity, n);
       buf->capacity += n;
+      if (buf == &stdin_buf && old_termios_ptr != NULL) paste_ingest(buf, buf->capacity - n);
       return true;
     } else if ((fd.revents & (POLLNVAL)) != 0) {
       buf->eof = true;
@@ -192,24 +983,50 @@ bool read_input(read_buffer *buf, bool block) {
 }
 
 char peek_char(read_buffer *buf) {
-  if (buf->eof) return EOF;
   if (!read_input(buf, false)) {
     return EOF; /* Non blocking, should check is_eof() */
   }
-  return buf->eof ? EOF : buf->buffer[buf->offset];
+  return buf->offset < buf->capacity ? buf->buffer[buf->offset] : EOF;
 }
 
 char read_char(read_buffer *buf) {
-  if (buf->eof) return EOF;
   if (!read_input(buf, true)) {
     assert(buf->eof);
     return EOF;
   }
+  // A raw terminal can have nothing to read yet
+  if (buf->offset >= buf->capacity) return EOF;
+  if (buf->echo && input_pasted(buf)) {
+    // The rest of the pasted block in one write
+    if (buf->paste_echoed <= buf->offset) {
+      size_t len = buf->paste_end - buf->offset;
+      const char *text = buf->buffer + buf->offset;
+      fwrite(text, 1, len, stdout);
+      for (size_t i = 0; prompt_active && i < len; i ++) {
+        if (text[i] == '\n') prompt_active = false;
+        else ARRAY_ADD(prompt_line, text[i]);
+      }
+      buf->paste_echoed = buf->paste_end;
+    }
+    return buf->buffer[buf->offset++];
+  }
   char c = buf->buffer[buf->offset++];
-  fprintf(stdout, "%c", c); /* echo */
+  if (buf->echo) {
+    fprintf(stdout, "%c", c); /* echo */
+    if (c == '\n') prompt_active = false;
+    if (prompt_active) ARRAY_ADD(prompt_line, c);
+  }
   return c;
 }
 
+// Echoes text that wasn't typed, such as completions
+void echo_text(const char *text) {
+  printf("%s", text);
+  for (; prompt_active && *text != '\0'; text ++) {
+    ARRAY_ADD(prompt_line, *text);
+  }
+}
+
 bool is_eof(read_buffer *buf) {
   if (read_input(buf, true)) {
     return false;
@@ -253,25 +1070,51 @@ void read_and_drain_buffer(int fd, read_buffer *buf, bool blocking, bool buffer_
     if (!blocking) loop = false;
     size_t to_write = buf->capacity - buf->offset;
     if (to_write == 0) return;
-    size_t orig_write = to_write;
     if (buffer_lines) {
       while (to_write > 0 && buf->buffer[buf->offset + to_write - 1] != '\n') {
         to_write --;
       }
     }
     if (to_write == 0) return;
-    if (buffer_lines && to_write != orig_write) {
-      printf("stripped: |");
-      write(STDOUT_FILENO, buf->buffer + buf->offset + to_write, orig_write - to_write);
-      printf("|\n");
-    }
     // FIXME this could block...
     // Need to poll the write, and check if no POLLERR
     // and if non blocking we just wait?
+    STAT_ADD(STAT_RELAYED_BYTES, to_write);
     drain_buffer_size(fd, buf, to_write, echo);
   }
 }
 
+void prompt2(void);
+void prompt_ps2(bool newline);
+
+// Reads what is available on fd (or everything when blocking) straight into
+// `out`, returns false once fd is at EOF
+bool capture_read(int fd, char_array *out, bool block) {
+  while (true) {
+    struct pollfd pfd = {
+      .fd = fd,
+      .events = POLLIN,
+    };
+    int p = poll(&pfd, 1, block ? -1 : 0);
+    if (p == -1) {
+      if (errno == EINTR) continue;
+      perror("capture poll");
+      ABORT();
+    }
+    if (p == 0) return true;
+    char_array_reserve(out, 65536);
+    ssize_t n = read(fd, out->data + out->size, out->capacity - out->size);
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      perror("capture read");
+      ABORT();
+    }
+    if (n == 0) return false;
+    STAT_ADD(STAT_RELAYED_BYTES, n);
+    out->size += n;
+  }
+}
+
 typedef struct {
   char *match;
   int idx;
@@ -298,35 +1141,106 @@ bool do_completion(str_arr *matches, completion *match) {
   return false;
 }
 
+// Reads up to and including the `close` matching the `open` that is next in
+// the input, appending the raw text to `ret`. Quotes inside are skipped over.
+bool _read_balanced(char_array *ret, char open, char close) {
+  quote_mode quote = UNQUOTED;
+  int depth = 0;
+  while (!is_eof(input)) {
+    char c = peek_char(input);
+    if (c == CTRL_C) {
+      printf("^C\n");
+      input->offset ++;
+      return false;
+    }
+    if (c == '\n') {
+      prompt2();
+      ARRAY_ADD(*ret, c);
+      input->offset ++;
+      continue;
+    }
+    ARRAY_ADD(*ret, read_char(input));
+    switch (quote) {
+      case SINGLE:
+        if (c == '\'') quote = UNQUOTED;
+        break;
+
+      case DOUBLE:
+        if (c == '"') quote = UNQUOTED;
+        else if (c == '\\' && !is_eof(input)) ARRAY_ADD(*ret, read_char(input));
+        break;
+
+      case UNQUOTED:
+        if (c == '\'') quote = SINGLE;
+        else if (c == '"') quote = DOUBLE;
+        else if (c == '\\' && !is_eof(input)) ARRAY_ADD(*ret, read_char(input));
+        else if (c == open) depth ++;
+        else if (c == close && -- depth == 0) return true;
+        break;
+    }
+  }
+  fprintf(stderr, "syntax error: Unexpected EOF while looking for matching `%c'\n", close);
+  return false;
+}
+
 char *_read_arg(const char *delim, bool *quoted, bool *escaped, quote_mode *quote, bool *error, bool first) {
-  ARRAY(char) ret = {0};
+  // Most words fit inline
+  SBO_ARRAY(char, 64) ret;
+  SBO_ARRAY_INIT(ret);
   *escaped = false;
   completion match = {0};
   bool dirty_complete = true;
-  while (!*error && !is_eof(&stdin_buf) && (*quote != UNQUOTED || strchr(delim, peek_char(&stdin_buf)) == NULL)) {
+  while (!*error && !is_eof(input) && (*quote != UNQUOTED || strchr(delim, peek_char(input)) == NULL)) {
     if (!*escaped && *quote == UNQUOTED) {
-      if (ret.size == 1 && ret.data[0] == '>') {
-        if (peek_char(&stdin_buf) == '>') ARRAY_ADD(ret, read_char(&stdin_buf));
+      if (ret.size == 1 && (ret.data[0] == '<' || ret.data[0] == '>') && peek_char(input) == '(') {
+        // <(...) and >(...) are words, for process substitution
+        char_array balanced = {0};
+        bool ok = _read_balanced(&balanced, '(', ')');
+        for (size_t i = 0; i < balanced.size; i ++) SBO_ARRAY_ADD(ret, balanced.data[i]);
+        ARRAY_FREE(balanced);
+        if (!ok) {
+          SBO_ARRAY_FREE(ret);
+          *error = true;
+          return NULL;
+        }
+        continue;
+      } else if (ret.size == 1 && ret.data[0] == '>') {
+        if (peek_char(input) == '>') SBO_ARRAY_ADD(ret, read_char(input));
+        goto end;
+      } else if (ret.size > 0 && ret.data[0] == '<') {
+        // <, <<, <<- and <<<
+        char c = peek_char(input);
+        if ((c == '<' && ret.size < 3 && ret.data[ret.size - 1] == '<') || (c == '-' && ret.size == 2)) {
+          SBO_ARRAY_ADD(ret, read_char(input));
+          continue;
+        }
         goto end;
-      } else if (ret.size > 0 && peek_char(&stdin_buf) == '>') {
+      } else if (ret.size > 0 && (peek_char(input) == '>' || peek_char(input) == '<')) {
         break;
+      } else if (strchr(";&|()", peek_char(input)) != NULL) {
+        if (ret.size > 0) break;
+        // ;, ;;, &, &&, |, ||, ( and )
+        char c = read_char(input);
+        SBO_ARRAY_ADD(ret, c);
+        if (strchr(";&|", c) != NULL && peek_char(input) == c) SBO_ARRAY_ADD(ret, read_char(input));
+        goto end;
       }
     }
     *escaped = false;
-    if (peek_char(&stdin_buf) != '\t') dirty_complete = true;
+    if (peek_char(input) != '\t') dirty_complete = true;
 
-    switch (peek_char(&stdin_buf)) {
+    switch (peek_char(input)) {
       case EOF:
         UNREACHABLE();
-        ARRAY_FREE(ret);
+        SBO_ARRAY_FREE(ret);
         *error = true;
         return NULL;
         break;
 
       case CTRL_C: {
         printf("^C\n");
-        stdin_buf.offset++;
-        ARRAY_FREE(ret);
+        input->offset++;
+        SBO_ARRAY_FREE(ret);
         *error = true;
         return NULL;
       }; break;
@@ -336,7 +1250,13 @@ char *_read_arg(const char *delim, bool *quoted, bool *escaped, quote_mode *quot
       }; break;
 
       case '\t': {
-        stdin_buf.offset++;
+        if (input_pasted(input)) {
+          // A pasted tab is a blank, or itself within quotes
+          if (*quote == UNQUOTED) goto end;
+          SBO_ARRAY_ADD(ret, '\t');
+          break;
+        }
+        input->offset++;
         if (first) {
           // may not need to generate if cycling?
           str_arr matches = {0};
@@ -346,7 +1266,7 @@ char *_read_arg(const char *delim, bool *quoted, bool *escaped, quote_mode *quot
             }
           }
           size_t cmd_start = matches.size;
-          char *path = getenv("PATH");
+          char *path = var_get("PATH");
           if (path != NULL) {
             char *p = path;
             while (*p != '\0') {
@@ -383,9 +1303,10 @@ char *_read_arg(const char *delim, bool *quoted, bool *escaped, quote_mode *quot
           if (dirty_complete) match.idx = -1;
           if (do_completion(&matches, &match)) {
             if (match.idx == -1) {
-              printf("%s ", match.match + ret.size);
+              echo_text(match.match + ret.size);
+              echo_text(" ");
               ret.size = strlen(match.match) + 1;
-              ARRAY_ENSURE_CAPACITY(ret, ret.size);
+              SBO_ARRAY_ENSURE_CAPACITY(ret, ret.size);
               strncpy(ret.data, match.match, ret.size);
               // builtin matches are not allocated, commands after it are
               for (size_t i = cmd_start; i < matches.size; i ++) {
@@ -412,12 +1333,12 @@ char *_read_arg(const char *delim, bool *quoted, bool *escaped, quote_mode *quot
       case '\\': {
         switch (*quote) {
           case DOUBLE: {
-            read_char(&stdin_buf);
+            read_char(input);
 check_double_escape:
-            if (!is_eof(&stdin_buf)) switch (peek_char(&stdin_buf)) {
+            if (!is_eof(input)) switch (peek_char(input)) {
               case EOF:
                 UNREACHABLE();
-                ARRAY_FREE(ret);
+                SBO_ARRAY_FREE(ret);
                 *error = true;
                 return NULL;
                 break;
@@ -425,24 +1346,22 @@ check_double_escape:
               case CTRL_C: {
                 *error = true;
                 printf("^C\n");
-                stdin_buf.offset ++;
-                ARRAY_FREE(ret);
+                input->offset ++;
+                SBO_ARRAY_FREE(ret);
                 return NULL;
               }; break;
 
               case CTRL_D: {
                 printf("\a");
-                stdin_buf.offset ++;
+                input->offset ++;
                 goto check_double_escape;
               }; break;
 
               case '\n':
-                // FIXME read PS2
-                printf("\n> ");
+                prompt2();
                 *escaped = true;
-                // consume with no echo
-                ARRAY_ADD(ret, peek_char(&stdin_buf));
-                stdin_buf.offset ++;
+                // line continuation, consume with no echo
+                input->offset ++;
                 continue;
 
               case '\\':
@@ -450,50 +1369,51 @@ check_double_escape:
               case '"':
               case '>':
                 *escaped = true;
-                ARRAY_ADD(ret, read_char(&stdin_buf));
+                SBO_ARRAY_ADD(ret, '\\');
+                SBO_ARRAY_ADD(ret, read_char(input));
                 continue;
 
               default:
                 *escaped = true;
-                ARRAY_ADD(ret, '\\');
-                ARRAY_ADD(ret, peek_char(&stdin_buf));
+                SBO_ARRAY_ADD(ret, '\\');
+                SBO_ARRAY_ADD(ret, peek_char(input));
                 break;
             }
           }; break;
 
           case SINGLE:
-            ARRAY_ADD(ret, peek_char(&stdin_buf));
+            SBO_ARRAY_ADD(ret, peek_char(input));
             break;
 
           case UNQUOTED: {
-            read_char(&stdin_buf);
+            read_char(input);
 check_unquoted_escape:
-            if (!is_eof(&stdin_buf)) switch (peek_char(&stdin_buf)) {
+            if (!is_eof(input)) switch (peek_char(input)) {
               case EOF:
                 break;
 
               case CTRL_C: {
                 *error = true;
                 printf("^C\n");
-                stdin_buf.offset ++;
-                ARRAY_FREE(ret);
+                input->offset ++;
+                SBO_ARRAY_FREE(ret);
                 return NULL;
               }; break;
 
               case CTRL_D: {
                 printf("\a");
-                stdin_buf.offset ++;
+                input->offset ++;
                 goto check_unquoted_escape;
               }; break;
 
               case '\n':
-                // FIXME read PS2
-                printf("\n> ");
-                stdin_buf.offset ++;
+                prompt2();
+                input->offset ++;
                 continue;
 
               default:
-                ARRAY_ADD(ret, peek_char(&stdin_buf));
+                SBO_ARRAY_ADD(ret, '\\');
+                SBO_ARRAY_ADD(ret, peek_char(input));
                 break;
             }
           }; break;
@@ -505,6 +1425,8 @@ check_unquoted_escape:
       }; break;
 
       case '"': {
+        // quotes are kept, expand_word() removes them
+        SBO_ARRAY_ADD(ret, '"');
         switch (*quote) {
           case UNQUOTED:
             *quote = DOUBLE;
@@ -512,7 +1434,6 @@ check_unquoted_escape:
             break;
 
           case SINGLE:
-            ARRAY_ADD(ret, '"');
             break;
 
           case DOUBLE:
@@ -526,6 +1447,7 @@ check_unquoted_escape:
       }; break;
 
       case '\'': {
+        SBO_ARRAY_ADD(ret, '\'');
         switch (*quote) {
           case UNQUOTED:
             *quote = SINGLE;
@@ -537,7 +1459,6 @@ check_unquoted_escape:
             break;
 
           case DOUBLE:
-            ARRAY_ADD(ret, '\'');
             break;
 
           default:
@@ -546,22 +1467,61 @@ check_unquoted_escape:
         }
       }; break;
 
+      case '$': {
+        SBO_ARRAY_ADD(ret, read_char(input));
+        if (*quote != SINGLE && !is_eof(input) && (peek_char(input) == '{' || peek_char(input) == '(')) {
+          bool paren = peek_char(input) == '(';
+          char_array balanced = {0};
+          bool ok = _read_balanced(&balanced, paren ? '(' : '{', paren ? ')' : '}');
+          for (size_t i = 0; i < balanced.size; i ++) SBO_ARRAY_ADD(ret, balanced.data[i]);
+          ARRAY_FREE(balanced);
+          if (!ok) {
+            SBO_ARRAY_FREE(ret);
+            *error = true;
+            return NULL;
+          }
+        }
+        continue;
+      }; break;
+
+      case '`': {
+        SBO_ARRAY_ADD(ret, read_char(input));
+        if (*quote == SINGLE) continue;
+        while (!is_eof(input) && peek_char(input) != '`') {
+          if (peek_char(input) == '\n') {
+            prompt2();
+            SBO_ARRAY_ADD(ret, '\n');
+            input->offset ++;
+            continue;
+          }
+          char c = read_char(input);
+          SBO_ARRAY_ADD(ret, c);
+          if (c == '\\' && !is_eof(input)) SBO_ARRAY_ADD(ret, read_char(input));
+        }
+        if (is_eof(input)) {
+          fprintf(stderr, "syntax error: Unexpected EOF while looking for matching backquote << ` >>\n");
+          SBO_ARRAY_FREE(ret);
+          *error = true;
+          return NULL;
+        }
+        SBO_ARRAY_ADD(ret, '`');
+      }; break;
+
       case '\n':
-        // FIXME read PS2
-        printf("\n> ");
-        ARRAY_ADD(ret, peek_char(&stdin_buf));
-        stdin_buf.offset ++;
+        prompt2();
+        SBO_ARRAY_ADD(ret, peek_char(input));
+        input->offset ++;
         continue;
 
       default:
-        ARRAY_ADD(ret, peek_char(&stdin_buf));
+        SBO_ARRAY_ADD(ret, peek_char(input));
         break;
     }
-    if (!*error) read_char(&stdin_buf);
+    if (!*error) read_char(input);
   }
 end:
-  if (*quote != UNQUOTED && is_eof(&stdin_buf)) {
-    ARRAY_FREE(ret);
+  if (*quote != UNQUOTED && is_eof(input)) {
+    SBO_ARRAY_FREE(ret);
     switch (*quote) {
       case SINGLE:
         fprintf(stderr, "syntax error: Unexpected EOF while looking for matching single quote << ' >>\n");
@@ -581,7 +1541,8 @@ end:
     return NULL;
   }
   assert(*quote == UNQUOTED);
-  ARRAY_ADD(ret, '\0');
+  SBO_ARRAY_ADD(ret, '\0');
+  SBO_ARRAY_DETACH(ret);
   return ret.data;
 }
 
@@ -596,23 +1557,38 @@ void passwd_free(passwd_t *pass) {
     .home = (dir) \
 }
 
-char *_read_tilde_arg(const char *delim, bool *quoted, bool *escaped, quote_mode *quote, bool *error, bool first) {
-  assert(*quote == UNQUOTED);
-  assert(read_char(&stdin_buf) == '~');
-
-start_read_tilde_arg:
-  assert(!is_eof(&stdin_buf));
+// Escapes `s` so that expand_word() gives it back unchanged, followed by the
+// already raw `rest`.
+char *raw_quote(const char *s, const char *rest) {
+  char_array ret = {0};
+  for (; *s != '\0'; s ++) {
+    if (!isalnum((unsigned char)*s) && strchr("/._-+,:@%", *s) == NULL) ARRAY_ADD(ret, '\\');
+    ARRAY_ADD(ret, *s);
+  }
+  for (; *rest != '\0'; rest ++) {
+    ARRAY_ADD(ret, *rest);
+  }
+  ARRAY_ADD(ret, '\0');
+  return ret.data;
+}
+
+char *_read_tilde_arg(const char *delim, bool *quoted, bool *escaped, quote_mode *quote, bool *error, bool first) {
+  assert(*quote == UNQUOTED);
+  assert(read_char(input) == '~');
+
+start_read_tilde_arg:
+  assert(!is_eof(input));
   struct passwd *passwd = NULL;
 
-  if (peek_char(&stdin_buf) == '\0' || strchr(delim, peek_char(&stdin_buf)) != NULL) {
-    char *home = getenv("HOME");
+  if (peek_char(input) == '\0' || strchr(delim, peek_char(input)) != NULL) {
+    char *home = var_get("HOME");
     if (home == NULL) {
       return strdup("~");
     }
-    return strdup(home);
+    return raw_quote(home, "");
   }
 
-  switch (peek_char(&stdin_buf)) {
+  switch (peek_char(input)) {
     case EOF:
       *error = true;
       break;
@@ -620,20 +1596,20 @@ start_read_tilde_arg:
     case CTRL_C: {
       *error = true;
       printf("^C\n");
-      stdin_buf.offset ++;
+      input->offset ++;
       return NULL;
     }; break;
 
     case CTRL_D: {
       printf("\a");
-      stdin_buf.offset ++;
+      input->offset ++;
       goto start_read_tilde_arg;
     }; break;
 
     case '/': {
       char *arg = _read_arg(delim, quoted, escaped, quote, error, first);
       if (*error || arg == NULL) return NULL;
-      char *home = getenv("HOME");
+      char *home = var_get("HOME");
       if (home == NULL) {
         size_t arg_len = strlen(arg);
         char *ret = malloc(arg_len + 2);
@@ -643,13 +1619,7 @@ start_read_tilde_arg:
         free(arg);
         return ret;
       }
-      size_t len = strlen(home);
-      size_t arg_len = strlen(arg);
-      char *full_path = malloc(len + arg_len + 1);
-      assert(full_path != NULL);
-      strcpy(full_path, home);
-      strcpy(full_path + len, arg);
-      full_path[len + arg_len] = '\0';
+      char *full_path = raw_quote(home, arg);
       free(arg);
       return full_path;
     }; break;
@@ -677,27 +1647,27 @@ start_read_tilde_arg:
       ARRAY(char) username = {0};
       bool dirty_complete = true;
       completion match = {0};
-      while (!is_eof(&stdin_buf) &&
-          peek_char(&stdin_buf) != '\0' &&
-          peek_char(&stdin_buf) != '/' &&
-          strchr(delim, peek_char(&stdin_buf)) == NULL) {
-        if (peek_char(&stdin_buf) != '\t') dirty_complete = true;
-        if (iscntrl(peek_char(&stdin_buf))) {
-          switch (peek_char(&stdin_buf)) {
+      while (!is_eof(input) &&
+          peek_char(input) != '\0' &&
+          peek_char(input) != '/' &&
+          strchr(delim, peek_char(input)) == NULL) {
+        if (peek_char(input) != '\t') dirty_complete = true;
+        if (iscntrl(peek_char(input))) {
+          switch (peek_char(input)) {
             case CTRL_C:
               *error = true;
               printf("^C\n");
-              stdin_buf.offset ++;
+              input->offset ++;
               ARRAY_FREE(username);
               return NULL;
 
             case CTRL_D:
               printf("\a");
-              stdin_buf.offset ++;
+              input->offset ++;
               continue;
 
             case '\t': {
-              stdin_buf.offset ++;
+              input->offset ++;
               str_arr matches = {0};
               for (size_t i = 0; i < users.size; i ++) {
                 if (strncmp(username.data, users.data[i]->username, username.size) == 0) {
@@ -708,7 +1678,7 @@ start_read_tilde_arg:
               if (do_completion(&matches, &match)) {
                 if (match.idx == -1) {
                   // FIXME in bash, if user has home folder, completes to ~user/, if not, then ~userSPACE
-                  printf("%s", match.match + username.size);
+                  echo_text(match.match + username.size);
                   username.size = strlen(match.match) + 1;
                   ARRAY_ENSURE_CAPACITY(username, username.size);
                   strncpy(username.data, match.match, username.size);
@@ -722,33 +1692,27 @@ start_read_tilde_arg:
             }; break;
 
             default:
-              printf("Code %d\n", peek_char(&stdin_buf));
+              printf("Code %d\n", peek_char(input));
               UNIMPLEMENTED("Unhandled cntrl char in ~user");
           }
         }
-        ARRAY_ADD(username, read_char(&stdin_buf));
+        ARRAY_ADD(username, read_char(input));
       }
 tilde_end:
       for (size_t i = 0; i < users.size; i ++) {
         size_t len = strlen(users.data[i]->username);
         if (len == username.size && strncmp(username.data, users.data[i]->username, len) == 0) {
-          if (peek_char(&stdin_buf) == '\0' || strchr(delim, peek_char(&stdin_buf)) != NULL) {
+          if (peek_char(input) == '\0' || strchr(delim, peek_char(input)) != NULL) {
             char *ret = strdup(users.data[i]->username);
             ARRAY_FREE(username);
             passwd_array_free(users);
             return ret;
           }
 
-          if (peek_char(&stdin_buf) == '/') {
+          if (peek_char(input) == '/') {
             char *arg = _read_arg(delim, quoted, escaped, quote, error, first);
             if (*error || arg == NULL) return NULL;
-            size_t dir_len = strlen(users.data[i]->home);
-            size_t arg_len = strlen(arg);
-            char *full_path = malloc(dir_len + arg_len + 1);
-            assert(full_path != NULL);
-            strcpy(full_path, users.data[i]->home);
-            strcpy(full_path + dir_len, arg);
-            full_path[dir_len + arg_len] = '\0';
+            char *full_path = raw_quote(users.data[i]->home, arg);
             free(arg);
             ARRAY_FREE(username);
             passwd_array_free(users);
@@ -784,28 +1748,29 @@ char *read_arg(const char *delim, bool *quoted, bool *escaped, quote_mode *quote
   *quoted = false;
 
 start_read_arg:
-  while (!is_eof(&stdin_buf) &&
-      peek_char(&stdin_buf) != '\n' &&
-      strchr(delim, peek_char(&stdin_buf)) != NULL) {
-    read_char(&stdin_buf);
+  while (!is_eof(input) &&
+      peek_char(input) != '\n' &&
+      strchr(delim, peek_char(input)) != NULL) {
+    read_char(input);
   }
 
-  switch (peek_char(&stdin_buf)) {
+  switch (peek_char(input)) {
     case CTRL_C: {
       printf("^C\n");
-      stdin_buf.offset ++;
+      input->offset ++;
+      *error = true;
       return NULL;
     }; break;
 
     case CTRL_D: {
       if (first) {
         printf("\n");
-        stdin_buf.offset = stdin_buf.capacity;
-        stdin_buf.eof = true;
+        input->offset = input->capacity;
+        input->eof = true;
         return NULL;
       } else {
         printf("\a");
-        stdin_buf.offset ++;
+        input->offset ++;
         goto start_read_arg;
       }
     }; break;
@@ -814,7 +1779,7 @@ start_read_arg:
       return _read_tilde_arg(delim, quoted, escaped, quote, error, first);
 
     case '\n':
-      read_char(&stdin_buf);
+      read_char(input);
       // fall through
     case EOF:
       return NULL;
@@ -823,7 +1788,7 @@ start_read_arg:
       // TODO if first, then display a list of builtins
       // if not first, then complete anything
       printf("\a");
-      stdin_buf.offset ++;
+      input->offset ++;
       goto start_read_arg;
     }; break;
 
@@ -834,514 +1799,8094 @@ start_read_arg:
   return NULL;
 }
 
-extern char **environ;
-int run_program(char *file_path, string_array args) {
-  ARRAY(char *) argv = {0};
-  for (size_t i = 0; i < args.size; i ++) {
-    ARRAY_ADD(argv, args.data[i]);
-  }
-  ARRAY_ADD(argv, NULL);
-  int stdin_pipe[2];
-  int stdout_pipe[2];
-  int stderr_pipe[2];
-  if (pipe(stdin_pipe) != 0) { perror("pipe stdin"); ABORT(); }
-  if (pipe(stdout_pipe) != 0) { perror("pipe stdout"); ABORT(); }
-  if (pipe(stderr_pipe) != 0) { perror("pipe stderr"); ABORT(); }
-  pid_t pid = fork();
-  switch (pid) {
-    case -1:
-      perror("fork");
-      ABORT();
-      UNREACHABLE();
-      return -1;
-
-    case 0:
-      // FIXME get stdin working, pipe maybe
-      if (close(stdin_pipe[1]) == -1) { perror("child close stdin_pipe[1]"); ABORT(); }
-      if (close(stdout_pipe[0]) == -1) { perror("child close stdout_pipe[0]"); ABORT(); }
-      if (close(stderr_pipe[0]) == -1) { perror("child close stderr_pipe[0]"); ABORT(); }
-      if (dup2(stdin_pipe[0], STDIN_FILENO) == -1) { perror("child dup2 stdin"); ABORT(); }
-      if (dup2(stdout_pipe[1], STDOUT_FILENO) == -1) { perror("child dup2 stdout"); ABORT(); }
-      if (dup2(stderr_pipe[1], STDERR_FILENO) == -1) { perror("child dup2 stderr"); ABORT(); }
-      for (size_t i = 0; i < files.size; i ++) {
-        if (files.data[i] != NULL) {
-          int fd = fileno(files.data[i]);
-          close(i);
-          if (dup2(fd, i) == -1) { perror("child dup2 files"); ABORT(); }
-        }
-      }
-      if (execve(file_path, argv.data, environ) == -1) {
-        perror("execve");
-        abort();
-      }
-      UNREACHABLE();
-      return -1;
-
-    default: {
-      ARRAY_FREE(argv);
-      if (close(stdin_pipe[0]) == -1) { perror("parent close stdin_pipe[0]"); ABORT(); }
-      if (close(stdout_pipe[1]) == -1) { perror("parent close stdout_pipe[1]"); ABORT(); }
-      if (close(stderr_pipe[1]) == -1) { perror("parent close stderr_pipe[1]"); ABORT(); }
-      int wstatus = 0;
-      pid_t wait_ret;
-      bool eof = false;
-      read_buffer child_stdout_buf = {
-        .fd = stdout_pipe[0],
-      };
-      read_buffer child_stderr_buf = {
-        .fd = stderr_pipe[0],
-      };
-      int child_stdin_fd = stdin_pipe[1];
-
-wait_loop:
-      while (true) {
-        wait_ret = waitpid(pid, &wstatus, WNOHANG);
-        if (wait_ret == -1) {
-          switch (errno) {
-            case EAGAIN:
-              continue;
-
-            case ECHILD:
-              goto wait_loop;
+typedef enum {
+  GLOB_LITERAL,
+  GLOB_ANY,
+  GLOB_STAR,
+  GLOB_CLASS,
+} glob_op_type;
 
-            default:
-              perror("waitpid(pid, &status, WNOHANG)");
-              ABORT();
-          }
-        }
-        if (wait_ret != 0) break;
+typedef struct {
+  glob_op_type type;
+  size_t offset; // GLOB_LITERAL: text is component.text + offset
+  size_t len;
+  uint8_t set[32]; // GLOB_CLASS: bitmap of matching bytes
+} glob_op;
 
-        // FIXME Check if write eof as well
-        if (!eof && read_input(&stdin_buf, false)) {
-          size_t to_write = stdin_buf.capacity - stdin_buf.offset;
-          for (size_t i = 0; i < to_write; i ++) {
-            switch (stdin_buf.buffer[stdin_buf.offset + i]) {
-              case CTRL_C: {
-                // Write what was read up to the ^C out, then signal. Continue loop from the byte after this
-                // FIXME handle write errors?, and blocking
-                // Check a poll in a function, and check for POLLERR
-                if (i > 0) drain_buffer_size(child_stdin_fd, &stdin_buf, i - 1, true);
-                stdin_buf.offset ++;
-                to_write = stdin_buf.capacity - stdin_buf.offset;
-                i = 0;
-                if (kill(pid, SIGINT) == -1) {
-                  perror("kill sigint");
-                  ABORT();
-                }
-              }; break;
+typedef struct {
+  ARRAY(glob_op) ops;
+  char *text;       // unescaped literal characters of the component
+  bool literal;     // no wildcards, text is the whole name
+  bool recursive;   // **
+  bool match_dot;   // starts with a '.', so hidden names can match
+  size_t min_len;   // shortest name that could match
+  size_t suffix;    // length of the literal text the name must end with
+} glob_component;
 
-              case CTRL_D: {
-                // Write out up to here, set EOF
-                // FIXME handle write errors, and blocking
-                if (i > 0) drain_buffer_size(child_stdin_fd, &stdin_buf, i - 1, true);
-                stdin_buf.offset ++;
-                to_write = 0;
-                i = 0;
-                eof = true;
-                while (close(child_stdin_fd) == -1) {
-                  if (errno == EINTR) continue;
-                  perror("parent close stdin");
-                  ABORT();
-                  break;
-                }
-              }; break;
-            }
+typedef struct {
+  char *source;
+  ARRAY(glob_component) components;
+  bool absolute;
+  bool dirs_only;   // pattern ended with a '/'
+} glob_pattern;
+
+// Parses a bracket expression after the '[' at p[0], returning the index after
+// the closing ']', or 0 if there isn't one.
+size_t glob_compile_class(const char *p, uint8_t set[32]) {
+  static const struct {
+    const char *name;
+    int (*is)(int);
+  } classes[] = {
+    { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+    { "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+    { "lower", islower }, { "print", isprint }, { "punct", ispunct },
+    { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+  };
+  memset(set, 0, 32);
+  size_t i = 1;
+  bool negate = p[i] == '!' || p[i] == '^';
+  if (negate) i ++;
+  bool first = true;
+  while (p[i] != '\0' && (first || p[i] != ']')) {
+    first = false;
+    if (p[i] == '[' && p[i + 1] == ':') {
+      const char *end = strstr(p + i + 2, ":]");
+      bool found = false;
+      for (size_t c = 0; end != NULL && c < sizeof(classes) / sizeof(classes[0]); c ++) {
+        if (strlen(classes[c].name) == (size_t)(end - p - i - 2) && strncmp(classes[c].name, p + i + 2, end - p - i - 2) == 0) {
+          for (int ch = 1; ch < 256; ch ++) {
+            if (classes[c].is(ch)) set[ch / 8] |= 1 << (ch % 8);
           }
-          // FIXME handle write errors, and blocking
-          if (!eof) drain_buffer_size(child_stdin_fd, &stdin_buf, to_write, true);
+          found = true;
         }
-        read_and_drain_buffer(STDOUT_FILENO, &child_stdout_buf, eof, !eof, false);
-        read_and_drain_buffer(STDERR_FILENO, &child_stderr_buf, eof, !eof, false);
       }
-      read_and_drain_buffer(STDOUT_FILENO, &child_stdout_buf, true, false, false);
-      read_and_drain_buffer(STDERR_FILENO, &child_stderr_buf, true, false, false);
-      if (WIFEXITED(wstatus)) {
-        return WEXITSTATUS(wstatus);
-      } else if (WIFSIGNALED(wstatus)) {
-        return 128 + WTERMSIG(wstatus);
-      } else if (WIFSTOPPED(wstatus)) {
-        return 128 + WSTOPSIG(wstatus);
-      } else {
-        perror("waitpid");
-        fprintf(stderr, "wait returned %d, wstatus = %d\n", wait_ret, wstatus);
+      if (found) {
+        i = end - p + 2;
+        continue;
       }
     }
+    unsigned char lo = p[i];
+    if (lo == '\\' && p[i + 1] != '\0') lo = p[++ i];
+    i ++;
+    unsigned char hi = lo;
+    if (p[i] == '-' && p[i + 1] != ']' && p[i + 1] != '\0') {
+      hi = p[i + 1];
+      if (hi == '\\' && p[i + 2] != '\0') hi = p[++ i + 1];
+      i += 2;
+    }
+    for (unsigned int ch = lo; ch <= hi; ch ++) {
+      set[ch / 8] |= 1 << (ch % 8);
+    }
   }
-  UNREACHABLE();
-  return -1;
+  if (p[i] != ']') return 0;
+  if (negate) {
+    for (size_t b = 0; b < 32; b ++) set[b] = ~set[b];
+  }
+  set['/' / 8] &= ~(1 << ('/' % 8));
+  return i + 1;
 }
 
-
-int help_command(string_array args) {
-  FILE *out = stdout;
-  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
-    out = files.data[STDOUT_FILENO];
-  }
-  FILE *err = stdout;
-  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
-    err = files.data[STDERR_FILENO];
+void glob_compile_component(glob_component *comp, const char *p, size_t len) {
+  char_array text = {0};
+  if (len == 2 && p[0] == '*' && p[1] == '*') {
+    comp->recursive = true;
+    return;
   }
+  for (size_t i = 0; i < len; i ++) {
+    glob_op op = {0};
+    switch (p[i]) {
+      case '*':
+        if (comp->ops.size > 0 && comp->ops.data[comp->ops.size - 1].type == GLOB_STAR) continue;
+        op.type = GLOB_STAR;
+        break;
 
-  if (args.size > 1) {
-    char *arg = args.data[1];
-    for (size_t i = 0; i < builtins.size; i ++) {
-      command_t cmd = builtins.data[i];
-      if (strcmp(cmd.command, arg) == 0) {
+      case '?':
+        op.type = GLOB_ANY;
+        break;
 
-        fprintf(out, "    %-10s - %s\n", cmd.command, cmd.description);
-        return 0;
-      }
+      case '[': {
+        char *class_text = strndup(p + i, len - i);
+        size_t end = glob_compile_class(class_text, op.set);
+        free(class_text);
+        if (end != 0) {
+          op.type = GLOB_CLASS;
+          i += end - 1;
+          break;
+        }
+      }; // fall through
+
+      default:
+        if (p[i] == '\\' && i + 1 < len) i ++;
+        if (comp->ops.size > 0 && comp->ops.data[comp->ops.size - 1].type == GLOB_LITERAL) {
+          comp->ops.data[comp->ops.size - 1].len ++;
+          ARRAY_ADD(text, p[i]);
+          continue;
+        }
+        op.type = GLOB_LITERAL;
+        op.offset = text.size;
+        op.len = 1;
+        ARRAY_ADD(text, p[i]);
+        break;
     }
-    fprintf(err, "%s: Builtin %s not found\n", args.data[0], args.data[1]);
-    return 1;
+    ARRAY_ADD(comp->ops, op);
   }
-  fprintf(out, "Available commands:\n");
-  for (size_t i = 0; i < builtins.size; i ++) {
-    command_t cmd = builtins.data[i];
-    fprintf(out, "    %-10s - %s\n", cmd.command, cmd.description);
+  ARRAY_ADD(text, '\0');
+  comp->text = text.data;
+  comp->match_dot = comp->text[0] == '.' && comp->ops.size > 0 && comp->ops.data[0].type == GLOB_LITERAL;
+  comp->literal = comp->ops.size == 1 && comp->ops.data[0].type == GLOB_LITERAL;
+  comp->min_len = 0;
+  for (size_t i = 0; i < comp->ops.size; i ++) {
+    glob_op *op = &comp->ops.data[i];
+    comp->min_len += op->type == GLOB_LITERAL ? op->len : op->type == GLOB_STAR ? 0 : 1;
   }
-  return 0;
-}
-
-int exit_command(string_array args) {
-  FILE *err = stdout;
-  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
-    err = files.data[STDERR_FILENO];
+  if (comp->ops.size > 1 && comp->ops.data[comp->ops.size - 1].type == GLOB_LITERAL) {
+    comp->suffix = comp->ops.data[comp->ops.size - 1].len;
   }
+}
 
-  int code = 0;
-  if (args.size > 1) {
-    char *end;
-    code = strtol(args.data[1], &end, 0);
-    if (*end != '\0') {
-      fprintf(err, "%s: numeric argument required\n", args.data[0]);
-      return 1;
+// Compiles a pattern where quoted characters are escaped with a backslash
+glob_pattern *glob_compile(const char *source) {
+  glob_pattern *pattern = calloc(1, sizeof(glob_pattern));
+  assert(pattern != NULL);
+  pattern->source = strdup(source);
+  pattern->absolute = source[0] == '/';
+  const char *p = source;
+  while (*p != '\0') {
+    while (*p == '/') p ++;
+    if (*p == '\0') {
+      pattern->dirs_only = true;
+      break;
     }
-    if (code < 0 || code > 255) {
-      fprintf(err, "%s: exit code must be 0-255\n", args.data[0]);
-      return 1;
+    size_t len = 0;
+    while (p[len] != '\0' && p[len] != '/') {
+      if (p[len] == '\\' && p[len + 1] != '\0') len ++;
+      len ++;
     }
+    glob_component comp = {0};
+    glob_compile_component(&comp, p, len);
+    ARRAY_ADD(pattern->components, comp);
+    p += len;
   }
-  for (size_t i = 0; i < args.size; i ++) {
-    free(args.data[i]);
-    args.data[i] = NULL;
-  }
-  ARRAY_FREE(args);
-  cleanup();
-  exit(code);
-  UNREACHABLE();
-  return 0;
+  return pattern;
 }
 
-int echo_command(string_array args) {
-  FILE *out = stdout;
-  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
-    out = files.data[STDOUT_FILENO];
-  }
-
-  for (size_t i = 1; i < args.size; i ++) {
-    if (i > 1) fprintf(out, " ");
-    fprintf(out, "%s", args.data[i]);
+void glob_free(glob_pattern *pattern) {
+  if (pattern == NULL) return;
+  for (size_t i = 0; i < pattern->components.size; i ++) {
+    ARRAY_FREE(pattern->components.data[i].ops);
+    free(pattern->components.data[i].text);
   }
-  fprintf(out, "\n");
-  return 0;
+  ARRAY_FREE(pattern->components);
+  free(pattern->source);
+  free(pattern);
 }
 
-int type_command(string_array args) {
-  FILE *out = stdout;
-  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
-    out = files.data[STDOUT_FILENO];
-  }
-  FILE *err = stdout;
-  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
-    err = files.data[STDERR_FILENO];
+bool glob_match(const glob_component *comp, const char *name, size_t len) {
+  if (len < comp->min_len) return false;
+  if (name[0] == '.' && !comp->match_dot) return false;
+  if (comp->suffix > 0 && memcmp(name + len - comp->suffix,
+        comp->text + comp->ops.data[comp->ops.size - 1].offset, comp->suffix) != 0) {
+    return false;
   }
+  size_t op = 0;
+  size_t n = 0;
+  size_t star_op = SIZE_MAX;
+  size_t star_n = 0;
+  while (n < len || op < comp->ops.size) {
+    if (op < comp->ops.size) {
+      const glob_op *o = &comp->ops.data[op];
+      switch (o->type) {
+        case GLOB_STAR:
+          star_op = op ++;
+          star_n = n;
+          continue;
 
-  int ret = 0;
-  for (size_t i = 1; i < args.size; i ++) {
-    char *arg = args.data[i];
-    bool found = false;
-    for (size_t b_i = 0; b_i < builtins.size; b_i ++) {
-      if (strcmp(arg, builtins.data[b_i].command) == 0) {
-        fprintf(out, "%s is a shell builtin\n", arg);
-        found = true;
-        break;
-      }
-    }
-    if (found) {
-      continue;
-    }
+        case GLOB_ANY:
+          if (n < len) {
+            op ++;
+            n ++;
+            continue;
+          }
+          break;
 
-    if (strchr(arg, '/') != NULL && access(arg, R_OK | X_OK) == 0) {
-      fprintf(out, "%s is %s\n", arg, arg);
-      continue;
-    }
+        case GLOB_CLASS:
+          if (n < len && (o->set[(unsigned char)name[n] / 8] & (1 << ((unsigned char)name[n] % 8))) != 0) {
+            op ++;
+            n ++;
+            continue;
+          }
+          break;
 
-    char *path = getenv("PATH");
-    if (path != NULL) {
-      char *p = path;
-      while (*p != '\0') {
-        while (*p != '\0' && *p != ':') p ++;
-        char *file_path = NULL;
-        char *path_name = strndup(path, (int)(p - path));
-        assert(asprintf(&file_path, "%s/%s", path_name, arg) != 0);
-        free(path_name);
-        if (access(file_path, R_OK | X_OK) == 0) {
-          fprintf(out, "%s is %s\n", arg, file_path);
-          free(file_path);
-          found = true;
+        case GLOB_LITERAL:
+          if (len - n >= o->len && memcmp(name + n, comp->text + o->offset, o->len) == 0) {
+            op ++;
+            n += o->len;
+            continue;
+          }
           break;
-        }
-        if (*p != '\0') path = ++p;
-        free(file_path);
       }
     }
-    if (found) {
+    if (star_op != SIZE_MAX && star_n < len) {
+      op = star_op + 1;
+      n = ++ star_n;
       continue;
     }
-
-    ret = 1;
-    fprintf(err, "%s: not found\n", arg);
+    return false;
   }
-
-  return ret;
+  return true;
 }
 
-int pwd_command(string_array args) {
-  FILE *out = stdout;
-  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
-    out = files.data[STDOUT_FILENO];
-  }
-  FILE *err = stdout;
-  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
-    err = files.data[STDERR_FILENO];
-  }
+// Recently used compiled patterns, so loops don't recompile them
+#define GLOB_CACHE_SIZE 64
+glob_pattern *glob_cache[GLOB_CACHE_SIZE] = {0};
 
-  if (args.size > 1) {
-    fprintf(err, "pwd: arguments not supported yet\n");
-    return 1;
+glob_pattern *glob_compile_cached(const char *source) {
+  glob_pattern **slot = &glob_cache[hash_string(source) % GLOB_CACHE_SIZE];
+  if (*slot == NULL || strcmp((*slot)->source, source) != 0) {
+    glob_free(*slot);
+    *slot = glob_compile(source);
   }
-
-  char buf[4096] = {0};
-  char *cwd = getcwd(buf, 4096);
-  assert(cwd != NULL);
-  fprintf(out, "%s\n", cwd);
-  return 0;
+  return *slot;
 }
 
-int cd(char *file_path) {
-  if (*file_path == 0) return 0;
-  int ret = chdir(file_path);
-  if (ret < 0) {
-    switch (errno) {
-      case EACCES:
-        fprintf(stderr, "cd: %s: Permission denied\n", file_path);
-        return 1;
-
-      case ENOENT:
-      case ENOTDIR:
-        fprintf(stderr, "cd: %s: No such file or directory\n", file_path);
-        return 1;
+// Patterns of case, matched against the whole word with no special / or .
+typedef struct {
+  char *source;
+  glob_component comp;
+} case_pattern;
+case_pattern case_cache[GLOB_CACHE_SIZE] = {0};
+
+bool case_match(const char *pattern, const char *word) {
+  case_pattern *slot = &case_cache[hash_string(pattern) % GLOB_CACHE_SIZE];
+  if (slot->source == NULL || strcmp(slot->source, pattern) != 0) {
+    free(slot->source);
+    ARRAY_FREE(slot->comp.ops);
+    free(slot->comp.text);
+    slot->comp = (glob_component){0};
+    slot->source = strdup(pattern);
+    glob_compile_component(&slot->comp, pattern, strlen(pattern));
+    if (slot->comp.recursive) {
+      slot->comp = (glob_component){0};
+      glob_compile_component(&slot->comp, "*", 1);
     }
-    assert(false && "Uncaught error occured in chdir");
-    UNREACHABLE();
-    return 1;
+    slot->comp.match_dot = true;
   }
-  return 0;
+  return glob_match(&slot->comp, word, strlen(word));
 }
 
-int cd_command(string_array args) {
-  FILE *err = stdout;
-  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
-    err = files.data[STDERR_FILENO];
+void glob_cache_free(void) {
+  for (size_t i = 0; i < GLOB_CACHE_SIZE; i ++) {
+    glob_free(glob_cache[i]);
+    glob_cache[i] = NULL;
+    free(case_cache[i].source);
+    ARRAY_FREE(case_cache[i].comp.ops);
+    free(case_cache[i].comp.text);
+    case_cache[i] = (case_pattern){0};
   }
+}
 
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+#define GLOB_DIRENT_BUFFER (128 * 1024)
+
+typedef struct {
+  glob_pattern *pattern;
+  char_array path;        // prefix of the current directory, '/' terminated
+  ARRAY(char *) buffers;  // getdents64 buffers, one per directory depth
+  string_array *matches;
+} glob_walk;
+
+void glob_emit(glob_walk *walk, const char *name, size_t len) {
+  size_t prefix = walk->path.size;
+  char *match = malloc(prefix + len + 2);
+  assert(match != NULL);
+  memcpy(match, walk->path.data, prefix);
+  memcpy(match + prefix, name, len);
+  if (walk->pattern->dirs_only) match[prefix + len ++] = '/';
+  match[prefix + len] = '\0';
+  ARRAY_ADD(*walk->matches, match);
+}
+
+// Follows symlinks, as a symlink to a directory can be walked through
+bool glob_is_dir(int dirfd, const char *name, unsigned char type) {
+  if (type == DT_DIR) return true;
+  if (type != DT_LNK && type != DT_UNKNOWN) return false;
+  struct stat st;
+  return fstatat(dirfd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+void glob_walk_dir(glob_walk *walk, int dirfd, size_t index, size_t depth);
+
+void glob_walk_into(glob_walk *walk, int dirfd, const char *name, size_t len, size_t index, size_t depth) {
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) return;
+  size_t prefix = walk->path.size;
+  char_array_reserve(&walk->path, len + 1);
+  memcpy(walk->path.data + prefix, name, len);
+  walk->path.data[prefix + len] = '/';
+  walk->path.size += len + 1;
+  glob_walk_dir(walk, fd, index, depth + 1);
+  walk->path.size = prefix;
+  close(fd);
+}
+
+// Matches components[index...] against the directory dirfd
+void glob_walk_dir(glob_walk *walk, int dirfd, size_t index, size_t depth) {
+  glob_component *comp = &walk->pattern->components.data[index];
+  bool last = index + 1 == walk->pattern->components.size;
+  bool need_dir = !last || walk->pattern->dirs_only;
+
+  if (comp->literal) {
+    // No need to read the directory, the name either exists or not
+    size_t len = strlen(comp->text);
+    if (!last) {
+      glob_walk_into(walk, dirfd, comp->text, len, index + 1, depth);
+      return;
+    }
+    struct stat st;
+    if (fstatat(dirfd, comp->text, &st, need_dir ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && (!need_dir || S_ISDIR(st.st_mode))) {
+      glob_emit(walk, comp->text, len);
+    }
+    return;
+  }
+
+  // ** matches no directories as well
+  if (comp->recursive && !last) {
+    glob_walk_dir(walk, dirfd, index + 1, depth);
+    lseek(dirfd, 0, SEEK_SET);
+  }
+
+  while (walk->buffers.size <= depth) {
+    char *buffer = malloc(GLOB_DIRENT_BUFFER);
+    assert(buffer != NULL);
+    ARRAY_ADD(walk->buffers, buffer);
+  }
+  char *buffer = walk->buffers.data[depth];
+  while (true) {
+    long n = syscall(SYS_getdents64, dirfd, buffer, GLOB_DIRENT_BUFFER);
+    if (n <= 0) break;
+    for (long off = 0; off < n;) {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + off);
+      off += entry->d_reclen;
+      const char *name = entry->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+      size_t len = strlen(name);
+      if (comp->recursive) {
+        if (name[0] == '.') continue;
+        bool is_dir = entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && glob_is_dir(dirfd, name, entry->d_type));
+        if (last && (is_dir || !need_dir)) glob_emit(walk, name, len);
+        // don't follow symlinks, they could loop
+        if (is_dir) glob_walk_into(walk, dirfd, name, len, index, depth);
+        continue;
+      }
+      if (!glob_match(comp, name, len)) continue;
+      if (need_dir && !glob_is_dir(dirfd, name, entry->d_type)) continue;
+      if (last) {
+        glob_emit(walk, name, len);
+      } else {
+        glob_walk_into(walk, dirfd, name, len, index + 1, depth);
+      }
+    }
+  }
+}
+
+// Adds the paths matching `pattern` to `matches`, in directory order
+void glob_expand(glob_pattern *pattern, string_array *matches) {
+  if (pattern->components.size == 0) return;
+  glob_walk walk = {
+    .pattern = pattern,
+    .matches = matches,
+  };
+  int dirfd = open(pattern->absolute ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd == -1) return;
+  if (pattern->absolute) ARRAY_ADD(walk.path, '/');
+  glob_walk_dir(&walk, dirfd, 0, 0);
+  close(dirfd);
+  for (size_t i = 0; i < walk.buffers.size; i ++) {
+    free(walk.buffers.data[i]);
+  }
+  ARRAY_FREE(walk.buffers);
+  ARRAY_FREE(walk.path);
+}
+
+#define EXPAND_NOSPLIT 1
+#define EXPAND_PATTERN 2 // give the pattern form of a single field, for case
+
+typedef struct {
+  string_array *fields;
+  char_array field;
+  char_array pattern; // field with quoted glob characters escaped
+  bool glob;          // an unquoted glob character is in the field
+  bool has_field;     // the current field exists, even if empty (eg from "")
+  bool split_ws;      // the last field was ended by IFS whitespace
+  bool drop_empty;    // "$@" with no parameters, which gives no field
+  int flags;
+} expansion;
+
+void expansion_add(expansion *exp, const char *s, size_t len, bool quoted) {
+  char_array_reserve(&exp->field, len + 1);
+  memcpy(exp->field.data + exp->field.size, s, len);
+  exp->field.size += len;
+  if (!(exp->flags & EXPAND_NOSPLIT) || (exp->flags & EXPAND_PATTERN)) {
+    char_array_reserve(&exp->pattern, len * 2 + 1);
+    for (size_t i = 0; i < len; i ++) {
+      if (strchr("*?[", s[i]) != NULL) {
+        if (quoted) exp->pattern.data[exp->pattern.size ++] = '\\';
+        else exp->glob = true;
+      } else if (s[i] == '\\' || (quoted && s[i] == ']')) {
+        exp->pattern.data[exp->pattern.size ++] = '\\';
+      }
+      exp->pattern.data[exp->pattern.size ++] = s[i];
+    }
+  }
+  exp->has_field = true;
+  exp->split_ws = false;
+}
+
+void expansion_end_field(expansion *exp) {
+  if (exp->drop_empty && exp->field.size == 0) exp->has_field = false;
+  exp->drop_empty = false;
+  if (!exp->has_field) return;
+  if (exp->flags & EXPAND_PATTERN) {
+    ARRAY_ADD(exp->pattern, '\0');
+    ARRAY_ADD(*exp->fields, exp->pattern.data);
+    exp->pattern = (char_array){0};
+    ARRAY_FREE(exp->field);
+    exp->has_field = false;
+    return;
+  }
+  if (exp->glob) {
+    ARRAY_ADD(exp->pattern, '\0');
+    size_t start = exp->fields->size;
+    glob_expand(glob_compile_cached(exp->pattern.data), exp->fields);
+    size_t count = exp->fields->size - start;
+    if (count > 0) {
+      // GLOBSORT=none streams matches into the fields in directory order
+      char *order = var_get("GLOBSORT");
+      if (order == NULL || strcmp(order, "none") != 0) {
+        qsort(exp->fields->data + start, count, sizeof(char *), compare_strings);
+      }
+      ARRAY_FREE(exp->field);
+    }
+  }
+  if (exp->field.data != NULL || !exp->glob) {
+    ARRAY_ADD(exp->field, '\0');
+    ARRAY_ADD(*exp->fields, exp->field.data);
+  }
+  exp->field = (char_array){0};
+  exp->pattern.size = 0;
+  exp->glob = false;
+  exp->has_field = false;
+}
+
+// Adds the result of an expansion, splitting it on IFS unless quoted
+void expansion_add_value(expansion *exp, const char *value, bool quoted) {
+  if (quoted || (exp->flags & EXPAND_NOSPLIT)) {
+    expansion_add(exp, value, strlen(value), quoted);
+    return;
+  }
+  const char *ifs = var_get("IFS");
+  if (ifs == NULL) ifs = " \t\n";
+  for (const char *c = value; *c != '\0'; c ++) {
+    if (strchr(ifs, *c) == NULL) {
+      expansion_add(exp, c, 1, false);
+    } else if (isspace((unsigned char)*c)) {
+      if (exp->has_field) {
+        expansion_end_field(exp);
+        exp->split_ws = true;
+      }
+    } else if (exp->split_ws && !exp->has_field) {
+      // whitespace around a delimiter is part of it
+      exp->split_ws = false;
+    } else {
+      exp->has_field = true;
+      expansion_end_field(exp);
+    }
+  }
+}
+
+bool expand_word(const char *raw, string_array *fields, int flags);
+char *expand_word_single(const char *raw);
+
+// Finds the index of the `close` that matches the `open` at raw[0], or 0
+size_t find_closing(const char *raw, char open, char close) {
+  quote_mode quote = UNQUOTED;
+  int depth = 0;
+  for (size_t i = 0; raw[i] != '\0'; i ++) {
+    switch (quote) {
+      case SINGLE:
+        if (raw[i] == '\'') quote = UNQUOTED;
+        break;
+
+      case DOUBLE:
+        if (raw[i] == '"') quote = UNQUOTED;
+        else if (raw[i] == '\\' && raw[i + 1] != '\0') i ++;
+        break;
+
+      case UNQUOTED:
+        if (raw[i] == '\'') quote = SINGLE;
+        else if (raw[i] == '"') quote = DOUBLE;
+        else if (raw[i] == '\\' && raw[i + 1] != '\0') i ++;
+        else if (raw[i] == open) depth ++;
+        else if (raw[i] == close && -- depth == 0) return i;
+        break;
+    }
+  }
+  return 0;
+}
+
+// Arithmetic for $((...)), ((...)), for ((...)) and let, over 64 bit
+// integers. Expressions are compiled into a tree with constant parts
+// folded, and cached by their text so a loop body only parses them once.
+typedef enum {
+  ARITH_CONST,
+  ARITH_VAR,
+  ARITH_UNARY,
+  ARITH_BINARY,
+  ARITH_TERNARY,
+  ARITH_ASSIGN, // op is AOP_NONE for plain =
+  ARITH_INCDEC, // op is AOP_ADD or AOP_SUB
+  ARITH_COMMA,
+} arith_type;
+
+typedef enum {
+  AOP_NONE,
+  AOP_POW,
+  AOP_MUL,
+  AOP_DIV,
+  AOP_MOD,
+  AOP_ADD,
+  AOP_SUB,
+  AOP_SHL,
+  AOP_SHR,
+  AOP_LT,
+  AOP_LE,
+  AOP_GT,
+  AOP_GE,
+  AOP_EQ,
+  AOP_NE,
+  AOP_BAND,
+  AOP_BXOR,
+  AOP_BOR,
+  AOP_LAND,
+  AOP_LOR,
+  AOP_NEG,
+  AOP_PLUS,
+  AOP_NOT,
+  AOP_BNOT,
+} arith_op;
+
+typedef struct arith_node {
+  arith_type type;
+  arith_op op;
+  int64_t value;  // CONST
+  char *name;     // VAR, ASSIGN and INCDEC
+  bool postfix;   // INCDEC
+  struct arith_node *a, *b, *c;
+} arith_node;
+
+// Binary operators, longest first, with their precedence
+const struct {
+  const char *text;
+  arith_op op;
+  int prec;
+} arith_binary_ops[] = {
+  { "**", AOP_POW, 14 },
+  { "<<", AOP_SHL, 11 }, { ">>", AOP_SHR, 11 },
+  { "<=", AOP_LE, 10 }, { ">=", AOP_GE, 10 },
+  { "==", AOP_EQ, 9 }, { "!=", AOP_NE, 9 },
+  { "&&", AOP_LAND, 5 }, { "||", AOP_LOR, 4 },
+  { "*", AOP_MUL, 13 }, { "/", AOP_DIV, 13 }, { "%", AOP_MOD, 13 },
+  { "+", AOP_ADD, 12 }, { "-", AOP_SUB, 12 },
+  { "<", AOP_LT, 10 }, { ">", AOP_GT, 10 },
+  { "&", AOP_BAND, 8 }, { "^", AOP_BXOR, 7 }, { "|", AOP_BOR, 6 },
+};
+
+typedef struct {
+  const char *text;
+  size_t pos;
+  const char *error;
+  int depth; // of variables whose values are expressions
+} arith_parser;
+
+void arith_free(arith_node *n) {
+  if (n == NULL) return;
+  arith_free(n->a);
+  arith_free(n->b);
+  arith_free(n->c);
+  free(n->name);
+  free(n);
+}
+
+arith_node *arith_new(arith_type type, arith_op op) {
+  arith_node *n = calloc(1, sizeof(arith_node));
+  assert(n != NULL);
+  n->type = type;
+  n->op = op;
+  return n;
+}
+
+// Applies a unary or binary operator, wrapping on overflow like C's
+// unsigned arithmetic rather than leaving it undefined
+bool arith_apply(arith_op op, int64_t x, int64_t y, int64_t *ret, const char **error) {
+  uint64_t ux = (uint64_t)x, uy = (uint64_t)y;
+  switch (op) {
+    case AOP_POW: {
+      if (y < 0) {
+        *error = "exponent less than 0";
+        return false;
+      }
+      uint64_t r = 1;
+      for (; uy > 0; uy >>= 1) {
+        if (uy & 1) r *= ux;
+        ux *= ux;
+      }
+      *ret = (int64_t)r;
+    }; break;
+
+    case AOP_DIV:
+    case AOP_MOD:
+      if (y == 0) {
+        *error = "division by 0";
+        return false;
+      }
+      if (y == -1) *ret = op == AOP_DIV ? (int64_t)(0 - ux) : 0;
+      else *ret = op == AOP_DIV ? x / y : x % y;
+      break;
+
+    case AOP_MUL: *ret = (int64_t)(ux * uy); break;
+    case AOP_ADD: *ret = (int64_t)(ux + uy); break;
+    case AOP_SUB: *ret = (int64_t)(ux - uy); break;
+    case AOP_SHL: *ret = (int64_t)(ux << (uy & 63)); break;
+    case AOP_SHR: *ret = x >> (uy & 63); break;
+    case AOP_LT: *ret = x < y; break;
+    case AOP_LE: *ret = x <= y; break;
+    case AOP_GT: *ret = x > y; break;
+    case AOP_GE: *ret = x >= y; break;
+    case AOP_EQ: *ret = x == y; break;
+    case AOP_NE: *ret = x != y; break;
+    case AOP_BAND: *ret = x & y; break;
+    case AOP_BXOR: *ret = x ^ y; break;
+    case AOP_BOR: *ret = x | y; break;
+    case AOP_LAND: *ret = x && y; break;
+    case AOP_LOR: *ret = x || y; break;
+    case AOP_NEG: *ret = (int64_t)(0 - ux); break;
+    case AOP_PLUS: *ret = x; break;
+    case AOP_NOT: *ret = !x; break;
+    case AOP_BNOT: *ret = ~x; break;
+    case AOP_NONE: *ret = y; break;
+  }
+  return true;
+}
+
+// Folds operators on constants, leaving any that would fail for when the
+// expression is run so the error is reported then
+arith_node *arith_fold(arith_node *n) {
+  if (n->a == NULL || n->a->type != ARITH_CONST) return n;
+  if (n->type == ARITH_TERNARY) {
+    arith_node *ret = n->a->value ? n->b : n->c;
+    if (n->a->value) n->b = NULL;
+    else n->c = NULL;
+    arith_free(n);
+    return ret;
+  }
+  int64_t value = 0;
+  const char *error = NULL;
+  if (n->type == ARITH_UNARY) {
+    if (!arith_apply(n->op, n->a->value, 0, &value, &error)) return n;
+  } else if (n->type == ARITH_BINARY && n->b->type == ARITH_CONST) {
+    if (!arith_apply(n->op, n->a->value, n->b->value, &value, &error)) return n;
+  } else if (n->type == ARITH_BINARY && (n->op == AOP_LAND || n->op == AOP_LOR)) {
+    // 0 && x and 1 || x never look at x
+    if ((n->a->value != 0) != (n->op == AOP_LOR)) return n;
+    value = n->op == AOP_LOR;
+  } else {
+    return n;
+  }
+  arith_free(n->a);
+  arith_free(n->b);
+  n->a = n->b = NULL;
+  n->type = ARITH_CONST;
+  n->value = value;
+  return n;
+}
+
+void arith_skip_blanks(arith_parser *p) {
+  while (isspace((unsigned char)p->text[p->pos])) p->pos ++;
+}
+
+size_t arith_name_length(const char *s) {
+  size_t len = 0;
+  while (isalnum((unsigned char)s[len]) || s[len] == '_') len ++;
+  return is_name(s, len) ? len : 0;
+}
+
+// Parses an integer constant: decimal, 0x hex, 0 octal or base#digits
+bool arith_parse_number(const char *s, size_t *len, int64_t *value, const char **error) {
+  size_t i = 0;
+  int base = 10;
+  if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    base = 16;
+    i = 2;
+  } else if (s[0] == '0') {
+    base = 8;
+  } else {
+    size_t j = 0;
+    while (isdigit((unsigned char)s[j])) j ++;
+    if (s[j] == '#') {
+      base = atoi(s);
+      if (base < 2 || base > 64) {
+        *error = "invalid arithmetic base";
+        return false;
+      }
+      i = j + 1;
+    }
+  }
+  uint64_t n = 0;
+  size_t start = i;
+  for (;; i ++) {
+    char c = s[i];
+    int digit;
+    if (isdigit((unsigned char)c)) digit = c - '0';
+    else if (c >= 'a' && c <= 'z') digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'Z') digit = c - 'A' + (base <= 36 ? 10 : 36);
+    else if (c == '@') digit = 62;
+    else if (c == '_') digit = 63;
+    else break;
+    if (digit >= base) {
+      *error = "value too great for base";
+      return false;
+    }
+    n = n * base + digit;
+  }
+  if (i == start && base != 8) {
+    *error = "invalid number";
+    return false;
+  }
+  *len = i;
+  *value = (int64_t)n;
+  return true;
+}
+
+arith_node *arith_parse_comma(arith_parser *p);
+arith_node *arith_parse_assign(arith_parser *p);
+
+arith_node *arith_parse_unary(arith_parser *p) {
+  arith_skip_blanks(p);
+  const char *s = p->text + p->pos;
+  if ((s[0] == '+' || s[0] == '-') && s[1] == s[0]) {
+    p->pos += 2;
+    arith_skip_blanks(p);
+    size_t len = arith_name_length(p->text + p->pos);
+    if (len == 0) {
+      p->error = "syntax error: operand expected";
+      return NULL;
+    }
+    arith_node *n = arith_new(ARITH_INCDEC, s[0] == '+' ? AOP_ADD : AOP_SUB);
+    n->name = strndup(p->text + p->pos, len);
+    p->pos += len;
+    return n;
+  }
+  if (s[0] != '\0' && strchr("+-!~", s[0]) != NULL) {
+    p->pos ++;
+    arith_op op = s[0] == '+' ? AOP_PLUS : s[0] == '-' ? AOP_NEG : s[0] == '!' ? AOP_NOT : AOP_BNOT;
+    arith_node *a = arith_parse_unary(p);
+    if (a == NULL) return NULL;
+    arith_node *n = arith_new(ARITH_UNARY, op);
+    n->a = a;
+    return arith_fold(n);
+  }
+  if (s[0] == '(') {
+    p->pos ++;
+    arith_node *n = arith_parse_comma(p);
+    if (n == NULL) return NULL;
+    arith_skip_blanks(p);
+    if (p->text[p->pos] != ')') {
+      p->error = "missing `)'";
+      arith_free(n);
+      return NULL;
+    }
+    p->pos ++;
+    return n;
+  }
+  if (isdigit((unsigned char)s[0])) {
+    size_t len = 0;
+    int64_t value = 0;
+    if (!arith_parse_number(s, &len, &value, &p->error)) return NULL;
+    if (isalnum((unsigned char)s[len]) || s[len] == '_') {
+      p->error = "invalid number";
+      return NULL;
+    }
+    p->pos += len;
+    arith_node *n = arith_new(ARITH_CONST, AOP_NONE);
+    n->value = value;
+    return n;
+  }
+  size_t len = arith_name_length(s);
+  if (len == 0) {
+    p->error = "syntax error: operand expected";
+    return NULL;
+  }
+  p->pos += len;
+  arith_node *n = arith_new(ARITH_VAR, AOP_NONE);
+  n->name = strndup(s, len);
+  arith_skip_blanks(p);
+  s = p->text + p->pos;
+  if ((s[0] == '+' || s[0] == '-') && s[1] == s[0]) {
+    p->pos += 2;
+    n->type = ARITH_INCDEC;
+    n->op = s[0] == '+' ? AOP_ADD : AOP_SUB;
+    n->postfix = true;
+  }
+  return n;
+}
+
+// The binary operator at the parser, if it isn't part of an assignment
+int arith_peek_binary(arith_parser *p, size_t *len) {
+  arith_skip_blanks(p);
+  const char *s = p->text + p->pos;
+  for (size_t i = 0; i < sizeof(arith_binary_ops) / sizeof(arith_binary_ops[0]); i ++) {
+    size_t n = strlen(arith_binary_ops[i].text);
+    if (strncmp(s, arith_binary_ops[i].text, n) != 0) continue;
+    arith_op op = arith_binary_ops[i].op;
+    bool comparison = op == AOP_LE || op == AOP_GE || op == AOP_EQ || op == AOP_NE;
+    if (s[n] == '=' && !comparison && op != AOP_LAND && op != AOP_LOR) return -1;
+    *len = n;
+    return (int)i;
+  }
+  return -1;
+}
+
+// Binary operators binding at least as tightly as `min_prec`
+arith_node *arith_parse_binary(arith_parser *p, int min_prec) {
+  arith_node *left = arith_parse_unary(p);
+  while (left != NULL) {
+    size_t len = 0;
+    int i = arith_peek_binary(p, &len);
+    if (i == -1 || arith_binary_ops[i].prec < min_prec) break;
+    p->pos += len;
+    int prec = arith_binary_ops[i].prec;
+    // ** is right associative
+    arith_node *right = arith_parse_binary(p, arith_binary_ops[i].op == AOP_POW ? prec : prec + 1);
+    if (right == NULL) {
+      arith_free(left);
+      return NULL;
+    }
+    arith_node *n = arith_new(ARITH_BINARY, arith_binary_ops[i].op);
+    n->a = left;
+    n->b = right;
+    left = arith_fold(n);
+  }
+  return left;
+}
+
+arith_node *arith_parse_ternary(arith_parser *p) {
+  arith_node *cond = arith_parse_binary(p, 4);
+  if (cond == NULL) return NULL;
+  arith_skip_blanks(p);
+  if (p->text[p->pos] != '?') return cond;
+  p->pos ++;
+  arith_node *n = arith_new(ARITH_TERNARY, AOP_NONE);
+  n->a = cond;
+  n->b = arith_parse_comma(p);
+  if (n->b == NULL) {
+    arith_free(n);
+    return NULL;
+  }
+  arith_skip_blanks(p);
+  if (p->text[p->pos] != ':') {
+    p->error = "`:' expected for conditional expression";
+    arith_free(n);
+    return NULL;
+  }
+  p->pos ++;
+  n->c = arith_parse_ternary(p);
+  if (n->c == NULL) {
+    arith_free(n);
+    return NULL;
+  }
+  return arith_fold(n);
+}
+
+arith_node *arith_parse_assign(arith_parser *p) {
+  arith_skip_blanks(p);
+  size_t start = p->pos;
+  size_t len = arith_name_length(p->text + p->pos);
+  if (len > 0) {
+    p->pos += len;
+    arith_skip_blanks(p);
+    const char *s = p->text + p->pos;
+    arith_op op = AOP_NONE;
+    size_t op_len = 0;
+    if (s[0] == '=' && s[1] != '=') {
+      op_len = 1;
+    } else {
+      int i = -1;
+      for (size_t j = 0; j < sizeof(arith_binary_ops) / sizeof(arith_binary_ops[0]) && i == -1; j ++) {
+        size_t n = strlen(arith_binary_ops[j].text);
+        arith_op o = arith_binary_ops[j].op;
+        if (o == AOP_POW || o == AOP_LAND || o == AOP_LOR || (o >= AOP_LT && o <= AOP_NE)) continue;
+        if (strncmp(s, arith_binary_ops[j].text, n) == 0 && s[n] == '=') i = (int)j;
+      }
+      if (i != -1) {
+        op = arith_binary_ops[i].op;
+        op_len = strlen(arith_binary_ops[i].text) + 1;
+      }
+    }
+    if (op_len > 0) {
+      p->pos += op_len;
+      arith_node *value = arith_parse_assign(p);
+      if (value == NULL) return NULL;
+      arith_node *n = arith_new(ARITH_ASSIGN, op);
+      n->name = strndup(p->text + start, len);
+      n->a = value;
+      return n;
+    }
+    p->pos = start;
+  }
+  return arith_parse_ternary(p);
+}
+
+arith_node *arith_parse_comma(arith_parser *p) {
+  arith_node *left = arith_parse_assign(p);
+  while (left != NULL) {
+    arith_skip_blanks(p);
+    if (p->text[p->pos] != ',') break;
+    p->pos ++;
+    arith_node *right = arith_parse_assign(p);
+    if (right == NULL) {
+      arith_free(left);
+      return NULL;
+    }
+    arith_node *n = arith_new(ARITH_COMMA, AOP_NONE);
+    n->a = left;
+    n->b = right;
+    left = n;
+  }
+  return left;
+}
+
+// Compiles a whole expression, an empty one is 0
+arith_node *arith_compile(arith_parser *p) {
+  arith_skip_blanks(p);
+  if (p->text[p->pos] == '\0') return arith_new(ARITH_CONST, AOP_NONE);
+  arith_node *n = arith_parse_comma(p);
+  if (n != NULL && p->text[p->pos] != '\0') {
+    p->error = "syntax error in expression";
+    arith_free(n);
+    return NULL;
+  }
+  return n;
+}
+
+bool arith_eval(arith_parser *p, arith_node *n, int64_t *ret);
+
+// The value of a variable, which may itself be an expression
+bool arith_var(arith_parser *p, const char *name, int64_t *ret) {
+  const char *value = var_get(name);
+  *ret = 0;
+  if (value == NULL) return true;
+  while (isspace((unsigned char)*value)) value ++;
+  if (*value == '\0') return true;
+  // Fast path for plain numbers, which most variables are
+  const char *digits = value + (*value == '-' || *value == '+');
+  size_t len = 0;
+  const char *error = NULL;
+  if (isdigit((unsigned char)*digits) && arith_parse_number(digits, &len, ret, &error)) {
+    size_t end = len;
+    while (isspace((unsigned char)digits[end])) end ++;
+    if (digits[end] == '\0') {
+      if (*value == '-') *ret = (int64_t)(0 - (uint64_t)*ret);
+      return true;
+    }
+  }
+  if (p->depth >= 64) {
+    p->error = "expression recursion level exceeded";
+    return false;
+  }
+  // Compiled every time, the cache may be holding the expression being run
+  arith_parser sub = { .text = value, .depth = p->depth + 1 };
+  arith_node *n = arith_compile(&sub);
+  bool ok = n != NULL && arith_eval(&sub, n, ret);
+  arith_free(n);
+  if (!ok) p->error = sub.error;
+  return ok;
+}
+
+void arith_store(const char *name, int64_t value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%" PRId64, value);
+  var_set(name, buf);
+}
+
+bool arith_eval(arith_parser *p, arith_node *n, int64_t *ret) {
+  int64_t a = 0, b = 0;
+  switch (n->type) {
+    case ARITH_CONST:
+      *ret = n->value;
+      return true;
+
+    case ARITH_VAR:
+      return arith_var(p, n->name, ret);
+
+    case ARITH_UNARY:
+      return arith_eval(p, n->a, &a) && arith_apply(n->op, a, 0, ret, &p->error);
+
+    case ARITH_BINARY:
+      if (!arith_eval(p, n->a, &a)) return false;
+      if (n->op == AOP_LAND || n->op == AOP_LOR) {
+        if ((a != 0) == (n->op == AOP_LOR)) {
+          *ret = a != 0;
+          return true;
+        }
+        if (!arith_eval(p, n->b, &b)) return false;
+        *ret = b != 0;
+        return true;
+      }
+      return arith_eval(p, n->b, &b) && arith_apply(n->op, a, b, ret, &p->error);
+
+    case ARITH_TERNARY:
+      if (!arith_eval(p, n->a, &a)) return false;
+      return arith_eval(p, a ? n->b : n->c, ret);
+
+    case ARITH_ASSIGN:
+      if (!arith_eval(p, n->a, &b)) return false;
+      if (n->op != AOP_NONE && !arith_var(p, n->name, &a)) return false;
+      if (!arith_apply(n->op, a, b, ret, &p->error)) return false;
+      arith_store(n->name, *ret);
+      return true;
+
+    case ARITH_INCDEC:
+      if (!arith_var(p, n->name, &a)) return false;
+      arith_apply(n->op, a, 1, &b, &p->error);
+      *ret = n->postfix ? a : b;
+      arith_store(n->name, b);
+      return true;
+
+    case ARITH_COMMA:
+      return arith_eval(p, n->a, &a) && arith_eval(p, n->b, ret);
+  }
+  UNREACHABLE();
+  return false;
+}
+
+#define ARITH_CACHE_SIZE 64
+struct {
+  char *source;
+  arith_node *root;
+} arith_cache[ARITH_CACHE_SIZE] = {0};
+
+void arith_cache_free(void) {
+  for (size_t i = 0; i < ARITH_CACHE_SIZE; i ++) {
+    free(arith_cache[i].source);
+    arith_free(arith_cache[i].root);
+    arith_cache[i].source = NULL;
+    arith_cache[i].root = NULL;
+  }
+}
+
+// Evaluates an expression that has already been expanded
+bool arith_run(const char *text, int64_t *value, const char **error) {
+  arith_parser p = { .text = text };
+  size_t slot = hash_string(text) % ARITH_CACHE_SIZE;
+  if (arith_cache[slot].source == NULL || strcmp(arith_cache[slot].source, text) != 0) {
+    arith_node *root = arith_compile(&p);
+    if (root == NULL) {
+      *error = p.error;
+      return false;
+    }
+    free(arith_cache[slot].source);
+    arith_free(arith_cache[slot].root);
+    arith_cache[slot].source = strdup(text);
+    arith_cache[slot].root = root;
+  }
+  if (!arith_eval(&p, arith_cache[slot].root, value)) {
+    *error = p.error;
+    return false;
+  }
+  return true;
+}
+
+// Expands and evaluates an arithmetic expression, reporting any error
+bool arith_evaluate(const char *raw, int64_t *value) {
+  char *expanded = NULL;
+  const char *text = raw;
+  if (strpbrk(raw, "$`'\"\\") != NULL) {
+    expanded = expand_word_single(raw);
+    if (expanded == NULL) return false;
+    text = expanded;
+  }
+  const char *error = NULL;
+  bool ok = arith_run(text, value, &error);
+  if (!ok) fprintf(stderr, "%s: %s\n", text, error);
+  free(expanded);
+  return ok;
+}
+
+// Expands $((...)) at raw[0] == '(', returns how much of raw was used, or 0
+// if it isn't arithmetic but a $(...) starting with a subshell
+size_t expand_arithmetic(expansion *exp, const char *raw, bool quoted, bool *error) {
+  size_t end = find_closing(raw, '(', ')');
+  if (end < 3 || raw[end - 1] != ')' || find_closing(raw + 1, '(', ')') != end - 2) return 0;
+  char *text = strndup(raw + 2, end - 3);
+  int64_t value = 0;
+  bool ok = arith_evaluate(text, &value);
+  free(text);
+  if (!ok) {
+    *error = true;
+    return 0;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%" PRId64, value);
+  expansion_add_value(exp, buf, quoted);
+  return end + 1;
+}
+
+int let_command(string_array args) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  if (args.size < 2) {
+    fprintf(err, "%s: expression expected\n", args.data[0]);
+    return 1;
+  }
+  int64_t value = 0;
+  for (size_t i = 1; i < args.size; i ++) {
+    const char *error = NULL;
+    if (!arith_run(args.data[i], &value, &error)) {
+      fprintf(err, "%s: %s: %s\n", args.data[0], args.data[i], error);
+      return 1;
+    }
+  }
+  return value == 0;
+}
+
+// Length of the parameter name at the start of `s`, 0 if there isn't one
+size_t parameter_name_length(const char *s) {
+  if (isdigit((unsigned char)s[0]) || (s[0] != '\0' && strchr("?$#@*!-", s[0]) != NULL)) return 1;
+  size_t len = 0;
+  while (s[len] != '\0' && (isalnum((unsigned char)s[len]) || s[len] == '_')) len ++;
+  return is_name(s, len) ? len : 0;
+}
+
+// Value of a named or special parameter, `buf` is used for numbers
+const char *parameter_value(const char *name, size_t len, char buf[32]) {
+  if (len == 1) {
+    switch (name[0]) {
+      case '?':
+        snprintf(buf, 32, "%d", last_status);
+        return buf;
+
+      case '$':
+        snprintf(buf, 32, "%d", getpid());
+        return buf;
+
+      case '#':
+        snprintf(buf, 32, "%zu", positional.size);
+        return buf;
+
+      case '@':
+      case '*': {
+        // Joined with spaces, for uses that only want one string
+        static char_array joined = {0};
+        joined.size = 0;
+        for (size_t i = 0; i < positional.size; i ++) {
+          if (i > 0) ARRAY_ADD(joined, ' ');
+          size_t n = strlen(positional.data[i]);
+          char_array_reserve(&joined, n);
+          memcpy(joined.data + joined.size, positional.data[i], n);
+          joined.size += n;
+        }
+        ARRAY_ADD(joined, '\0');
+        return joined.data;
+      }
+    }
+  }
+  if (isdigit((unsigned char)name[0])) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i ++) {
+      if (!isdigit((unsigned char)name[i])) return NULL;
+      n = n * 10 + (name[i] - '0');
+      if (n > positional.size) return NULL;
+    }
+    return n == 0 ? shell_name : positional.data[n - 1];
+  }
+  if (!is_name(name, len) || len >= 256) return NULL;
+  char var_name[256];
+  memcpy(var_name, name, len);
+  var_name[len] = '\0';
+  return var_get(var_name);
+}
+
+// Adds $@ or $*. Unquoted, each parameter is split into its own fields.
+// Quoted, "$@" keeps each parameter as a field and "$*" joins them with the
+// first character of IFS.
+void expansion_add_positional(expansion *exp, char c, bool quoted) {
+  if (positional.size == 0) {
+    if (quoted && c == '@') exp->drop_empty = true;
+    return;
+  }
+  const char *ifs = var_get("IFS");
+  for (size_t i = 0; i < positional.size; i ++) {
+    if (i > 0) {
+      if (quoted && (c == '*' || (exp->flags & EXPAND_NOSPLIT))) {
+        if (ifs == NULL) expansion_add(exp, " ", 1, true);
+        else if (*ifs != '\0') expansion_add(exp, ifs, 1, true);
+      } else if (exp->flags & EXPAND_NOSPLIT) {
+        expansion_add(exp, " ", 1, quoted);
+      } else {
+        exp->has_field = true;
+        expansion_end_field(exp);
+      }
+    }
+    expansion_add_value(exp, positional.data[i], quoted);
+  }
+}
+
+// Expands ${...} at raw[0] == '{', returns how much of raw was used, or 0
+size_t expand_braced_parameter(expansion *exp, const char *raw, bool quoted, bool *error) {
+  size_t end = find_closing(raw, '{', '}');
+  if (end == 0) {
+    fprintf(stderr, "bad substitution: no closing `}'\n");
+    *error = true;
+    return 0;
+  }
+  const char *name = raw + 1;
+  bool length = false;
+  if (name[0] == '#' && name + 1 != raw + end) {
+    length = true;
+    name ++;
+  }
+  size_t len = parameter_name_length(name);
+  // ${10} and on
+  if (isdigit((unsigned char)name[0])) {
+    while (isdigit((unsigned char)name[len])) len ++;
+  }
+  const char *op = name + len;
+  if (len == 0 || (length && op != raw + end)) {
+    fprintf(stderr, "${%.*s}: bad substitution\n", (int)(end - 1), raw + 1);
+    *error = true;
+    return 0;
+  }
+  char buf[32];
+  const char *value = parameter_value(name, len, buf);
+  if (length) {
+    snprintf(buf, sizeof(buf), "%zu", value == NULL ? 0 : strlen(value));
+    expansion_add_value(exp, buf, quoted);
+    return end + 1;
+  }
+  if (op == raw + end) {
+    if (len == 1 && (name[0] == '@' || name[0] == '*')) expansion_add_positional(exp, name[0], quoted);
+    else if (value != NULL) expansion_add_value(exp, value, quoted);
+    return end + 1;
+  }
+
+  bool colon = *op == ':';
+  if (colon) op ++;
+  if (*op == '\0' || strchr("-=+?", *op) == NULL) {
+    fprintf(stderr, "${%.*s}: bad substitution\n", (int)(end - 1), raw + 1);
+    *error = true;
+    return 0;
+  }
+  bool set = value != NULL && (!colon || *value != '\0');
+  char *word_raw = strndup(op + 1, raw + end - op - 1);
+  switch (*op) {
+    case '-':
+    case '=':
+      if (set) {
+        expansion_add_value(exp, value, quoted);
+      } else {
+        char *word = expand_word_single(word_raw);
+        if (word == NULL) {
+          *error = true;
+          break;
+        }
+        if (*op == '=') {
+          if (!is_name(name, len)) {
+            fprintf(stderr, "$%.*s: cannot assign in this way\n", (int)len, name);
+            *error = true;
+          } else {
+            char *var_name = strndup(name, len);
+            var_set(var_name, word);
+            free(var_name);
+          }
+        }
+        expansion_add_value(exp, word, quoted);
+        free(word);
+      }
+      break;
+
+    case '+':
+      if (set) {
+        char *word = expand_word_single(word_raw);
+        if (word == NULL) {
+          *error = true;
+          break;
+        }
+        expansion_add_value(exp, word, quoted);
+        free(word);
+      }
+      break;
+
+    case '?':
+      if (set) {
+        expansion_add_value(exp, value, quoted);
+      } else {
+        char *word = expand_word_single(word_raw);
+        fprintf(stderr, "%.*s: %s\n", (int)len, name, word != NULL && *word != '\0' ? word : "parameter null or not set");
+        free(word);
+        *error = true;
+      }
+      break;
+  }
+  free(word_raw);
+  return *error ? 0 : end + 1;
+}
+
+char *command_substitute(const char *text, size_t len);
+
+// Expands $(...) at raw[0] == '(', returns how much of raw was used, or 0
+size_t expand_command_substitution(expansion *exp, const char *raw, bool quoted, bool *error) {
+  size_t end = find_closing(raw, '(', ')');
+  if (end == 0) {
+    fprintf(stderr, "bad substitution: no closing `)'\n");
+    *error = true;
+    return 0;
+  }
+  char *value = command_substitute(raw + 1, end - 1);
+  expansion_add_value(exp, value, quoted);
+  free(value);
+  return end + 1;
+}
+
+char *process_substitute(const char *text, size_t len, bool output);
+
+// Expands <(...) or >(...) at raw[0] into a /dev/fd/N path, returns the
+// index of the closing `)`, or 0
+size_t expand_process_substitution(expansion *exp, const char *raw, bool *error) {
+  size_t end = find_closing(raw + 1, '(', ')');
+  if (end == 0) {
+    fprintf(stderr, "bad substitution: no closing `)'\n");
+    *error = true;
+    return 0;
+  }
+  char *path = process_substitute(raw + 2, end - 1, raw[0] == '>');
+  expansion_add(exp, path, strlen(path), true);
+  free(path);
+  return end + 1;
+}
+
+// Expands `...` at raw[0] == '`', returns how much of raw was used, or 0
+size_t expand_backquote(expansion *exp, const char *raw, bool quoted, bool *error) {
+  char_array text = {0};
+  size_t i = 1;
+  for (; raw[i] != '\0' && raw[i] != '`'; i ++) {
+    if (raw[i] == '\\' && raw[i + 1] != '\0' && strchr("\\`$", raw[i + 1]) != NULL) i ++;
+    ARRAY_ADD(text, raw[i]);
+  }
+  if (raw[i] != '`') {
+    fprintf(stderr, "bad substitution: no closing \"`\"\n");
+    ARRAY_FREE(text);
+    *error = true;
+    return 0;
+  }
+  char *value = command_substitute(text.size == 0 ? "" : text.data, text.size);
+  expansion_add_value(exp, value, quoted);
+  free(value);
+  ARRAY_FREE(text);
+  return i;
+}
+
+// Expands the parameter after a `$`, returns how much of raw was used
+size_t expand_parameter(expansion *exp, const char *raw, bool quoted, bool *error) {
+  if (raw[0] == '{') return expand_braced_parameter(exp, raw, quoted, error);
+  if (raw[0] == '(' && raw[1] == '(') {
+    size_t used = expand_arithmetic(exp, raw, quoted, error);
+    if (used > 0 || *error) return used;
+  }
+  if (raw[0] == '(') return expand_command_substitution(exp, raw, quoted, error);
+  size_t len = parameter_name_length(raw);
+  if (len == 0) {
+    expansion_add(exp, "$", 1, quoted);
+    return 0;
+  }
+  if (len == 1 && (raw[0] == '@' || raw[0] == '*')) {
+    expansion_add_positional(exp, raw[0], quoted);
+    return len;
+  }
+  char buf[32];
+  const char *value = parameter_value(raw, len, buf);
+  if (value != NULL) expansion_add_value(exp, value, quoted);
+  return len;
+}
+
+// Performs parameter expansion and quote removal on a raw word from the
+// lexer, adding the resulting fields to `fields`.
+bool expand_word(const char *raw, string_array *fields, int flags) {
+  expansion exp = {
+    .fields = fields,
+    .flags = flags,
+  };
+  bool error = false;
+  quote_mode quote = UNQUOTED;
+  for (size_t i = 0; raw[i] != '\0' && !error; i ++) {
+    char c = raw[i];
+    switch (quote) {
+      case SINGLE:
+        if (c == '\'') quote = UNQUOTED;
+        else expansion_add(&exp, &c, 1, true);
+        break;
+
+      case DOUBLE:
+        if (c == '"') {
+          quote = UNQUOTED;
+        } else if (c == '\\' && raw[i + 1] != '\0' && strchr("\\$\">`", raw[i + 1]) != NULL) {
+          expansion_add(&exp, &raw[++ i], 1, true);
+        } else if (c == '$') {
+          i += expand_parameter(&exp, raw + i + 1, true, &error);
+        } else if (c == '`') {
+          i += expand_backquote(&exp, raw + i, true, &error);
+        } else {
+          expansion_add(&exp, &c, 1, true);
+        }
+        break;
+
+      case UNQUOTED:
+        if (c == '\'') {
+          quote = SINGLE;
+          exp.has_field = true;
+        } else if (c == '"') {
+          quote = DOUBLE;
+          exp.has_field = true;
+        } else if (c == '\\') {
+          if (raw[i + 1] != '\0') expansion_add(&exp, &raw[++ i], 1, true);
+        } else if (c == '$') {
+          i += expand_parameter(&exp, raw + i + 1, false, &error);
+        } else if (c == '`') {
+          i += expand_backquote(&exp, raw + i, false, &error);
+        } else if ((c == '<' || c == '>') && raw[i + 1] == '(') {
+          i += expand_process_substitution(&exp, raw + i, &error);
+        } else {
+          expansion_add(&exp, &c, 1, false);
+        }
+        break;
+    }
+  }
+  if (!error) expansion_end_field(&exp);
+  ARRAY_FREE(exp.field);
+  ARRAY_FREE(exp.pattern);
+  return !error;
+}
+
+// Expands a word that is always a single field, eg assignments and redirects
+char *expand_word_single(const char *raw) {
+  string_array fields = {0};
+  if (!expand_word(raw, &fields, EXPAND_NOSPLIT)) {
+    for (size_t i = 0; i < fields.size; i ++) {
+      free(fields.data[i]);
+    }
+    ARRAY_FREE(fields);
+    return NULL;
+  }
+  char *ret = fields.size > 0 ? fields.data[0] : strdup("");
+  ARRAY_FREE(fields);
+  return ret;
+}
+
+// A raw word of the form name=value
+bool is_assignment(const char *raw) {
+  const char *eq = strchr(raw, '=');
+  return eq != NULL && is_name(raw, eq - raw);
+}
+
+// Scheduling and resource controls applied to spawned commands between fork
+// and execve, so there's no need for taskset/nice/ionice wrapper processes.
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define MPOL_BIND 2
+
+typedef struct {
+  bool has_cpus;
+  cpu_set_t cpus;
+  bool has_nice;
+  int nice;
+  bool has_ioprio;
+  int ioprio;
+  bool has_numa;
+  unsigned long nodes;
+  bool has_mem;
+  rlim_t mem;
+} spawn_limits;
+
+// Session wide defaults, and the ones for the command run by `run`
+spawn_limits spawn_defaults = {0};
+spawn_limits *spawn_next = NULL;
+
+// Applies limits to the current process, in the child before execve
+void spawn_limits_apply(const spawn_limits *limits) {
+  if (limits->has_cpus && sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) == -1) {
+    perror("sched_setaffinity");
+  }
+  if (limits->has_nice && setpriority(PRIO_PROCESS, 0, limits->nice) == -1) {
+    perror("setpriority");
+  }
+  if (limits->has_ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, limits->ioprio) == -1) {
+    perror("ioprio_set");
+  }
+  if (limits->has_numa && syscall(SYS_set_mempolicy, MPOL_BIND, &limits->nodes, sizeof(limits->nodes) * 8) == -1) {
+    perror("set_mempolicy");
+  }
+  if (limits->has_mem) {
+    struct rlimit lim = { .rlim_cur = limits->mem, .rlim_max = limits->mem };
+    if (prlimit(0, RLIMIT_AS, &lim, NULL) == -1) perror("prlimit");
+  }
+}
+
+// Deadlines for spawned commands, from `timeout` or the session default.
+// The wait loop watches a timerfd for them, so there's no timeout(1) process
+// in between, and the signals go to the command's own process group.
+typedef struct {
+  double duration; // seconds, 0 for no deadline
+  int signal;
+  double kill_after; // seconds after the signal to send SIGKILL, 0 for never
+} timeout_spec;
+
+typedef struct {
+  struct timespec at; // CLOCK_MONOTONIC
+  int signal;
+  double kill_after;
+} deadline;
+
+// Session wide default, and the deadline for commands run by `timeout`
+timeout_spec timeout_defaults = { .signal = SIGTERM };
+deadline *deadline_next = NULL;
+
+typedef struct {
+  int fd;
+  pid_t pid;
+  deadline deadline;
+  int stage; // 0 armed, 1 signalled, 2 killed
+} command_timer;
+
+struct timespec timespec_from(double seconds) {
+  struct timespec ts = { .tv_sec = (time_t)seconds };
+  ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+  return ts;
+}
+
+deadline deadline_after(const timeout_spec *spec) {
+  deadline d = { .signal = spec->signal, .kill_after = spec->kill_after };
+  clock_gettime(CLOCK_MONOTONIC, &d.at);
+  struct timespec add = timespec_from(spec->duration);
+  d.at.tv_sec += add.tv_sec;
+  d.at.tv_nsec += add.tv_nsec;
+  if (d.at.tv_nsec >= 1000000000L) {
+    d.at.tv_sec ++;
+    d.at.tv_nsec -= 1000000000L;
+  }
+  return d;
+}
+
+// The deadline for the next spawned command, if it has one
+bool command_deadline(deadline *d) {
+  if (deadline_next != NULL) {
+    *d = *deadline_next;
+    return true;
+  }
+  if (timeout_defaults.duration <= 0) return false;
+  *d = deadline_after(&timeout_defaults);
+  return true;
+}
+
+// Arms the timer for a child that has been put in its own process group
+void command_timer_start(command_timer *timer, pid_t pid, const deadline *d) {
+  timer->pid = pid;
+  timer->deadline = *d;
+  timer->stage = 0;
+  timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (timer->fd == -1) {
+    perror("timerfd_create");
+    ABORT();
+  }
+  struct itimerspec spec = { .it_value = d->at };
+  // A deadline already passed still has to fire, so never leave it zero
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;
+  if (timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+    perror("timerfd_settime");
+    ABORT();
+  }
+}
+
+// Handles the timer having expired, signalling the command's process group
+// and then killing it if it is still around after kill_after
+void command_timer_fire(command_timer *timer) {
+  uint64_t expirations;
+  if (read(timer->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+  if (timer->stage == 0) {
+    kill(-timer->pid, timer->deadline.signal);
+    // Stopped commands wouldn't see the signal
+    if (timer->deadline.signal != SIGKILL) kill(-timer->pid, SIGCONT);
+    timer->stage = timer->deadline.signal == SIGKILL ? 2 : 1;
+    if (timer->stage == 1 && timer->deadline.kill_after > 0) {
+      struct itimerspec spec = { .it_value = timespec_from(timer->deadline.kill_after) };
+      if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;
+      timerfd_settime(timer->fd, 0, &spec, NULL);
+    }
+  } else if (timer->stage == 1) {
+    kill(-timer->pid, SIGKILL);
+    timer->stage = 2;
+  }
+}
+
+// Whether the timer could still fire
+bool command_timer_armed(const command_timer *timer) {
+  return timer->fd != -1 && (timer->stage == 0 || (timer->stage == 1 && timer->deadline.kill_after > 0));
+}
+
+void command_timer_stop(command_timer *timer) {
+  if (timer->fd != -1) close(timer->fd);
+  timer->fd = -1;
+}
+
+// Passes what has been typed on to the child's stdin, with ^C sending it
+// SIGINT and ^D closing its stdin. With stdin redirected only ^C is looked for.
+void relay_stdin(pid_t pid, int child_stdin_fd, bool stdin_redirected, bool *eof) {
+  if (stdin_redirected) {
+    if (read_input(&stdin_buf, false)) {
+      char *ctrl_c = memchr(stdin_buf.buffer + stdin_buf.offset, CTRL_C, stdin_buf.capacity - stdin_buf.offset);
+      if (ctrl_c != NULL) {
+        stdin_buf.offset = ctrl_c - stdin_buf.buffer + 1;
+        if (kill(pid, SIGINT) == -1) {
+          perror("kill sigint");
+          ABORT();
+        }
+        interrupted = true;
+      }
+    }
+  } else if (!*eof && read_input(&stdin_buf, false)) {
+    // FIXME Check if write eof as well
+    size_t to_write = stdin_buf.capacity - stdin_buf.offset;
+    for (size_t i = 0; i < to_write; i ++) {
+      switch (stdin_buf.buffer[stdin_buf.offset + i]) {
+        case CTRL_C: {
+          // Write what was read up to the ^C out, then signal. Continue loop from the byte after this
+          // FIXME handle write errors?, and blocking
+          // Check a poll in a function, and check for POLLERR
+          if (i > 0) drain_buffer_size(child_stdin_fd, &stdin_buf, i - 1, true);
+          stdin_buf.offset ++;
+          to_write = stdin_buf.capacity - stdin_buf.offset;
+          i = 0;
+          if (kill(pid, SIGINT) == -1) {
+            perror("kill sigint");
+            ABORT();
+          }
+          interrupted = true;
+        }; break;
+
+        case CTRL_D: {
+          // Write out up to here, set EOF
+          // FIXME handle write errors, and blocking
+          if (i > 0) drain_buffer_size(child_stdin_fd, &stdin_buf, i - 1, true);
+          stdin_buf.offset ++;
+          to_write = 0;
+          i = 0;
+          *eof = true;
+          while (close(child_stdin_fd) == -1) {
+            if (errno == EINTR) continue;
+            perror("parent close stdin");
+            ABORT();
+            break;
+          }
+        }; break;
+      }
+    }
+    // FIXME handle write errors, and blocking
+    if (!*eof) drain_buffer_size(child_stdin_fd, &stdin_buf, to_write, true);
+  }
+}
+
+// The zygote is a small helper forked at startup, before the shell's heap
+// has grown, that forks and execs commands for run_program(), as forking it
+// stays cheap however large the shell gets. Each shell process sends it
+// requests over its own SOCK_SEQPACKET channel, with the command's fds
+// passed by SCM_RIGHTS and its environment as changes to the one the zygote
+// started with. It replies with the pid, then with the wait status once it
+// reaps the command. What a fork of the shell would have inherited and the
+// zygote doesn't have goes with each request: the cwd as an fd after the
+// command's, and any limits set with ulimit. SHELL_SPAWN=zygote at startup
+// turns it on, anything it can't take is forked by the shell as before.
+#define ZYGOTE_MAX_FDS 64
+#define ZYGOTE_MAX_REQUEST 65536
+#define ZYGOTE_MIN_FD 10 // the shell's ends are kept out of the way of redirections
+
+typedef struct {
+  uint32_t argc;
+  uint32_t env_changes; // "name=value" to set, or "name" to unset
+  uint32_t fds;
+  bool timed;
+  spawn_limits limits;
+  bool has_rlimits;
+  struct rlimit rlimits[RLIM_NLIMITS];
+  int targets[ZYGOTE_MAX_FDS]; // where each passed fd goes in the command
+} zygote_request; // followed by the path, the args and the env changes, each NUL terminated
+
+typedef struct {
+  pid_t pid;
+  int error;  // errno of a failed fork, with a pid of -1
+  bool exited;
+  int status; // wait status, once exited
+} zygote_reply;
+
+typedef struct {
+  int control;       // shell processes send the zygote their channels on this
+  char **base_env;   // the environment the zygote has
+  int channel;       // for requests from channel_pid
+  pid_t channel_pid;
+  pid_t spawned;     // the command to be reaped through the zygote
+} zygote_state;
+zygote_state zygote = { .control = -1, .channel = -1 };
+
+// ulimit has changed the shell's limits since the zygote was started
+bool rlimits_changed = false;
+
+// Sends a message with `fds` attached
+bool fds_send(int sock, const void *data, size_t len, const int *fds, size_t nfds) {
+  char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {
+    .iov_base = (void *)data,
+    .iov_len = len,
+  };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
+  if (nfds > 0) {
+    assert(nfds <= ZYGOTE_MAX_FDS);
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+  ssize_t n;
+  while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+  return n == (ssize_t)len;
+}
+
+// Receives a message and any fds attached to it, which are close-on-exec
+ssize_t fds_recv(int sock, void *data, size_t len, int *fds, size_t *nfds) {
+  char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+  struct iovec iov = {
+    .iov_base = data,
+    .iov_len = len,
+  };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  ssize_t n;
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+  *nfds = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds + *nfds, CMSG_DATA(cmsg), count * sizeof(int));
+    *nfds += count;
+  }
+  return n;
+}
+
+// Execs a request, in a child of the zygote
+void zygote_exec(char *data, size_t len, int *fds, size_t nfds) {
+  zygote_request *req = (zygote_request *)data;
+  char *p = data + sizeof(*req);
+  char *end = data + len;
+  string_array strings = {0};
+  while (p < end) {
+    ARRAY_ADD(strings, p);
+    p += strlen(p) + 1;
+  }
+  if (strings.size != 1 + req->argc + req->env_changes || nfds != req->fds + 1) {
+    fprintf(stderr, "zygote: bad request\n");
+    _exit(127);
+  }
+  if (fchdir(fds[req->fds]) == -1) { perror("zygote fchdir"); abort(); }
+  close(fds[req->fds]);
+  nfds = req->fds;
+  for (int r = 0; req->has_rlimits && r < RLIM_NLIMITS; r ++) setrlimit(r, &req->rlimits[r]);
+  char *path = strings.data[0];
+  char **changes = strings.data + 1 + req->argc;
+  string_array argv = {0};
+  for (uint32_t i = 0; i < req->argc; i ++) ARRAY_ADD(argv, strings.data[1 + i]);
+  ARRAY_ADD(argv, NULL);
+  string_array env = {0};
+  for (char **e = environ; *e != NULL; e ++) {
+    size_t name_len = strcspn(*e, "=");
+    bool changed = false;
+    for (uint32_t i = 0; i < req->env_changes && !changed; i ++) {
+      changed = strncmp(changes[i], *e, name_len) == 0 && (changes[i][name_len] == '=' || changes[i][name_len] == '\0');
+    }
+    if (!changed) ARRAY_ADD(env, *e);
+  }
+  for (uint32_t i = 0; i < req->env_changes; i ++) {
+    if (strchr(changes[i], '=') != NULL) ARRAY_ADD(env, changes[i]);
+  }
+  ARRAY_ADD(env, NULL);
+
+  // Out of the way of the targets first, so none is overwritten before use
+  int top = STDERR_FILENO;
+  for (size_t i = 0; i < nfds; i ++) {
+    if (req->targets[i] > top) top = req->targets[i];
+  }
+  for (size_t i = 0; i < nfds; i ++) {
+    int moved = fcntl(fds[i], F_DUPFD_CLOEXEC, top + 1);
+    if (moved == -1) { perror("zygote fcntl"); abort(); }
+    fds[i] = moved;
+  }
+  for (size_t i = 0; i < nfds; i ++) {
+    if (dup2(fds[i], req->targets[i]) == -1) { perror("zygote dup2"); abort(); }
+  }
+  signal(SIGINT, SIG_DFL);
+  signal(SIGQUIT, SIG_DFL);
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+  spawn_limits_apply(&req->limits);
+  if (req->timed) setpgid(0, 0);
+  execve(path, argv.data, env.data);
+  perror("execve");
+  abort();
+}
+
+typedef struct {
+  pid_t pid;
+  int channel;
+} zygote_child;
+
+// The zygote's loop, until no shell process is left to send it requests
+int zygote_main(int control) {
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, NULL);
+  int sfd = signalfd(-1, &chld, SFD_CLOEXEC);
+  if (sfd == -1) { perror("zygote signalfd"); return 1; }
+  ARRAY(int) channels = {0};
+  ARRAY(zygote_child) children = {0};
+  ARRAY(struct pollfd) pfds = {0};
+  static char request[ZYGOTE_MAX_REQUEST];
+  while (true) {
+    pfds.size = 0;
+    ARRAY_ADD(pfds, ((struct pollfd){ .fd = control, .events = POLLIN }));
+    ARRAY_ADD(pfds, ((struct pollfd){ .fd = sfd, .events = POLLIN }));
+    for (size_t i = 0; i < channels.size; i ++) {
+      ARRAY_ADD(pfds, ((struct pollfd){ .fd = channels.data[i], .events = POLLIN }));
+    }
+    if (poll(pfds.data, pfds.size, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("zygote poll");
+      return 1;
+    }
+
+    if (pfds.data[0].revents != 0) {
+      int fds[ZYGOTE_MAX_FDS];
+      size_t nfds = 0;
+      char byte;
+      // Until every shell process has gone
+      if (fds_recv(control, &byte, 1, fds, &nfds) <= 0) return 0;
+      for (size_t i = 0; i < nfds; i ++) ARRAY_ADD(channels, fds[i]);
+    }
+
+    if (pfds.data[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(sfd, &info, sizeof(info)) == -1 && errno == EINTR);
+      pid_t pid;
+      int status;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (size_t i = 0; i < children.size; i ++) {
+          if (children.data[i].pid != pid) continue;
+          zygote_reply reply = { .pid = pid, .exited = true, .status = status };
+          if (children.data[i].channel != -1) send(children.data[i].channel, &reply, sizeof(reply), MSG_NOSIGNAL);
+          children.data[i] = children.data[-- children.size];
+          break;
+        }
+      }
+    }
+
+    for (size_t c = 2; c < pfds.size; c ++) {
+      int channel = pfds.data[c].fd;
+      if (pfds.data[c].revents == 0) continue;
+      int fds[ZYGOTE_MAX_FDS];
+      size_t nfds = 0;
+      ssize_t n = (pfds.data[c].revents & POLLIN) ? fds_recv(channel, request, sizeof(request), fds, &nfds) : 0;
+      if (n <= 0) {
+        // The shell process went away, its commands are reaped all the same
+        close(channel);
+        for (size_t i = 0; i < children.size; i ++) {
+          if (children.data[i].channel == channel) children.data[i].channel = -1;
+        }
+        for (size_t i = 0; i < channels.size; i ++) {
+          if (channels.data[i] == channel) channels.data[i] = channels.data[-- channels.size];
+        }
+        continue;
+      }
+      zygote_reply reply = {0};
+      if ((size_t)n < sizeof(zygote_request)) {
+        reply.pid = -1;
+        reply.error = EINVAL;
+      } else {
+        reply.pid = fork();
+        if (reply.pid == 0) zygote_exec(request, n, fds, nfds);
+        reply.error = errno;
+        if (reply.pid > 0) {
+          if (((zygote_request *)request)->timed) setpgid(reply.pid, reply.pid);
+          ARRAY_ADD(children, ((zygote_child){ .pid = reply.pid, .channel = channel }));
+        }
+      }
+      for (size_t i = 0; i < nfds; i ++) close(fds[i]);
+      send(channel, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+  }
+}
+
+// Moves a socket of the shell's to ZYGOTE_MIN_FD or above
+int zygote_fd(int fd) {
+  int moved = fcntl(fd, F_DUPFD_CLOEXEC, ZYGOTE_MIN_FD);
+  if (moved == -1) return fd;
+  close(fd);
+  return moved;
+}
+
+void zygote_start(void) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) return;
+  pid_t pid = fork();
+  switch (pid) {
+    case -1:
+      close(sv[0]);
+      close(sv[1]);
+      return;
+
+    case 0: {
+      close(sv[0]);
+      // Not a child of the shell, so it never has to be waited for
+      pid_t zygote_pid = fork();
+      if (zygote_pid != 0) _exit(zygote_pid == -1);
+      _exit(zygote_main(sv[1]));
+    }; break;
+
+    default:
+      break;
+  }
+  close(sv[1]);
+  int wstatus;
+  while (waitpid(pid, &wstatus, 0) == -1 && errno == EINTR);
+  if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+    close(sv[0]);
+    return;
+  }
+  zygote.control = zygote_fd(sv[0]);
+  zygote.base_env = environ;
+}
+
+// Stops using the zygote, eg after it has gone
+void zygote_lost(void) {
+  if (zygote.channel != -1) close(zygote.channel);
+  if (zygote.control != -1) close(zygote.control);
+  zygote = (zygote_state){ .control = -1, .channel = -1 };
+}
+
+// Whether this is the main thread of its process. The zygote's channel is
+// one per process, so commands started from other threads are forked.
+bool on_main_thread(void) {
+  return syscall(SYS_gettid) == getpid();
+}
+
+// The channel of this process to the zygote, made on first use, or -1
+int zygote_channel(void) {
+  if (zygote.control == -1 || !on_main_thread()) return -1;
+  if (zygote.channel_pid == getpid()) return zygote.channel;
+  // A forked shell has its own, and leaves its parent's alone
+  if (zygote.channel != -1) close(zygote.channel);
+  zygote.channel = -1;
+  zygote.spawned = 0;
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) return -1;
+  char byte = 0;
+  bool sent = fds_send(zygote.control, &byte, 1, &sv[1], 1);
+  close(sv[1]);
+  if (!sent) {
+    close(sv[0]);
+    zygote_lost();
+    return -1;
+  }
+  zygote.channel = zygote_fd(sv[0]);
+  zygote.channel_pid = getpid();
+  return zygote.channel;
+}
+
+// Whether `name=...` is in `env`, and if so the entry
+char *env_find(char **env, const char *entry, size_t name_len) {
+  for (; *env != NULL; env ++) {
+    if (strncmp(*env, entry, name_len) == 0 && (*env)[name_len] == '=') return *env;
+  }
+  return NULL;
+}
+
+// Has the zygote spawn a command with `in`, `out` and `err` as its stdin,
+// stdout and stderr and `files` over them. Returns -1 when the shell has to
+// fork it itself.
+pid_t zygote_spawn(const char *file_path, char **argv, char **envp, int in, int out, int err, bool timed) {
+  int channel = zygote_channel();
+  if (channel == -1) return -1;
+  zygote_request req = {
+    .timed = timed,
+    .limits = spawn_next != NULL ? *spawn_next : spawn_defaults,
+  };
+  int fds[ZYGOTE_MAX_FDS] = { in, out, err };
+  req.fds = 3;
+  for (int i = 0; i < 3; i ++) req.targets[i] = i;
+  for (size_t i = 0; i < files.size; i ++) {
+    if (files.data[i] == NULL) continue;
+    int fd = fileno(files.data[i]);
+    // Room is kept for the cwd
+    if (fd < 0 || req.fds + 1 == ZYGOTE_MAX_FDS) return -1;
+    req.targets[req.fds] = i;
+    fds[req.fds ++] = fd;
+  }
+  if (rlimits_changed) {
+    req.has_rlimits = true;
+    for (int r = 0; r < RLIM_NLIMITS; r ++) getrlimit(r, &req.rlimits[r]);
+  }
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (cwd == -1) return -1;
+  fds[req.fds] = cwd;
+  char_array msg = {0};
+  char_array_reserve(&msg, sizeof(req));
+  msg.size = sizeof(req);
+  #define ZYGOTE_PUT(s) do { \
+    size_t len = strlen(s) + 1; \
+    char_array_reserve(&msg, len); \
+    memcpy(msg.data + msg.size, (s), len); \
+    msg.size += len; \
+  } while (false)
+  ZYGOTE_PUT(file_path);
+  for (; argv[req.argc] != NULL; req.argc ++) ZYGOTE_PUT(argv[req.argc]);
+  for (char **e = envp; *e != NULL; e ++) {
+    size_t name_len = strcspn(*e, "=");
+    char *base = env_find(zygote.base_env, *e, name_len);
+    if (base != NULL && strcmp(base, *e) == 0) continue;
+    ZYGOTE_PUT(*e);
+    req.env_changes ++;
+  }
+  for (char **e = zygote.base_env; *e != NULL; e ++) {
+    size_t name_len = strcspn(*e, "=");
+    if (env_find(envp, *e, name_len) != NULL) continue;
+    char *name = strndup(*e, name_len);
+    assert(name != NULL);
+    ZYGOTE_PUT(name);
+    free(name);
+    req.env_changes ++;
+  }
+  #undef ZYGOTE_PUT
+  memcpy(msg.data, &req, sizeof(req));
+  if (msg.size > ZYGOTE_MAX_REQUEST) {
+    ARRAY_FREE(msg);
+    close(cwd);
+    return -1;
+  }
+  bool sent = fds_send(channel, msg.data, msg.size, fds, req.fds + 1);
+  ARRAY_FREE(msg);
+  close(cwd);
+  zygote_reply reply;
+  ssize_t n = 0;
+  while (sent && (n = recv(channel, &reply, sizeof(reply), 0)) == -1 && errno == EINTR);
+  if (n != sizeof(reply)) {
+    zygote_lost();
+    return -1;
+  }
+  if (reply.pid == -1) {
+    errno = reply.error;
+    return -1;
+  }
+  STAT_ADD(STAT_SPAWNS, 1);
+  zygote.spawned = reply.pid;
+  return reply.pid;
+}
+
+// Whether `pid` is reaped through the zygote, rather than with waitpid()
+bool zygote_owns(pid_t pid) {
+  return zygote.spawned == pid && pid > 0 && zygote.channel_pid == getpid() && on_main_thread();
+}
+
+// waitpid() for a command run_program() started
+pid_t spawn_wait(pid_t pid, int *wstatus, int options) {
+  if (!zygote_owns(pid)) return waitpid(pid, wstatus, options);
+  while (true) {
+    zygote_reply reply;
+    ssize_t n = recv(zygote.channel, &reply, sizeof(reply), (options & WNOHANG) ? MSG_DONTWAIT : 0);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n != sizeof(reply)) {
+      // Its status went with the zygote
+      fprintf(stderr, "%s: spawn helper exited\n", shell_name);
+      zygote_lost();
+      *wstatus = W_EXITCODE(1, 0);
+      return pid;
+    }
+    if (reply.exited && reply.pid == pid) {
+      *wstatus = reply.status;
+      zygote.spawned = 0;
+      return pid;
+    }
+  }
+}
+
+// The output of commands can be relayed through io_uring instead of a
+// poll() and read()/write() pair per chunk. Each chunk read into one of the
+// registered relay buffers is written out with a write linked to the next
+// read, so both go to the kernel in one submission. The child's exit comes
+// in as a completion through a pidfd rather than polling waitpid().
+// SHELL_IO=poll selects the poll backend, which is also used whenever
+// io_uring isn't available.
+#define RELAY_BUFFER_SIZE 65536
+#define RELAY_STDIN 2
+#define RELAY_CHILD 3
+#define RELAY_CANCEL 4
+#define RELAY_TIMER 5
+#define RELAY_WRITE 6 // + the index of the source
+
+typedef struct {
+  int fd; // -1 before setup, -2 if io_uring isn't available
+  pid_t pid; // process that set it up, a forked child needs its own
+  unsigned entries;
+  unsigned sq_tail;
+  unsigned *sq_head, *sq_ktail, *sq_mask;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  bool fixed; // the relay buffers are registered
+} io_ring;
+
+io_ring ring = { .fd = -1 };
+char relay_buffers[2][RELAY_BUFFER_SIZE];
+
+void io_ring_free(void) {
+  if (ring.fd < 0) return;
+  munmap(ring.sqes, ring.sqes_size);
+  if (ring.cq_ring != ring.sq_ring) munmap(ring.cq_ring, ring.cq_ring_size);
+  munmap(ring.sq_ring, ring.sq_ring_size);
+  close(ring.fd);
+  ring = (io_ring){ .fd = -1 };
+}
+
+// Sets up the ring on first use, returns whether io_uring can be used
+bool io_ring_ready(void) {
+  char *backend = var_get("SHELL_IO");
+  if (backend != NULL && strcmp(backend, "poll") == 0) return false;
+  if (ring.fd >= 0 && ring.pid != getpid()) io_ring_free();
+  if (ring.fd != -1) return ring.fd >= 0;
+
+  struct io_uring_params params = {0};
+  int fd = syscall(SYS_io_uring_setup, 16, &params);
+  if (fd == -1) {
+    ring.fd = -2;
+    return false;
+  }
+  ring.fd = fd;
+  ring.pid = getpid();
+  ring.entries = params.sq_entries;
+  ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ring.cq_ring_size > ring.sq_ring_size) ring.sq_ring_size = ring.cq_ring_size;
+  ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring.sq_ring == MAP_FAILED) {
+    perror("mmap io_uring sq");
+    ABORT();
+  }
+  ring.cq_ring = ring.sq_ring;
+  if (!single) {
+    ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring.cq_ring == MAP_FAILED) {
+      perror("mmap io_uring cq");
+      ABORT();
+    }
+  }
+  ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) {
+    perror("mmap io_uring sqes");
+    ABORT();
+  }
+  char *sq = ring.sq_ring;
+  char *cq = ring.cq_ring;
+  ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring.sq_ktail = (unsigned *)(sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring.sq_tail = *ring.sq_ktail;
+  // Submission entries are always used in order
+  unsigned *array = (unsigned *)(sq + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i ++) array[i] = i;
+
+  struct iovec iov[2] = {
+    { .iov_base = relay_buffers[0], .iov_len = RELAY_BUFFER_SIZE },
+    { .iov_base = relay_buffers[1], .iov_len = RELAY_BUFFER_SIZE },
+  };
+  ring.fixed = syscall(SYS_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, 2) == 0;
+  return true;
+}
+
+void io_ring_submit(unsigned wait) {
+  while (true) {
+    unsigned to_submit = ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait == 0) return;
+    STAT_ADD(STAT_URING_ENTERS, 1);
+    int ret = syscall(SYS_io_uring_enter, ring.fd, to_submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0) return;
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+    perror("io_uring_enter");
+    ABORT();
+  }
+}
+
+struct io_uring_sqe *io_ring_sqe(uint8_t opcode, int fd, uint64_t user_data) {
+  if (ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.entries) io_ring_submit(0);
+  struct io_uring_sqe *sqe = &ring.sqes[ring.sq_tail & *ring.sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+  ring.sq_tail ++;
+  __atomic_store_n(ring.sq_ktail, ring.sq_tail, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+void io_ring_rw(bool write, int fd, int index, size_t len, uint64_t user_data, bool link) {
+  struct io_uring_sqe *sqe = io_ring_sqe(
+      ring.fixed ? (write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED) : (write ? IORING_OP_WRITE : IORING_OP_READ),
+      fd, user_data);
+  sqe->addr = (uintptr_t)relay_buffers[index];
+  sqe->len = len;
+  // Pipes and terminals have no offset
+  sqe->off = (uint64_t)-1;
+  if (ring.fixed) sqe->buf_index = index;
+  if (link) sqe->flags |= IOSQE_IO_LINK;
+}
+
+void write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, buf, len);
+    if (ret == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      perror("relay write");
+      ABORT();
+    }
+    buf += ret;
+    len -= ret;
+  }
+}
+
+// Relays the child's stdout and stderr, and any typing to its stdin, until
+// it exits and its output is done. Returns false without doing anything if
+// io_uring can't be used.
+bool relay_uring(pid_t pid, int out_fds[2], int child_stdin_fd, bool stdin_redirected, bool *eof, command_timer *timer, int *wstatus) {
+  // The ring is the main thread's too
+  if (!on_main_thread() || !io_ring_ready()) return false;
+  // The zygote's channel says when a command it spawned has exited
+  int pidfd = zygote_owns(pid) ? dup(zygote.channel) : syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd == -1) return false;
+  const int dest[2] = { STDOUT_FILENO, STDERR_FILENO };
+  bool open[2] = { true, true };
+  bool busy[2] = { false, false };
+  size_t writing[2] = { 0, 0 };
+  bool exited = false;
+  bool child_polling = false;
+  bool stdin_polling = false;
+  bool timer_polling = false;
+  int cancelling = 0;
+  while (open[0] || open[1] || !exited || stdin_polling || timer_polling || cancelling > 0) {
+    bool want_stdin = !exited && (stdin_redirected || !*eof) && !stdin_buf.eof;
+    // Anything already buffered, eg typed ahead, doesn't need a poll
+    if (want_stdin && (stdin_buf.offset < stdin_buf.capacity || stdin_buf.paste_offset < stdin_buf.paste.size)) relay_stdin(pid, child_stdin_fd, stdin_redirected, eof);
+    for (int i = 0; i < 2; i ++) {
+      if (open[i] && !busy[i]) {
+        io_ring_rw(false, out_fds[i], i, RELAY_BUFFER_SIZE, i, false);
+        busy[i] = true;
+      }
+    }
+    if (want_stdin && !stdin_polling) {
+      io_ring_sqe(IORING_OP_POLL_ADD, STDIN_FILENO, RELAY_STDIN)->poll32_events = POLLIN;
+      stdin_polling = true;
+    }
+    if (!exited && !child_polling) {
+      io_ring_sqe(IORING_OP_POLL_ADD, pidfd, RELAY_CHILD)->poll32_events = POLLIN;
+      child_polling = true;
+    }
+    if (!exited && !timer_polling && command_timer_armed(timer)) {
+      io_ring_sqe(IORING_OP_POLL_ADD, timer->fd, RELAY_TIMER)->poll32_events = POLLIN;
+      timer_polling = true;
+    }
+    if (exited && cancelling == 0 && (stdin_polling || timer_polling)) {
+      if (stdin_polling) {
+        io_ring_sqe(IORING_OP_POLL_REMOVE, -1, RELAY_CANCEL)->addr = RELAY_STDIN;
+        cancelling ++;
+      }
+      if (timer_polling) {
+        io_ring_sqe(IORING_OP_POLL_REMOVE, -1, RELAY_CANCEL)->addr = RELAY_TIMER;
+        cancelling ++;
+      }
+    }
+    io_ring_submit(1);
+
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head ++) {
+      struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+      __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+      int i = (int)(cqe.user_data - RELAY_WRITE);
+      switch (cqe.user_data) {
+        case 0:
+        case 1: {
+          i = (int)cqe.user_data;
+          busy[i] = false;
+          if (cqe.res == 0) {
+            open[i] = false;
+          } else if (cqe.res > 0 && i == 0 && capture != NULL) {
+            STAT_ADD(STAT_RELAYED_BYTES, cqe.res);
+            char_array_reserve(capture, cqe.res);
+            memcpy(capture->data + capture->size, relay_buffers[0], cqe.res);
+            capture->size += cqe.res;
+          } else if (cqe.res > 0) {
+            STAT_ADD(STAT_RELAYED_BYTES, cqe.res);
+            // Write the chunk out, with the next read going once it's done
+            writing[i] = cqe.res;
+            io_ring_rw(true, dest[i], i, cqe.res, RELAY_WRITE + i, true);
+            io_ring_rw(false, out_fds[i], i, RELAY_BUFFER_SIZE, i, false);
+            busy[i] = true;
+          } else if (cqe.res != -ECANCELED && cqe.res != -EINTR && cqe.res != -EAGAIN) {
+            errno = -cqe.res;
+            perror("relay read");
+            ABORT();
+          }
+        }; break;
+
+        case RELAY_STDIN:
+          stdin_polling = false;
+          if (!exited && cqe.res >= 0) relay_stdin(pid, child_stdin_fd, stdin_redirected, eof);
+          break;
+
+        case RELAY_CHILD:
+          child_polling = false;
+          if (cqe.res < 0) break;
+          pid_t reaped;
+          while ((reaped = spawn_wait(pid, wstatus, WNOHANG)) == -1) {
+            if (errno == EINTR) continue;
+            perror("waitpid relay");
+            ABORT();
+          }
+          exited = reaped != 0;
+          break;
+
+        case RELAY_TIMER:
+          timer_polling = false;
+          if (!exited && cqe.res >= 0) command_timer_fire(timer);
+          break;
+
+        case RELAY_CANCEL:
+          cancelling --;
+          break;
+
+        default: {
+          // A short or failed write cancels the linked read, so finish it here
+          size_t done = cqe.res > 0 ? (size_t)cqe.res : 0;
+          if (cqe.res < 0 && cqe.res != -EINTR && cqe.res != -EAGAIN) {
+            errno = -cqe.res;
+            perror("relay write");
+            ABORT();
+          }
+          if (done < writing[i]) write_all(dest[i], relay_buffers[i] + done, writing[i] - done);
+          writing[i] = 0;
+        }; break;
+      }
+    }
+  }
+  close(pidfd);
+  return true;
+}
+
+int run_program(const char *file_path, string_array args, char **envp) {
+  SBO_ARRAY(char *, 8) argv;
+  SBO_ARRAY_INIT(argv);
+  for (size_t i = 0; i < args.size; i ++) {
+    SBO_ARRAY_ADD(argv, args.data[i]);
+  }
+  SBO_ARRAY_ADD(argv, NULL);
+  int stdin_pipe[2];
+  int stdout_pipe[2];
+  int stderr_pipe[2];
+  if (pipe(stdin_pipe) != 0) { perror("pipe stdin"); ABORT(); }
+  if (pipe(stdout_pipe) != 0) { perror("pipe stdout"); ABORT(); }
+  if (pipe(stderr_pipe) != 0) { perror("pipe stderr"); ABORT(); }
+  deadline timeout;
+  bool timed = command_deadline(&timeout);
+  pid_t pid = zygote_spawn(file_path, argv.data, envp, stdin_pipe[0], stdout_pipe[1], stderr_pipe[1], timed);
+  if (pid == -1) pid = fork();
+  switch (pid) {
+    case -1:
+      perror("fork");
+      ABORT();
+      UNREACHABLE();
+      return -1;
+
+    case 0:
+      // FIXME get stdin working, pipe maybe
+      if (close(stdin_pipe[1]) == -1) { perror("child close stdin_pipe[1]"); ABORT(); }
+      if (close(stdout_pipe[0]) == -1) { perror("child close stdout_pipe[0]"); ABORT(); }
+      if (close(stderr_pipe[0]) == -1) { perror("child close stderr_pipe[0]"); ABORT(); }
+      if (dup2(stdin_pipe[0], STDIN_FILENO) == -1) { perror("child dup2 stdin"); ABORT(); }
+      if (dup2(stdout_pipe[1], STDOUT_FILENO) == -1) { perror("child dup2 stdout"); ABORT(); }
+      if (dup2(stderr_pipe[1], STDERR_FILENO) == -1) { perror("child dup2 stderr"); ABORT(); }
+      for (size_t i = 0; i < files.size; i ++) {
+        if (files.data[i] != NULL) {
+          int fd = fileno(files.data[i]);
+          if ((size_t)fd == i) {
+            fcntl(fd, F_SETFD, 0);
+          } else if (dup2(fd, i) == -1) {
+            perror("child dup2 files");
+            ABORT();
+          }
+        }
+      }
+      // Nothing the shell blocks is left blocked for the program
+      sigset_t none;
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, NULL);
+      spawn_limits_apply(spawn_next != NULL ? spawn_next : &spawn_defaults);
+      // Its own process group, so a timeout gets anything it starts too
+      if (timed) setpgid(0, 0);
+      if (execve(file_path, argv.data, envp) == -1) {
+        perror("execve");
+        abort();
+      }
+      UNREACHABLE();
+      return -1;
+
+    default: {
+      SBO_ARRAY_FREE(argv);
+      if (close(stdin_pipe[0]) == -1) { perror("parent close stdin_pipe[0]"); ABORT(); }
+      if (close(stdout_pipe[1]) == -1) { perror("parent close stdout_pipe[1]"); ABORT(); }
+      if (close(stderr_pipe[1]) == -1) { perror("parent close stderr_pipe[1]"); ABORT(); }
+      int wstatus = 0;
+      // relay_uring() reaps the child itself
+      pid_t wait_ret = pid;
+      bool eof = false;
+      read_buffer child_stdout_buf = {
+        .fd = stdout_pipe[0],
+      };
+      read_buffer child_stderr_buf = {
+        .fd = stderr_pipe[0],
+      };
+      int child_stdin_fd = stdin_pipe[1];
+      // With stdin redirected, only watch the terminal for ^C
+      bool stdin_redirected = files.size > STDIN_FILENO && files.data[STDIN_FILENO] != NULL;
+      if (stdin_redirected) {
+        close(child_stdin_fd);
+        child_stdin_fd = -1;
+      }
+      command_timer timer = { .fd = -1 };
+      if (timed) {
+        setpgid(pid, pid);
+        command_timer_start(&timer, pid, &timeout);
+      }
+      int out_fds[2] = { stdout_pipe[0], stderr_pipe[0] };
+      if (relay_uring(pid, out_fds, child_stdin_fd, stdin_redirected, &eof, &timer, &wstatus)) goto relayed;
+
+wait_loop:
+      while (true) {
+        wait_ret = spawn_wait(pid, &wstatus, WNOHANG);
+        if (wait_ret == -1) {
+          switch (errno) {
+            case EAGAIN:
+              continue;
+
+            case ECHILD:
+              goto wait_loop;
+
+            default:
+              perror("waitpid(pid, &status, WNOHANG)");
+              ABORT();
+          }
+        }
+        if (wait_ret != 0) break;
+
+        relay_stdin(pid, child_stdin_fd, stdin_redirected, &eof);
+        if (timer.fd != -1) command_timer_fire(&timer);
+        if (capture != NULL) {
+          capture_read(stdout_pipe[0], capture, false);
+        } else {
+          read_and_drain_buffer(STDOUT_FILENO, &child_stdout_buf, eof, !eof, false);
+        }
+        read_and_drain_buffer(STDERR_FILENO, &child_stderr_buf, eof, !eof, false);
+      }
+      if (capture != NULL) {
+        capture_read(stdout_pipe[0], capture, true);
+      } else {
+        read_and_drain_buffer(STDOUT_FILENO, &child_stdout_buf, true, false, false);
+      }
+      read_and_drain_buffer(STDERR_FILENO, &child_stderr_buf, true, false, false);
+relayed:
+      close(stdout_pipe[0]);
+      close(stderr_pipe[0]);
+      if (!eof && child_stdin_fd != -1) close(child_stdin_fd);
+      command_timer_stop(&timer);
+      if (timer.stage > 0) return timer.stage == 2 ? 128 + SIGKILL : 124;
+      if (WIFEXITED(wstatus)) {
+        return WEXITSTATUS(wstatus);
+      } else if (WIFSIGNALED(wstatus)) {
+        return 128 + WTERMSIG(wstatus);
+      } else if (WIFSTOPPED(wstatus)) {
+        return 128 + WSTOPSIG(wstatus);
+      } else {
+        perror("waitpid");
+        fprintf(stderr, "wait returned %d, wstatus = %d\n", wait_ret, wstatus);
+      }
+    }
+  }
+  UNREACHABLE();
+  return -1;
+}
+
+
+int help_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  if (args.size > 1) {
+    char *arg = args.data[1];
+    for (size_t i = 0; i < builtins.size; i ++) {
+      command_t cmd = builtins.data[i];
+      if (strcmp(cmd.command, arg) == 0) {
+
+        fprintf(out, "    %-10s - %s\n", cmd.command, cmd.description);
+        return 0;
+      }
+    }
+    fprintf(err, "%s: Builtin %s not found\n", args.data[0], args.data[1]);
+    return 1;
+  }
+  fprintf(out, "Available commands:\n");
+  for (size_t i = 0; i < builtins.size; i ++) {
+    command_t cmd = builtins.data[i];
+    fprintf(out, "    %-10s - %s\n", cmd.command, cmd.description);
+  }
+  return 0;
+}
+
+int exit_command(string_array args) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  int code = 0;
+  if (args.size > 1) {
+    char *end;
+    code = strtol(args.data[1], &end, 0);
+    if (*end != '\0') {
+      fprintf(err, "%s: numeric argument required\n", args.data[0]);
+      return 1;
+    }
+    if (code < 0 || code > 255) {
+      fprintf(err, "%s: exit code must be 0-255\n", args.data[0]);
+      return 1;
+    }
+  }
+  for (size_t i = 0; i < args.size; i ++) {
+    free(args.data[i]);
+    args.data[i] = NULL;
+  }
+  ARRAY_FREE(args);
+  server_reply(code);
+  cleanup();
+  exit(code);
+  UNREACHABLE();
+  return 0;
+}
+
+// Finds an executable command in PATH, returns a new string or NULL
+char *path_lookup(const char *command) {
+  char *path = var_get("PATH");
+  if (path == NULL) return NULL;
+  while (true) {
+    size_t len = strcspn(path, ":");
+    char *file_path = NULL;
+    assert(asprintf(&file_path, "%.*s/%s", (int)len, path, command) != -1);
+    if (access(file_path, R_OK | X_OK) == 0) return file_path;
+    free(file_path);
+    if (path[len] == '\0') return NULL;
+    path += len + 1;
+  }
+}
+
+// Commands that have been found in PATH, so running them again doesn't
+// search it. Forgotten whenever PATH changes.
+table path_hash = {0};
+char *path_hash_path = NULL;
+
+// Shell functions, with the nodes of their bodies as values
+table functions = {0};
+void function_body_free(void *body);
+
+void path_hash_clear(void) {
+  table_clear(&path_hash, free);
+  free(path_hash_path);
+  path_hash_path = NULL;
+}
+
+// The hashed entry of a command, if PATH hasn't changed since it was hashed
+table_entry *path_hash_find(const char *command) {
+  char *path = var_get("PATH");
+  if (path == NULL || path_hash_path == NULL || strcmp(path, path_hash_path) != 0) {
+    path_hash_clear();
+    if (path != NULL) path_hash_path = strdup(path);
+    return NULL;
+  }
+  return table_lookup(&path_hash, command);
+}
+
+// Like path_lookup(), but the result is remembered and owned by the hash
+const char *path_hashed(const char *command, bool count) {
+  table_entry *entry = path_hash_find(command);
+  if (entry == NULL) {
+    char *file_path = path_lookup(command);
+    if (file_path == NULL) return NULL;
+    entry = table_insert(&path_hash, command);
+    entry->value = file_path;
+  }
+  if (count) entry->hits ++;
+  return entry->value;
+}
+
+int hash_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  size_t i = 1;
+  if (i < args.size && strcmp(args.data[i], "-r") == 0) {
+    path_hash_clear();
+    i ++;
+  }
+  if (args.size == 1) {
+    path_hash_find("");
+    if (path_hash.size == 0) {
+      fprintf(out, "%s: hash table empty\n", args.data[0]);
+      return 0;
+    }
+    fprintf(out, "hits\tcommand\n");
+    for (size_t b = 0; b < path_hash.capacity; b ++) {
+      for (table_entry *entry = path_hash.buckets[b]; entry != NULL; entry = entry->next) {
+        fprintf(out, "%4zu\t%s\n", entry->hits, (char *)entry->value);
+      }
+    }
+    return 0;
+  }
+  int ret = 0;
+  for (; i < args.size; i ++) {
+    if (strchr(args.data[i], '/') != NULL) continue;
+    if (path_hashed(args.data[i], false) == NULL) {
+      fprintf(err, "%s: %s: not found\n", args.data[0], args.data[i]);
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+// Builtins read their stdin redirect straight from the fd. Regular files are
+// mmap'd from the current offset, and the offset is moved past what was used
+// so the next reader carries on from there.
+typedef struct {
+  int fd; // -1 for the shell's own input
+  bool mapped;
+  char *map;
+  size_t map_size;
+  const char *data;
+  size_t size;
+  size_t pos;
+  off_t start;
+} input_source;
+
+input_source input_source_open(void) {
+  input_source src = { .fd = -1 };
+  if (files.size > STDIN_FILENO && files.data[STDIN_FILENO] != NULL) {
+    src.fd = fileno(files.data[STDIN_FILENO]);
+  }
+  struct stat st;
+  if (src.fd == -1 || fstat(src.fd, &st) == -1 || !S_ISREG(st.st_mode)) return src;
+  src.start = lseek(src.fd, 0, SEEK_CUR);
+  if (src.start == -1 || src.start > st.st_size) return src;
+  src.mapped = true;
+  src.size = st.st_size - src.start;
+  if (src.size == 0) return src;
+  off_t page = sysconf(_SC_PAGESIZE);
+  off_t aligned = src.start & ~(page - 1);
+  src.map_size = st.st_size - aligned;
+  src.map = mmap(NULL, src.map_size, PROT_READ, MAP_PRIVATE, src.fd, aligned);
+  if (src.map == MAP_FAILED) {
+    src.map = NULL;
+    src.mapped = false;
+    return src;
+  }
+  madvise(src.map, src.map_size, MADV_SEQUENTIAL);
+  src.data = src.map + (src.start - aligned);
+  return src;
+}
+
+void input_source_close(input_source *src) {
+  if (!src->mapped) return;
+  lseek(src->fd, src->start + src->pos, SEEK_SET);
+  if (src->map != NULL) munmap(src->map, src->map_size);
+  src->map = NULL;
+}
+
+// Returns the next byte, EOF at end of input, or CTRL_C if interrupted
+int input_source_getc(input_source *src) {
+  if (src->mapped) return src->pos < src->size ? (unsigned char)src->data[src->pos ++] : EOF;
+  if (src->fd != -1) {
+    // One byte at a time, so nothing past the line is taken from a pipe
+    unsigned char c;
+    ssize_t n;
+    while ((n = read(src->fd, &c, 1)) == -1 && errno == EINTR);
+    return n == 1 ? c : EOF;
+  }
+  if (is_eof(&stdin_buf)) return EOF;
+  char c = read_char(&stdin_buf);
+  if (c == CTRL_C) return CTRL_C;
+  if (c == CTRL_D) return EOF;
+  return (unsigned char)c;
+}
+
+int read_command(string_array args) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  bool raw = false;
+  size_t i = 1;
+  for (; i < args.size && args.data[i][0] == '-'; i ++) {
+    if (strcmp(args.data[i], "--") == 0) {
+      i ++;
+      break;
+    } else if (strcmp(args.data[i], "-r") == 0) {
+      raw = true;
+    } else if (strcmp(args.data[i], "-p") == 0 && i + 1 < args.size) {
+      fprintf(err, "%s", args.data[++ i]);
+    } else {
+      fprintf(err, "read: %s: invalid option\n", args.data[i]);
+      return 2;
+    }
+  }
+  for (size_t n = i; n < args.size; n ++) {
+    if (!is_name(args.data[n], strlen(args.data[n]))) {
+      fprintf(err, "read: `%s': not a valid identifier\n", args.data[n]);
+      return 1;
+    }
+  }
+
+  // Escaped characters are marked so they don't split fields
+  char_array line = {0};
+  ARRAY(bool) literal = {0};
+  input_source src = input_source_open();
+  int c;
+  bool got_eof = false;
+  while (true) {
+    c = input_source_getc(&src);
+    if (c == CTRL_C) {
+      printf("^C\n");
+      input_source_close(&src);
+      ARRAY_FREE(line);
+      ARRAY_FREE(literal);
+      return 130;
+    }
+    if (c == EOF) {
+      got_eof = true;
+      break;
+    }
+    if (c == '\n') break;
+    if (c == '\\' && !raw) {
+      c = input_source_getc(&src);
+      if (c == EOF || c == CTRL_C) continue;
+      if (c == '\n') continue;
+      ARRAY_ADD(line, c);
+      ARRAY_ADD(literal, true);
+      continue;
+    }
+    ARRAY_ADD(line, c);
+    ARRAY_ADD(literal, false);
+  }
+  input_source_close(&src);
+  if (src.fd == -1 && stdin_buf.echo && !got_eof) prompt_active = false;
+
+  char *ifs = var_get("IFS");
+  if (ifs == NULL) ifs = " \t\n";
+  #define IS_IFS(j) (!literal.data[j] && strchr(ifs, line.data[j]) != NULL)
+  #define IS_IFS_SPACE(j) (IS_IFS(j) && isspace((unsigned char)line.data[j]))
+  size_t pos = 0;
+  size_t end = line.size;
+  while (pos < end && IS_IFS_SPACE(pos)) pos ++;
+  while (end > pos && IS_IFS_SPACE(end - 1)) end --;
+  size_t names = args.size - i;
+  for (size_t n = 0; n < (names == 0 ? 1 : names); n ++) {
+    const char *name = names == 0 ? "REPLY" : args.data[i + n];
+    size_t field_end = end;
+    if (names > 0 && n + 1 < names) {
+      field_end = pos;
+      while (field_end < end && !IS_IFS(field_end)) field_end ++;
+    }
+    char *value = strndup(line.data == NULL ? "" : line.data + pos, field_end - pos);
+    var_set(name, value);
+    free(value);
+    pos = field_end;
+    while (pos < end && IS_IFS_SPACE(pos)) pos ++;
+    if (pos < end && IS_IFS(pos)) {
+      pos ++;
+      while (pos < end && IS_IFS_SPACE(pos)) pos ++;
+    }
+  }
+  #undef IS_IFS
+  #undef IS_IFS_SPACE
+  bool empty = line.size == 0;
+  ARRAY_FREE(line);
+  ARRAY_FREE(literal);
+  return got_eof && empty ? 1 : 0;
+}
+
+// The status of a builtin whose output can't be written. When the reader
+// has gone it stops quietly, as SIGPIPE would have stopped the program.
+int write_error(FILE *err, const char *name, int error) {
+  if (error == EPIPE) return 128 + SIGPIPE;
+  fprintf(err, "%s: write error: %s\n", name, strerror(error));
+  return 1;
+}
+
+// The first option cat leaves to the real cat, or NULL. Only -u is its own.
+const char *cat_option(string_array args) {
+  for (size_t i = 1; i < args.size; i ++) {
+    if (args.data[i][0] == '-' && args.data[i][1] != '\0' && strcmp(args.data[i], "-u") != 0) return args.data[i];
+  }
+  return NULL;
+}
+
+int cat_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  const char *option = cat_option(args);
+  if (option != NULL) {
+    char *file_path = path_lookup("cat");
+    if (file_path == NULL) {
+      fprintf(err, "cat: %s: invalid option\n", option);
+      return 2;
+    }
+    FILE *memstream = NULL;
+    if (out != stdout && fileno(out) == -1) {
+      // $(...) captures the program's output directly
+      memstream = files.data[STDOUT_FILENO];
+      files.data[STDOUT_FILENO] = NULL;
+    }
+    int code = run_program(file_path, args, shell_environ());
+    if (memstream != NULL) files.data[STDOUT_FILENO] = memstream;
+    free(file_path);
+    return code;
+  }
+
+  int ret = 0;
+  bool any = false;
+  int write_errno = 0;
+  for (size_t i = 1; i <= args.size; i ++) {
+    if (i == args.size && any) break;
+    if (i < args.size && strcmp(args.data[i], "-u") == 0) continue;
+    any = true;
+    FILE *saved_stdin = NULL;
+    bool opened = false;
+    if (i < args.size && strcmp(args.data[i], "-") != 0) {
+      int fd = open(args.data[i], O_RDONLY | O_CLOEXEC);
+      if (fd == -1) {
+        fprintf(err, "cat: %s: %s\n", args.data[i], strerror(errno));
+        ret = 1;
+        continue;
+      }
+      ARRAY_ENSURE_CAPACITY(files, STDIN_FILENO + 1);
+      if (files.size <= STDIN_FILENO) files.size = STDIN_FILENO + 1;
+      saved_stdin = files.data[STDIN_FILENO];
+      files.data[STDIN_FILENO] = fdopen(fd, "r");
+      opened = true;
+    }
+    input_source src = input_source_open();
+    if (src.mapped) {
+      if (fwrite(src.data, 1, src.size, out) != src.size) write_errno = errno;
+      src.pos = src.size;
+    } else if (src.fd != -1) {
+      char buf[65536];
+      ssize_t n;
+      while ((n = read(src.fd, buf, sizeof(buf))) != 0) {
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+          fprintf(err, "cat: %s\n", strerror(errno));
+          ret = 1;
+          break;
+        }
+        if (fwrite(buf, 1, n, out) != (size_t)n) {
+          write_errno = errno;
+          break;
+        }
+      }
+    } else {
+      int c;
+      while ((c = input_source_getc(&src)) != EOF) {
+        if (c == CTRL_C) {
+          printf("^C\n");
+          ret = 130;
+          break;
+        }
+        if (fputc(c, out) == EOF) {
+          write_errno = errno;
+          break;
+        }
+      }
+    }
+    input_source_close(&src);
+    if (opened) {
+      fclose(files.data[STDIN_FILENO]);
+      files.data[STDIN_FILENO] = saved_stdin;
+    }
+    if (write_errno != 0) return write_error(err, "cat", write_errno);
+    if (ret == 130) break;
+  }
+  return ret;
+}
+
+// Where tee writes to. Pipes are duplicated to these with tee(2) and
+// splice(2), so the data stays in the kernel, except for any that splice
+// doesn't work with (eg O_APPEND files before Linux 6.x, terminals, $(...))
+// which get a copy instead.
+typedef struct {
+  const char *name;
+  int fd;     // -1 when only `file` can be written
+  FILE *file;
+  bool copy;  // splice doesn't work to it
+  bool failed;
+  bool broken; // its reader has gone
+} tee_dest;
+
+#define TEE_CHUNK (1 << 20)
+
+bool tee_write(tee_dest *dest, FILE *err, const char *data, size_t len) {
+  if (dest->failed) return false;
+  if (dest->fd == -1) {
+    if (fwrite(data, 1, len, dest->file) == len) return true;
+  } else {
+    while (len > 0) {
+      ssize_t n = write(dest->fd, data, len);
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1) break;
+      data += n;
+      len -= n;
+    }
+    if (len == 0) return true;
+  }
+  if (errno == EPIPE) dest->broken = true;
+  else fprintf(err, "tee: %s: %s\n", dest->name, strerror(errno));
+  dest->failed = true;
+  return false;
+}
+
+// Like tee(1) it stops once there is nowhere left to write, or when a
+// reader has gone, which SIGPIPE would have stopped it for
+bool tee_finished(tee_dest *dests, size_t count) {
+  size_t failed = 0;
+  for (size_t i = 0; i < count; i ++) {
+    if (dests[i].broken) return true;
+    if (dests[i].failed) failed ++;
+  }
+  return failed == count;
+}
+
+// Moves `len` bytes out of a pipe to the destination, splicing if it can
+bool tee_splice(tee_dest *dest, FILE *err, int pipe_fd, size_t len) {
+  while (len > 0 && !dest->copy && !dest->failed) {
+    ssize_t n = splice(pipe_fd, NULL, dest->fd, NULL, len, SPLICE_F_MOVE);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && errno == EINVAL) {
+      dest->copy = true;
+    } else if (n == -1) {
+      if (errno == EPIPE) dest->broken = true;
+      else fprintf(err, "tee: %s: %s\n", dest->name, strerror(errno));
+      dest->failed = true;
+    } else {
+      len -= n;
+    }
+  }
+  // Whatever is left is read out, and written if the destination is fine
+  char buf[65536];
+  while (len > 0) {
+    ssize_t n = read(pipe_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    tee_write(dest, err, buf, n);
+    len -= n;
+  }
+  return !dest->failed;
+}
+
+// Copies a pipe to every destination without it going through userspace
+int tee_pipe(int in, tee_dest *dests, size_t count, FILE *err) {
+  if (count == 1) {
+    // Nothing to duplicate, the input just moves along
+    tee_dest *dest = &dests[0];
+    while (!dest->copy && !dest->failed) {
+      ssize_t n = splice(in, NULL, dest->fd, NULL, TEE_CHUNK, SPLICE_F_MOVE);
+      if (n == 0) return 0;
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1 && errno == EINVAL) {
+        dest->copy = true;
+      } else if (n == -1) {
+        if (errno == EPIPE) dest->broken = true;
+        else fprintf(err, "tee: %s: %s\n", dest->name, strerror(errno));
+        dest->failed = true;
+      }
+    }
+    char buf[65536];
+    ssize_t n;
+    while (!dest->failed && (n = read(in, buf, sizeof(buf))) != 0) {
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1) break;
+      tee_write(dest, err, buf, n);
+    }
+    return dest->failed;
+  }
+  int scratch[2];
+  if (pipe2(scratch, O_CLOEXEC) == -1) {
+    perror("tee pipe");
+    return 1;
+  }
+  fcntl(scratch[1], F_SETPIPE_SZ, TEE_CHUNK);
+  fcntl(in, F_SETPIPE_SZ, TEE_CHUNK);
+  int ret = 0;
+  while (true) {
+    // Duplicating into the scratch pipe waits for data and says how much
+    ssize_t n = tee(in, scratch[1], TEE_CHUNK, 0);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) {
+      fprintf(err, "tee: %s\n", strerror(errno));
+      ret = 1;
+      break;
+    }
+    if (n == 0) break;
+    for (size_t i = 0; i + 1 < count; i ++) {
+      // The input is only consumed by the last, so each one tees the same
+      // bytes again into the now empty scratch pipe
+      if (i > 0) {
+        ssize_t m;
+        while ((m = tee(in, scratch[1], n, 0)) == -1 && errno == EINTR);
+        if (m != n) {
+          fprintf(err, "tee: %s\n", m == -1 ? strerror(errno) : "short tee");
+          ret = 1;
+          goto end;
+        }
+      }
+      if (!tee_splice(&dests[i], err, scratch[0], n)) ret = 1;
+    }
+    if (!tee_splice(&dests[count - 1], err, in, n)) ret = 1;
+    if (tee_finished(dests, count)) break;
+  }
+end:
+  close(scratch[0]);
+  close(scratch[1]);
+  return ret;
+}
+
+int tee_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  bool append = false;
+  size_t i = 1;
+  for (; i < args.size && args.data[i][0] == '-' && args.data[i][1] != '\0'; i ++) {
+    if (strcmp(args.data[i], "--") == 0) {
+      i ++;
+      break;
+    }
+    if (strcmp(args.data[i], "-a") != 0 && strcmp(args.data[i], "--append") != 0) {
+      fprintf(err, "tee: %s: invalid option\n", args.data[i]);
+      return 2;
+    }
+    append = true;
+  }
+
+  int ret = 0;
+  ARRAY(tee_dest) dests = {0};
+  for (; i < args.size; i ++) {
+    // Same as > and >> would open it
+    int fd = open(args.data[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+    if (fd == -1) {
+      fprintf(err, "tee: %s: %s\n", args.data[i], strerror(errno));
+      ret = 1;
+      continue;
+    }
+    ARRAY_ADD(dests, ((tee_dest){ .name = args.data[i], .fd = fd }));
+  }
+  // stdout last, as it's the one that consumes the input
+  fflush(out);
+  tee_dest stdout_dest = { .name = "stdout", .fd = fileno(out), .file = out };
+  // $(...) collects builtin output in a memstream
+  if (stdout_dest.fd == -1) stdout_dest.copy = true;
+  ARRAY_ADD(dests, stdout_dest);
+
+  input_source src = input_source_open();
+  struct stat st;
+  if (src.mapped) {
+    for (size_t d = 0; d < dests.size; d ++) {
+      if (!tee_write(&dests.data[d], err, src.data, src.size)) ret = 1;
+    }
+    src.pos = src.size;
+  } else if (src.fd != -1 && fstat(src.fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+    if (tee_pipe(src.fd, dests.data, dests.size, err) != 0) ret = 1;
+  } else if (src.fd != -1) {
+    read_buffer buf = { .fd = src.fd };
+    while (!tee_finished(dests.data, dests.size) && read_input(&buf, true)) {
+      size_t n = buf.capacity - buf.offset;
+      for (size_t d = 0; d < dests.size; d ++) {
+        if (!tee_write(&dests.data[d], err, buf.buffer + buf.offset, n)) ret = 1;
+      }
+      buf.offset = buf.capacity;
+    }
+  } else {
+    // Typed input is passed on a line at a time
+    char_array line = {0};
+    int c = 0;
+    while (c != EOF && !tee_finished(dests.data, dests.size)) {
+      c = input_source_getc(&src);
+      if (c == CTRL_C) {
+        printf("^C\n");
+        ret = 130;
+        break;
+      }
+      if (c != EOF) ARRAY_ADD(line, c);
+      if ((c == '\n' || c == EOF) && line.size > 0) {
+        for (size_t d = 0; d < dests.size; d ++) {
+          if (!tee_write(&dests.data[d], err, line.data, line.size)) ret = 1;
+        }
+        line.size = 0;
+      }
+    }
+    ARRAY_FREE(line);
+  }
+  input_source_close(&src);
+  for (size_t d = 0; d < dests.size; d ++) {
+    if (d + 1 < dests.size) close(dests.data[d].fd);
+    if (dests.data[d].broken) ret = 128 + SIGPIPE;
+  }
+  ARRAY_FREE(dests);
+  return ret;
+}
+
+void stats_print_prometheus(FILE *out) {
+  for (size_t i = 0; i < STAT_COUNT; i ++) {
+    fprintf(out, "# HELP shell_%s_total %s\n", stat_info[i].name, stat_info[i].help);
+    fprintf(out, "# TYPE shell_%s_total counter\n", stat_info[i].name);
+    fprintf(out, "shell_%s_total %" PRIu64 "\n", stat_info[i].name, stats[i]);
+  }
+  for (size_t i = 0; i < STAT_COUNT; i ++) {
+    fprintf(out, "# HELP shell_last_command_%s %s By the last command line.\n", stat_info[i].name, stat_info[i].help);
+    fprintf(out, "# TYPE shell_last_command_%s gauge\n", stat_info[i].name);
+    fprintf(out, "shell_last_command_%s %" PRIu64 "\n", stat_info[i].name, stats_last[i]);
+  }
+}
+
+// Written to a temporary file and renamed over FILE, so a collector reading
+// the textfile never sees half of it
+void stats_write_exit_file(void) {
+  if (stats_exit_path == NULL) return;
+  char *path = stats_exit_path;
+  stats_exit_path = NULL;
+  if (getpid() != stats_pid) {
+    free(path);
+    return;
+  }
+  char *tmp = NULL;
+  if (asprintf(&tmp, "%s.%d.tmp", path, (int)stats_pid) == -1) {
+    perror("asprintf");
+    free(path);
+    return;
+  }
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    fprintf(stderr, "shellstats: %s: %s\n", tmp, strerror(errno));
+  } else {
+    stats_print_prometheus(f);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+      fprintf(stderr, "shellstats: %s: %s\n", path, strerror(errno));
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+  free(path);
+}
+
+int shellstats_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  if (args.size == 1) {
+    fprintf(out, "%-24s %12s %14s\n", "counter", "last", "total");
+    for (size_t i = 0; i < STAT_COUNT; i ++) {
+      fprintf(out, "%-24s %12" PRIu64 " %14" PRIu64 "\n", stat_info[i].name, stats_last[i], stats[i]);
+    }
+    return 0;
+  }
+  if (args.size == 2 && strcmp(args.data[1], "-p") == 0) {
+    stats_print_prometheus(out);
+    return 0;
+  }
+  if (args.size == 2 && strcmp(args.data[1], "-r") == 0) {
+    memset(stats, 0, sizeof(stats));
+    memset(stats_last, 0, sizeof(stats_last));
+    return 0;
+  }
+  if (args.size == 3 && strcmp(args.data[1], "-o") == 0) {
+    free(stats_exit_path);
+    // An empty FILE turns it off again
+    stats_exit_path = args.data[2][0] == '\0' ? NULL : strdup(args.data[2]);
+    stats_pid = getpid();
+    return 0;
+  }
+  fprintf(err, "shellstats: usage: shellstats [-p | -r | -o FILE]\n");
+  return 2;
+}
+
+int echo_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+
+  for (size_t i = 1; i < args.size; i ++) {
+    if (i > 1) fprintf(out, " ");
+    fprintf(out, "%s", args.data[i]);
+  }
+  fprintf(out, "\n");
+  return 0;
+}
+
+int type_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  int ret = 0;
+  for (size_t i = 1; i < args.size; i ++) {
+    char *arg = args.data[i];
+    if (table_lookup(&functions, arg) != NULL) {
+      fprintf(out, "%s is a function\n", arg);
+      continue;
+    }
+    bool found = false;
+    for (size_t b_i = 0; b_i < builtins.size; b_i ++) {
+      if (strcmp(arg, builtins.data[b_i].command) == 0) {
+        fprintf(out, "%s is a shell builtin\n", arg);
+        found = true;
+        break;
+      }
+    }
+    if (found) {
+      continue;
+    }
+
+    if (strchr(arg, '/') != NULL && access(arg, R_OK | X_OK) == 0) {
+      fprintf(out, "%s is %s\n", arg, arg);
+      continue;
+    }
+
+    table_entry *hashed = path_hash_find(arg);
+    if (hashed != NULL) {
+      fprintf(out, "%s is hashed (%s)\n", arg, (char *)hashed->value);
+      continue;
+    }
+    char *file_path = path_lookup(arg);
+    if (file_path != NULL) {
+      fprintf(out, "%s is %s\n", arg, file_path);
+      free(file_path);
+      found = true;
+    }
+    if (found) {
+      continue;
+    }
+
+    ret = 1;
+    fprintf(err, "%s: not found\n", arg);
+  }
+
+  return ret;
+}
+
+// Logical working directory, as reached through any symlinks. Kept in memory
+// so pwd and the prompt don't need a getcwd on every call.
+char *shell_cwd = NULL;
+
+// Entries of the directory stack below the current directory
+string_array dir_stack = {0};
+
+typedef struct {
+  char *dir;
+  struct timespec mtime;
+  string_array names; // sorted subdirectories (and symlinks) of dir
+} cdpath_entry;
+
+ARRAY(cdpath_entry) cdpath_cache = {0};
+
+// Physical working directory, with a buffer grown to fit deep paths
+char *physical_cwd(void) {
+  size_t size = 256;
+  char *buf = NULL;
+  while (true) {
+    buf = realloc(buf, size);
+    assert(buf != NULL);
+    if (getcwd(buf, size) != NULL) return buf;
+    if (errno != ERANGE) {
+      free(buf);
+      return NULL;
+    }
+    size *= 2;
+  }
+}
+
+// Resolves `path` against `base` lexically, dropping "." and "..".
+char *canonical_path(const char *base, const char *path) {
+  char_array ret = {0};
+  if (*path != '/') {
+    char_array_reserve(&ret, strlen(base));
+    memcpy(ret.data, base, strlen(base));
+    ret.size = strlen(base);
+  }
+  while (*path != '\0') {
+    while (*path == '/') path ++;
+    size_t len = strcspn(path, "/");
+    if (len == 0 || (len == 1 && path[0] == '.')) {
+      // nothing
+    } else if (len == 2 && path[0] == '.' && path[1] == '.') {
+      while (ret.size > 0 && ret.data[ret.size - 1] != '/') ret.size --;
+      if (ret.size > 0) ret.size --;
+    } else {
+      if (ret.size == 0 || ret.data[ret.size - 1] != '/') ARRAY_ADD(ret, '/');
+      char_array_reserve(&ret, len);
+      memcpy(ret.data + ret.size, path, len);
+      ret.size += len;
+    }
+    path += len;
+  }
+  if (ret.size == 0) ARRAY_ADD(ret, '/');
+  ARRAY_ADD(ret, '\0');
+  return ret.data;
+}
+
+char *shell_getcwd(void) {
+  if (shell_cwd != NULL) return shell_cwd;
+  // Trust an inherited $PWD if it is absolute, clean and really is "."
+  char *pwd = var_get("PWD");
+  struct stat a, b;
+  if (pwd != NULL && pwd[0] == '/' && stat(pwd, &a) == 0 && stat(".", &b) == 0 &&
+      a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+    char *clean = canonical_path("/", pwd);
+    if (strcmp(clean, pwd) == 0) {
+      shell_cwd = clean;
+      return shell_cwd;
+    }
+    free(clean);
+  }
+  shell_cwd = physical_cwd();
+  if (shell_cwd != NULL) var_set("PWD", shell_cwd);
+  return shell_cwd;
+}
+
+void dirs_free(void) {
+  free(shell_cwd);
+  shell_cwd = NULL;
+  for (size_t i = 0; i < dir_stack.size; i ++) free(dir_stack.data[i]);
+  ARRAY_FREE(dir_stack);
+  for (size_t i = 0; i < cdpath_cache.size; i ++) {
+    free(cdpath_cache.data[i].dir);
+    free_string_array(&cdpath_cache.data[i].names);
+  }
+  ARRAY_FREE(cdpath_cache);
+}
+
+// Whether `dir` has a subdirectory called `name`. The listing of each
+// CDPATH directory is cached until its mtime changes, so a miss costs a
+// single stat.
+bool cdpath_has(const char *dir, const char *name) {
+  struct stat st;
+  if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) return false;
+  cdpath_entry *entry = NULL;
+  for (size_t i = 0; i < cdpath_cache.size; i ++) {
+    if (strcmp(cdpath_cache.data[i].dir, dir) == 0) entry = &cdpath_cache.data[i];
+  }
+  if (entry == NULL) {
+    ARRAY_ADD(cdpath_cache, ((cdpath_entry){ .dir = strdup(dir) }));
+    entry = &cdpath_cache.data[cdpath_cache.size - 1];
+    entry->mtime.tv_nsec = -1;
+  }
+  if (entry->mtime.tv_sec != st.st_mtim.tv_sec || entry->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+    free_string_array(&entry->names);
+    entry->names = (string_array){0};
+    DIR *d = opendir(dir);
+    if (d == NULL) return false;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+      if (ent->d_type == DT_DIR || ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) {
+        ARRAY_ADD(entry->names, strdup(ent->d_name));
+      }
+    }
+    closedir(d);
+    qsort(entry->names.data, entry->names.size, sizeof(char *), compare_strings);
+    entry->mtime = st.st_mtim;
+  }
+  return bsearch(&name, entry->names.data, entry->names.size, sizeof(char *), compare_strings) != NULL;
+}
+
+// Looks `path` up in CDPATH, returns a new string or NULL
+char *cdpath_resolve(const char *path) {
+  char *cdpath = var_get("CDPATH");
+  if (cdpath == NULL || *path == '/' || strcmp(path, ".") == 0 || strcmp(path, "..") == 0 ||
+      strncmp(path, "./", 2) == 0 || strncmp(path, "../", 3) == 0) {
+    return NULL;
+  }
+  char *first = strndup(path, strcspn(path, "/"));
+  char *ret = NULL;
+  while (ret == NULL) {
+    size_t len = strcspn(cdpath, ":");
+    char *dir = len == 0 ? strdup(".") : strndup(cdpath, len);
+    if (cdpath_has(dir, first)) {
+      assert(asprintf(&ret, "%s/%s", dir, path) != -1);
+      struct stat st;
+      if (stat(ret, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        free(ret);
+        ret = NULL;
+      }
+    }
+    free(dir);
+    if (cdpath[len] == '\0') break;
+    cdpath += len + 1;
+  }
+  free(first);
+  return ret;
+}
+
+int pwd_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  bool physical = false;
+  for (size_t i = 1; i < args.size; i ++) {
+    if (strcmp(args.data[i], "-P") == 0) {
+      physical = true;
+    } else if (strcmp(args.data[i], "-L") == 0) {
+      physical = false;
+    } else {
+      fprintf(err, "pwd: %s: invalid option\n", args.data[i]);
+      return 2;
+    }
+  }
+
+  if (physical) {
+    char *cwd = physical_cwd();
+    if (cwd == NULL) {
+      fprintf(err, "pwd: %s\n", strerror(errno));
+      return 1;
+    }
+    fprintf(out, "%s\n", cwd);
+    free(cwd);
+    return 0;
+  }
+  char *cwd = shell_getcwd();
+  if (cwd == NULL) {
+    fprintf(err, "pwd: %s\n", strerror(errno));
+    return 1;
+  }
+  fprintf(out, "%s\n", cwd);
+  return 0;
+}
+
+// Changes directory, updating the logical cwd, PWD and OLDPWD. Sets *found
+// if the directory came from CDPATH, as then the new directory is printed.
+int cd(FILE *err, const char *file_path, bool physical, bool *found) {
+  if (*file_path == 0) return 0;
+  char *resolved = cdpath_resolve(file_path);
+  if (found != NULL) *found = resolved != NULL;
+  const char *target = resolved != NULL ? resolved : file_path;
+  char *cwd = shell_getcwd();
+  char *logical = canonical_path(cwd == NULL ? "/" : cwd, target);
+  int ret = physical ? chdir(target) : chdir(logical);
+  if (ret < 0 && !physical && errno == ENAMETOOLONG) ret = chdir(target);
+  if (ret < 0) {
+    switch (errno) {
+      case EACCES:
+        fprintf(err, "cd: %s: Permission denied\n", file_path);
+        break;
+
+      case ENOENT:
+      case ENOTDIR:
+        fprintf(err, "cd: %s: No such file or directory\n", file_path);
+        break;
+
+      default:
+        fprintf(err, "cd: %s: %s\n", file_path, strerror(errno));
+        break;
+    }
+    free(logical);
+    free(resolved);
+    return 1;
+  }
+  free(resolved);
+  if (physical) {
+    free(logical);
+    logical = physical_cwd();
+  }
+  if (cwd != NULL) var_set("OLDPWD", cwd);
+  free(shell_cwd);
+  shell_cwd = logical;
+  if (shell_cwd != NULL) var_set("PWD", shell_cwd);
+  return 0;
+}
+
+int cd_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  size_t i = 1;
+  bool physical = false;
+  for (; i < args.size && args.data[i][0] == '-' && args.data[i][1] != '\0'; i ++) {
+    if (strcmp(args.data[i], "--") == 0) {
+      i ++;
+      break;
+    } else if (strcmp(args.data[i], "-P") == 0) {
+      physical = true;
+    } else if (strcmp(args.data[i], "-L") == 0) {
+      physical = false;
+    } else {
+      fprintf(err, "cd: %s: invalid option\n", args.data[i]);
+      return 2;
+    }
+  }
+
+  if (args.size > i + 1) {
+    fprintf(err, "cd: too many arguments\n");
+    return 1;
+  }
+
+  if (args.size == i) {
+    char *home = var_get("HOME");
+    if (home == NULL) {
+      fprintf(err, "cd: HOME not set\n");
+      return 1;
+    }
+    return cd(err, home, physical, NULL);
+  }
+
+  if (strcmp(args.data[i], "-") == 0) {
+    char *oldpwd = var_get("OLDPWD");
+    if (oldpwd == NULL) {
+      fprintf(err, "cd: OLDPWD not set\n");
+      return 1;
+    }
+    oldpwd = strdup(oldpwd);
+    int ret = cd(err, oldpwd, physical, NULL);
+    free(oldpwd);
+    if (ret == 0) fprintf(out, "%s\n", shell_cwd);
+    return ret;
+  }
+
+  bool found = false;
+  int ret = cd(err, args.data[i], physical, &found);
+  if (ret == 0 && found) fprintf(out, "%s\n", shell_cwd);
+  return ret;
+}
+
+// Directory stack entry n, where 0 is the current directory
+const char *dirs_entry(size_t n) {
+  return n == 0 ? shell_getcwd() : dir_stack.data[n - 1];
+}
+
+void dirs_print(FILE *out, bool long_form, bool per_line, bool numbered) {
+  char *home = var_get("HOME");
+  size_t home_len = home == NULL ? 0 : strlen(home);
+  for (size_t n = 0; n <= dir_stack.size; n ++) {
+    const char *dir = dirs_entry(n);
+    if (dir == NULL) dir = "";
+    if (numbered) fprintf(out, "%2zu  ", n);
+    else if (n > 0) fputc(per_line ? '\n' : ' ', out);
+    if (!long_form && home_len > 1 && strncmp(dir, home, home_len) == 0 &&
+        (dir[home_len] == '/' || dir[home_len] == '\0')) {
+      fprintf(out, "~%s", dir + home_len);
+    } else {
+      fputs(dir, out);
+    }
+    if (numbered) fputc('\n', out);
+  }
+  if (!numbered) fputc('\n', out);
+}
+
+// Parses a +N or -N directory stack index
+bool dirs_index(const char *arg, size_t *n) {
+  if ((arg[0] != '+' && arg[0] != '-') || !isdigit((unsigned char)arg[1])) return false;
+  char *end = NULL;
+  unsigned long value = strtoul(arg + 1, &end, 10);
+  if (*end != '\0' || value > dir_stack.size) return false;
+  *n = arg[0] == '+' ? value : dir_stack.size - value;
+  return true;
+}
+
+int dirs_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  bool long_form = false, per_line = false, numbered = false;
+  for (size_t i = 1; i < args.size; i ++) {
+    size_t n;
+    if (strcmp(args.data[i], "-c") == 0) {
+      for (size_t j = 0; j < dir_stack.size; j ++) free(dir_stack.data[j]);
+      dir_stack.size = 0;
+      return 0;
+    } else if (strcmp(args.data[i], "-l") == 0) {
+      long_form = true;
+    } else if (strcmp(args.data[i], "-p") == 0) {
+      per_line = true;
+    } else if (strcmp(args.data[i], "-v") == 0) {
+      numbered = true;
+    } else if (dirs_index(args.data[i], &n)) {
+      fprintf(out, "%s\n", dirs_entry(n));
+      return 0;
+    } else {
+      fprintf(err, "dirs: %s: invalid argument\n", args.data[i]);
+      return 1;
+    }
+  }
+  dirs_print(out, long_form, per_line, numbered);
+  return 0;
+}
+
+int pushd_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  size_t i = 1;
+  bool no_cd = false;
+  if (i < args.size && strcmp(args.data[i], "-n") == 0) {
+    no_cd = true;
+    i ++;
+  }
+  if (args.size > i + 1) {
+    fprintf(err, "pushd: too many arguments\n");
+    return 1;
+  }
+
+  char *cwd = shell_getcwd();
+  if (cwd == NULL) {
+    fprintf(err, "pushd: %s\n", strerror(errno));
+    return 1;
+  }
+  size_t n = 1;
+  if (args.size == i || dirs_index(args.data[i], &n)) {
+    if (dir_stack.size == 0) {
+      fprintf(err, "pushd: no other directory\n");
+      return 1;
+    }
+    if (args.size == i && no_cd) {
+      // Swapping without changing directory is a no-op
+    } else if (args.size == i) {
+      // Swap the top two entries
+      char *top = strdup(dir_stack.data[0]);
+      char *old = strdup(cwd);
+      if (cd(err, top, false, NULL) != 0) {
+        free(top);
+        free(old);
+        return 1;
+      }
+      free(top);
+      free(dir_stack.data[0]);
+      dir_stack.data[0] = old;
+    } else if (n != 0) {
+      // Rotate entry n to the top
+      string_array all = {0};
+      for (size_t k = 0; k <= dir_stack.size; k ++) ARRAY_ADD(all, strdup(dirs_entry(k)));
+      if (cd(err, all.data[n], false, NULL) != 0) {
+        free_string_array(&all);
+        return 1;
+      }
+      for (size_t k = 0; k < dir_stack.size; k ++) {
+        free(dir_stack.data[k]);
+        dir_stack.data[k] = strdup(all.data[(n + 1 + k) % all.size]);
+      }
+      free_string_array(&all);
+    }
+  } else {
+    char *old = strdup(cwd);
+    if (no_cd) {
+      ARRAY_ADD(dir_stack, NULL);
+      memmove(dir_stack.data + 1, dir_stack.data, (dir_stack.size - 1) * sizeof(char *));
+      dir_stack.data[0] = canonical_path(cwd, args.data[i]);
+      free(old);
+    } else {
+      if (cd(err, args.data[i], false, NULL) != 0) {
+        free(old);
+        return 1;
+      }
+      ARRAY_ADD(dir_stack, NULL);
+      memmove(dir_stack.data + 1, dir_stack.data, (dir_stack.size - 1) * sizeof(char *));
+      dir_stack.data[0] = old;
+    }
+  }
+  dirs_print(out, false, false, false);
+  return 0;
+}
+
+int popd_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  size_t i = 1;
+  bool no_cd = false;
+  if (i < args.size && strcmp(args.data[i], "-n") == 0) {
+    no_cd = true;
+    i ++;
+  }
+  if (args.size > i + 1) {
+    fprintf(err, "popd: too many arguments\n");
+    return 1;
+  }
+  if (dir_stack.size == 0) {
+    fprintf(err, "popd: directory stack empty\n");
+    return 1;
+  }
+  size_t n = 0;
+  if (args.size > i && !dirs_index(args.data[i], &n)) {
+    fprintf(err, "popd: %s: invalid argument\n", args.data[i]);
+    return 1;
+  }
+  if (n == 0 && no_cd) n = 1;
+  if (n == 0) {
+    if (cd(err, dir_stack.data[0], false, NULL) != 0) return 1;
+    n = 1;
+  }
+  free(dir_stack.data[n - 1]);
+  memmove(dir_stack.data + n - 1, dir_stack.data + n, (dir_stack.size - n) * sizeof(char *));
+  dir_stack.size --;
+  dirs_print(out, false, false, false);
+  return 0;
+}
+
+// Parses a list like 0-3,8 into bits, returns false if invalid
+bool parse_cpu_list(const char *list, cpu_set_t *cpus) {
+  CPU_ZERO(cpus);
+  while (*list != '\0') {
+    char *end;
+    if (!isdigit((unsigned char)*list)) return false;
+    unsigned long first = strtoul(list, &end, 10), last = first;
+    if (*end == '-') {
+      if (!isdigit((unsigned char)end[1])) return false;
+      last = strtoul(end + 1, &end, 10);
+    }
+    if (last < first || last >= CPU_SETSIZE) return false;
+    for (unsigned long cpu = first; cpu <= last; cpu ++) CPU_SET(cpu, cpus);
+    if (*end == ',') end ++;
+    else if (*end != '\0') return false;
+    list = end;
+  }
+  return CPU_COUNT(cpus) > 0;
+}
+
+// Parses a size with an optional K, M, G or T suffix
+bool parse_size(const char *arg, rlim_t *size) {
+  char *end;
+  if (!isdigit((unsigned char)*arg)) return false;
+  unsigned long long value = strtoull(arg, &end, 10);
+  switch (toupper((unsigned char)*end)) {
+    case 'T': value <<= 10; // fallthrough
+    case 'G': value <<= 10; // fallthrough
+    case 'M': value <<= 10; // fallthrough
+    case 'K': value <<= 10; end ++; break;
+  }
+  if (*end == 'B' || *end == 'b') end ++;
+  if (*end != '\0') return false;
+  *size = value;
+  return true;
+}
+
+// Parses idle, be[:level] or rt[:level] into an ioprio value
+bool parse_ioprio(const char *arg, int *ioprio) {
+  static const char *classes[] = { "none", "rt", "be", "idle" };
+  size_t len = strcspn(arg, ":");
+  for (int class = 0; class < 4; class ++) {
+    if (strlen(classes[class]) != len || strncmp(arg, classes[class], len) != 0) continue;
+    long level = class == 2 ? 4 : 0;
+    if (arg[len] == ':') {
+      char *end;
+      level = strtol(arg + len + 1, &end, 10);
+      if (*end != '\0' || level < 0 || level > 7) return false;
+    }
+    *ioprio = class << IOPRIO_CLASS_SHIFT | level;
+    return true;
+  }
+  return false;
+}
+
+void spawn_limits_print(FILE *out, const spawn_limits *limits) {
+  if (limits->has_cpus) {
+    fprintf(out, "--cpus ");
+    const char *sep = "";
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu ++) {
+      if (!CPU_ISSET(cpu, &limits->cpus)) continue;
+      int last = cpu;
+      while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &limits->cpus)) last ++;
+      if (last == cpu) fprintf(out, "%s%d", sep, cpu);
+      else fprintf(out, "%s%d-%d", sep, cpu, last);
+      sep = ",";
+      cpu = last;
+    }
+    fprintf(out, "\n");
+  }
+  if (limits->has_nice) fprintf(out, "--nice %d\n", limits->nice);
+  if (limits->has_mem) fprintf(out, "--mem %llu\n", (unsigned long long)limits->mem);
+  if (limits->has_ioprio) {
+    static const char *classes[] = { "none", "rt", "be", "idle" };
+    fprintf(out, "--ioprio %s:%d\n", classes[limits->ioprio >> IOPRIO_CLASS_SHIFT], limits->ioprio & 7);
+  }
+  if (limits->has_numa) {
+    fprintf(out, "--numa ");
+    const char *sep = "";
+    for (size_t node = 0; node < sizeof(limits->nodes) * 8; node ++) {
+      if (limits->nodes & (1UL << node)) {
+        fprintf(out, "%s%zu", sep, node);
+        sep = ",";
+      }
+    }
+    fprintf(out, "\n");
+  }
+}
+
+int run_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  spawn_limits limits = spawn_defaults;
+  bool set_default = false;
+  size_t i = 1;
+  for (; i < args.size && args.data[i][0] == '-'; i ++) {
+    char *opt = args.data[i];
+    if (strcmp(opt, "--") == 0) {
+      i ++;
+      break;
+    } else if (strcmp(opt, "--default") == 0) {
+      set_default = true;
+      continue;
+    } else if (strcmp(opt, "--reset") == 0) {
+      limits = (spawn_limits){0};
+      continue;
+    }
+    if (i + 1 >= args.size) {
+      fprintf(err, "run: %s: option requires an argument\n", opt);
+      return 2;
+    }
+    char *value = args.data[++ i];
+    bool ok = true;
+    if (strcmp(opt, "--cpus") == 0) {
+      ok = parse_cpu_list(value, &limits.cpus);
+      limits.has_cpus = true;
+    } else if (strcmp(opt, "--nice") == 0) {
+      char *end;
+      limits.nice = strtol(value, &end, 10);
+      ok = end != value && *end == '\0';
+      limits.has_nice = true;
+    } else if (strcmp(opt, "--mem") == 0) {
+      ok = parse_size(value, &limits.mem);
+      limits.has_mem = true;
+    } else if (strcmp(opt, "--ioprio") == 0) {
+      ok = parse_ioprio(value, &limits.ioprio);
+      limits.has_ioprio = true;
+    } else if (strcmp(opt, "--numa") == 0) {
+      cpu_set_t nodes;
+      ok = parse_cpu_list(value, &nodes);
+      limits.nodes = 0;
+      for (size_t node = 0; ok && node < CPU_SETSIZE; node ++) {
+        if (!CPU_ISSET(node, &nodes)) continue;
+        if (node >= sizeof(limits.nodes) * 8) ok = false;
+        else limits.nodes |= 1UL << node;
+      }
+      limits.has_numa = true;
+    } else {
+      fprintf(err, "run: %s: invalid option\n", opt);
+      return 2;
+    }
+    if (!ok) {
+      fprintf(err, "run: %s: invalid value `%s`\n", opt, value);
+      return 2;
+    }
+  }
+
+  if (set_default) {
+    if (i < args.size) {
+      fprintf(err, "run: --default doesn't take a command\n");
+      return 2;
+    }
+    spawn_defaults = limits;
+    spawn_limits_print(out, &spawn_defaults);
+    return 0;
+  }
+  if (i == args.size) {
+    spawn_limits_print(out, &limits);
+    return 0;
+  }
+
+  string_array words = {
+    .data = args.data + i,
+    .size = args.size - i,
+  };
+  spawn_limits *saved = spawn_next;
+  spawn_next = &limits;
+  int ret = execute_command(words, (string_array){0});
+  spawn_next = saved;
+  return ret;
+}
+
+// A number of seconds with an optional s, m, h or d suffix
+bool parse_duration(const char *arg, double *seconds) {
+  char *end;
+  *seconds = strtod(arg, &end);
+  if (end == arg || *seconds < 0) return false;
+  switch (*end) {
+    case '\0':
+    case 's': break;
+    case 'm': *seconds *= 60; break;
+    case 'h': *seconds *= 60 * 60; break;
+    case 'd': *seconds *= 24 * 60 * 60; break;
+    default: return false;
+  }
+  return *end == '\0' || end[1] == '\0';
+}
+
+// A signal name, with or without SIG, or number
+bool parse_signal(const char *arg, int *sig) {
+  char *end;
+  long n = strtol(arg, &end, 10);
+  if (end != arg && *end == '\0') {
+    *sig = n;
+    return n > 0 && n < NSIG;
+  }
+  if (strncasecmp(arg, "SIG", 3) == 0) arg += 3;
+  for (int i = 1; i < NSIG; i ++) {
+    const char *name = sigabbrev_np(i);
+    if (name != NULL && strcasecmp(name, arg) == 0) {
+      *sig = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void timeout_print(FILE *out, const timeout_spec *spec) {
+  if (spec->duration <= 0) {
+    fprintf(out, "no default timeout\n");
+    return;
+  }
+  fprintf(out, "timeout %gs, signal %s", spec->duration, sigabbrev_np(spec->signal));
+  if (spec->kill_after > 0) fprintf(out, ", kill after %gs", spec->kill_after);
+  fprintf(out, "\n");
+}
+
+int timeout_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  timeout_spec spec = { .signal = SIGTERM };
+  bool set_default = false;
+  size_t i = 1;
+  for (; i < args.size && args.data[i][0] == '-' && args.data[i][1] != '\0'; i ++) {
+    char *opt = args.data[i];
+    if (strcmp(opt, "--") == 0) {
+      i ++;
+      break;
+    } else if (strcmp(opt, "--default") == 0) {
+      set_default = true;
+      continue;
+    }
+    if (strcmp(opt, "-s") != 0 && strcmp(opt, "-k") != 0) {
+      fprintf(err, "timeout: %s: invalid option\n", opt);
+      return 125;
+    }
+    if (i + 1 >= args.size) {
+      fprintf(err, "timeout: %s: option requires an argument\n", opt);
+      return 125;
+    }
+    char *value = args.data[++ i];
+    bool ok = opt[1] == 's' ? parse_signal(value, &spec.signal) : parse_duration(value, &spec.kill_after);
+    if (!ok) {
+      fprintf(err, "timeout: %s: invalid value `%s`\n", opt, value);
+      return 125;
+    }
+  }
+
+  if (i == args.size) {
+    if (set_default) {
+      fprintf(err, "timeout: --default requires a duration\n");
+      return 125;
+    }
+    timeout_print(out, &timeout_defaults);
+    return 0;
+  }
+  if (!parse_duration(args.data[i], &spec.duration)) {
+    fprintf(err, "timeout: invalid time interval `%s`\n", args.data[i]);
+    return 125;
+  }
+  i ++;
+  if (set_default) {
+    if (i < args.size) {
+      fprintf(err, "timeout: --default doesn't take a command\n");
+      return 125;
+    }
+    timeout_defaults = spec;
+    return 0;
+  }
+  if (i == args.size) {
+    fprintf(err, "timeout: missing command\n");
+    return 125;
+  }
+
+  string_array words = {
+    .data = args.data + i,
+    .size = args.size - i,
+  };
+  // The deadline is fixed now, so it covers every command a function runs
+  deadline d = deadline_after(&spec);
+  deadline *saved = deadline_next;
+  timeout_spec saved_defaults = timeout_defaults;
+  if (spec.duration > 0) deadline_next = &d;
+  else timeout_defaults.duration = 0;
+  int ret = execute_command(words, (string_array){0});
+  deadline_next = saved;
+  timeout_defaults = saved_defaults;
+  return ret;
+}
+
+typedef struct {
+  char option;
+  int resource;
+  rlim_t unit;
+  const char *description;
+} ulimit_resource;
+
+ulimit_resource ulimit_resources[] = {
+  { 'c', RLIMIT_CORE, 512, "core file size (blocks)" },
+  { 'd', RLIMIT_DATA, 1024, "data seg size (kbytes)" },
+  { 'e', RLIMIT_NICE, 1, "scheduling priority" },
+  { 'f', RLIMIT_FSIZE, 512, "file size (blocks)" },
+  { 'i', RLIMIT_SIGPENDING, 1, "pending signals" },
+  { 'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)" },
+  { 'm', RLIMIT_RSS, 1024, "max memory size (kbytes)" },
+  { 'n', RLIMIT_NOFILE, 1, "open files" },
+  { 'q', RLIMIT_MSGQUEUE, 1, "POSIX message queues (bytes)" },
+  { 'r', RLIMIT_RTPRIO, 1, "real-time priority" },
+  { 's', RLIMIT_STACK, 1024, "stack size (kbytes)" },
+  { 't', RLIMIT_CPU, 1, "cpu time (seconds)" },
+  { 'u', RLIMIT_NPROC, 1, "max user processes" },
+  { 'v', RLIMIT_AS, 1024, "virtual memory (kbytes)" },
+  { 'x', RLIMIT_LOCKS, 1, "file locks" },
+};
+
+void ulimit_print(FILE *out, ulimit_resource *res, bool hard, bool label) {
+  struct rlimit lim;
+  if (getrlimit(res->resource, &lim) == -1) return;
+  rlim_t value = hard ? lim.rlim_max : lim.rlim_cur;
+  if (label) fprintf(out, "%-32s(-%c) ", res->description, res->option);
+  if (value == RLIM_INFINITY) fprintf(out, "unlimited\n");
+  else fprintf(out, "%llu\n", (unsigned long long)(value / res->unit));
+}
+
+// Limits are set on the shell itself, so every later command inherits them
+int ulimit_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  bool soft = false, hard = false, all = false;
+  ulimit_resource *res = &ulimit_resources[3];
+  size_t i = 1;
+  for (; i < args.size && args.data[i][0] == '-' && args.data[i][1] != '\0'; i ++) {
+    for (char *opt = args.data[i] + 1; *opt != '\0'; opt ++) {
+      if (*opt == 'S') {
+        soft = true;
+      } else if (*opt == 'H') {
+        hard = true;
+      } else if (*opt == 'a') {
+        all = true;
+      } else {
+        res = NULL;
+        for (size_t r = 0; r < sizeof(ulimit_resources) / sizeof(ulimit_resources[0]); r ++) {
+          if (ulimit_resources[r].option == *opt) res = &ulimit_resources[r];
+        }
+        if (res == NULL) {
+          fprintf(err, "ulimit: -%c: invalid option\n", *opt);
+          return 2;
+        }
+      }
+    }
+  }
+
+  if (all) {
+    for (size_t r = 0; r < sizeof(ulimit_resources) / sizeof(ulimit_resources[0]); r ++) {
+      ulimit_print(out, &ulimit_resources[r], hard && !soft, true);
+    }
+    return 0;
+  }
+  if (i == args.size) {
+    ulimit_print(out, res, hard && !soft, false);
+    return 0;
+  }
+  if (i + 1 < args.size) {
+    fprintf(err, "ulimit: too many arguments\n");
+    return 2;
+  }
+
+  rlim_t value;
+  if (strcmp(args.data[i], "unlimited") == 0) {
+    value = RLIM_INFINITY;
+  } else {
+    char *end;
+    value = strtoull(args.data[i], &end, 10);
+    if (!isdigit((unsigned char)args.data[i][0]) || *end != '\0') {
+      fprintf(err, "ulimit: %s: invalid number\n", args.data[i]);
+      return 1;
+    }
+    value *= res->unit;
+  }
+  if (!soft && !hard) soft = hard = true;
+  struct rlimit lim;
+  if (getrlimit(res->resource, &lim) == -1) {
+    fprintf(err, "ulimit: %s\n", strerror(errno));
+    return 1;
+  }
+  if (soft) lim.rlim_cur = value;
+  if (hard) lim.rlim_max = value;
+  if (setrlimit(res->resource, &lim) == -1) {
+    fprintf(err, "ulimit: %s: cannot modify limit: %s\n", res->description, strerror(errno));
+    return 1;
+  }
+  rlimits_changed = true;
+  return 0;
+}
+
+int export_command(string_array args) {
+  FILE *out = stdout;
+  if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
+    out = files.data[STDOUT_FILENO];
+  }
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  size_t i = 1;
+  bool exported = true;
+  for (; i < args.size && args.data[i][0] == '-'; i ++) {
+    if (strcmp(args.data[i], "--") == 0) {
+      i ++;
+      break;
+    } else if (strcmp(args.data[i], "-n") == 0) {
+      exported = false;
+    } else if (strcmp(args.data[i], "-p") != 0) {
+      fprintf(err, "%s: %s: invalid option\n", args.data[0], args.data[i]);
+      return 2;
+    }
+  }
+
+  if (i == args.size) {
+    string_array names = {0};
+    for (size_t b = 0; b < vars.capacity; b ++) {
+      for (variable *var = vars.buckets[b]; var != NULL; var = var->next) {
+        if (var->exported) ARRAY_ADD(names, var->name);
+      }
+    }
+    if (names.size > 0) qsort(names.data, names.size, sizeof(names.data[0]), compare_strings);
+    for (size_t n = 0; n < names.size; n ++) {
+      char *value = var_get(names.data[n]);
+      if (value == NULL) {
+        fprintf(out, "export %s\n", names.data[n]);
+        continue;
+      }
+      fprintf(out, "export %s='", names.data[n]);
+      for (char *c = value; *c != '\0'; c ++) {
+        if (*c == '\'') fprintf(out, "'\\''");
+        else fputc(*c, out);
+      }
+      fprintf(out, "'\n");
+    }
+    ARRAY_FREE(names);
+    return 0;
+  }
+
+  int ret = 0;
+  for (; i < args.size; i ++) {
+    char *arg = args.data[i];
+    char *eq = strchr(arg, '=');
+    size_t len = eq == NULL ? strlen(arg) : (size_t)(eq - arg);
+    if (!is_name(arg, len)) {
+      fprintf(err, "%s: `%s': not a valid identifier\n", args.data[0], arg);
+      ret = 1;
+      continue;
+    }
+    char *name = strndup(arg, len);
+    if (eq != NULL) var_set(name, eq + 1);
+    var_export(name, exported);
+    free(name);
+  }
+  return ret;
+}
+
+int unset_command(string_array args) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  size_t i = 1;
+  bool function = false;
+  if (i < args.size && (strcmp(args.data[i], "-v") == 0 || strcmp(args.data[i], "-f") == 0)) {
+    function = args.data[i][1] == 'f';
+    i ++;
+  }
+  int ret = 0;
+  for (; i < args.size; i ++) {
+    if (function) {
+      table_remove(&functions, args.data[i], function_body_free);
+      continue;
+    }
+    if (!is_name(args.data[i], strlen(args.data[i]))) {
+      fprintf(err, "%s: `%s': not a valid identifier\n", args.data[0], args.data[i]);
+      ret = 1;
+      continue;
+    }
+    var_unset(args.data[i]);
+  }
+  return ret;
+}
+
+// Runs a builtin, capturing its output while in $(...). Builtins that could
+// change the shell run in a subshell there, so the change doesn't stick.
+int run_builtin(command_t *cmd, string_array args) {
+  if (capture == NULL || (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL)) {
+    return cmd->function(args);
+  }
+  ARRAY_ENSURE_CAPACITY(files, STDOUT_FILENO + 1);
+  if (files.size <= STDOUT_FILENO) files.size = STDOUT_FILENO + 1;
+
+  if (cmd->pure) {
+    char *buf = NULL;
+    size_t size = 0;
+    files.data[STDOUT_FILENO] = open_memstream(&buf, &size);
+    if (files.data[STDOUT_FILENO] == NULL) {
+      perror("open_memstream");
+      ABORT();
+    }
+    int code = cmd->function(args);
+    fclose(files.data[STDOUT_FILENO]);
+    files.data[STDOUT_FILENO] = NULL;
+    char_array_reserve(capture, size);
+    memcpy(capture->data + capture->size, buf, size);
+    capture->size += size;
+    free(buf);
+    return code;
+  }
+
+  int capture_pipe[2];
+  if (pipe(capture_pipe) != 0) { perror("pipe capture"); ABORT(); }
+  pid_t pid = fork();
+  switch (pid) {
+    case -1:
+      perror("fork");
+      ABORT();
+      UNREACHABLE();
+      return -1;
+
+    case 0: {
+      close(capture_pipe[0]);
+      files.data[STDOUT_FILENO] = fdopen(capture_pipe[1], "w");
+      if (files.data[STDOUT_FILENO] == NULL) { perror("fdopen capture"); abort(); }
+      int code = cmd->function(args);
+      fflush(files.data[STDOUT_FILENO]);
+      _exit(code);
+    }; break;
+
+    default: {
+      close(capture_pipe[1]);
+      capture_read(capture_pipe[0], capture, true);
+      close(capture_pipe[0]);
+      int wstatus = 0;
+      while (waitpid(pid, &wstatus, 0) == -1) {
+        if (errno == EINTR) continue;
+        perror("waitpid builtin");
+        ABORT();
+      }
+      if (WIFEXITED(wstatus)) return WEXITSTATUS(wstatus);
+      if (WIFSIGNALED(wstatus)) return 128 + WTERMSIG(wstatus);
+    }; break;
+  }
+  return 1;
+}
+
+// Takes the preceding io_number word as the fd of a redirect, like 2> or 0<<
+bool redirect_fd(string_array *args, long *fd) {
+  if (args->size > 0) {
+    char *word = args->data[args->size - 1];
+    char *end;
+    long test = strtol(word, &end, 0);
+    if (word != end && *end == '\0') {
+      *fd = test;
+      args->size --;
+      free(args->data[args->size]);
+      args->data[args->size] = NULL;
+    }
+  }
+  if (*fd < 0) {
+    fprintf(stderr, "redirection error, negative file descriptor\n");
+    return false;
+  }
+  return true;
+}
+
+// Reads here-document lines from input up to the delimiter line
+bool read_heredoc(const char *delim, bool strip_tabs, char_array *body) {
+  char_array line = {0};
+  bool ok = true;
+  while (true) {
+    prompt_ps2(false);
+    line.size = 0;
+    char c = EOF;
+    while (!is_eof(input) && (c = read_char(input)) != '\n') {
+      if (c == CTRL_C) {
+        printf("^C\n");
+        ok = false;
+        goto end;
+      }
+      if (c == CTRL_D && line.size == 0) {
+        c = EOF;
+        break;
+      }
+      if (c == CTRL_D) continue;
+      if (strip_tabs && c == '\t' && line.size == 0) continue;
+      ARRAY_ADD(line, c);
+    }
+    if (line.size == strlen(delim) && strncmp(line.data, delim, line.size) == 0) break;
+    if (c != '\n') {
+      if (input->echo) printf("\n");
+      fprintf(stderr, "warning: here-document delimited by end-of-file (wanted `%s`)\n", delim);
+      char_array_reserve(body, line.size);
+      memcpy(body->data + body->size, line.data, line.size);
+      body->size += line.size;
+      break;
+    }
+    ARRAY_ADD(line, '\n');
+    char_array_reserve(body, line.size);
+    memcpy(body->data + body->size, line.data, line.size);
+    body->size += line.size;
+  }
+end:
+  ARRAY_FREE(line);
+  return ok;
+}
+
+// Expands $ and ` in an unquoted here-document body, as if it were double
+// quoted except that " stays literal
+char *heredoc_expand(const char *body, size_t len) {
+  char_array raw = {0};
+  ARRAY_ADD(raw, '"');
+  for (size_t i = 0; i < len; i ++) {
+    size_t end = 0;
+    if (body[i] == '$' && (body[i + 1] == '(' || body[i + 1] == '{')) {
+      end = find_closing(body + i + 1, body[i + 1], body[i + 1] == '(' ? ')' : '}');
+      if (end > 0) end += i + 2;
+    } else if (body[i] == '`') {
+      end = i + 1;
+      while (end < len && body[end] != '`') end += body[end] == '\\' ? 2 : 1;
+      if (end < len) end ++;
+      else end = 0;
+    }
+    if (end > 0) {
+      char_array_reserve(&raw, end - i);
+      memcpy(raw.data + raw.size, body + i, end - i);
+      raw.size += end - i;
+      i = end - 1;
+    } else if (body[i] == '\\' && body[i + 1] == '\n') {
+      i ++;
+    } else if (body[i] == '\\' && body[i + 1] == '"') {
+      ARRAY_ADD(raw, '\\');
+      ARRAY_ADD(raw, '\\');
+    } else if (body[i] == '"') {
+      ARRAY_ADD(raw, '\\');
+      ARRAY_ADD(raw, '"');
+    } else if (body[i] == '\\' && i + 1 < len) {
+      ARRAY_ADD(raw, body[i]);
+      ARRAY_ADD(raw, body[++ i]);
+    } else {
+      ARRAY_ADD(raw, body[i]);
+    }
+  }
+  ARRAY_ADD(raw, '"');
+  ARRAY_ADD(raw, '\0');
+  char *ret = expand_word_single(raw.data);
+  ARRAY_FREE(raw);
+  return ret;
+}
+
+// Hands a here-document to a command as a readable FILE. Small bodies fit in
+// a pipe; bigger ones are written once to an anonymous memfd, which is also
+// seekable. Nothing touches the disk.
+FILE *heredoc_open(const char *body, size_t len) {
+  int fd = -1;
+  if (len <= PIPE_BUF) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) { perror("heredoc pipe"); return NULL; }
+    if (len > 0 && write(fds[1], body, len) != (ssize_t)len) {
+      perror("heredoc write");
+      close(fds[0]);
+      close(fds[1]);
+      return NULL;
+    }
+    close(fds[1]);
+    fd = fds[0];
+  } else {
+    fd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fd == -1) { perror("heredoc memfd_create"); return NULL; }
+    size_t off = 0;
+    while (off < len) {
+      ssize_t n = write(fd, body + off, len - off);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) {
+        perror("heredoc write");
+        close(fd);
+        return NULL;
+      }
+      off += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+  }
+  FILE *f = fdopen(fd, "r");
+  if (f == NULL) {
+    perror("heredoc fdopen");
+    close(fd);
+  }
+  return f;
+}
+
+struct node;
+int function_call(struct node *body, string_array words, string_array assigns);
+
+// Makes the redirections of the running command those of the shell itself
+void files_make_permanent(void) {
+  for (size_t i = 0; i < files.size; i ++) {
+    if (files.data[i] == NULL) continue;
+    fflush(files.data[i]);
+    int fd = fileno(files.data[i]);
+    if (fd == -1) continue;
+    if ((size_t)fd == i) {
+      fcntl(fd, F_SETFD, 0);
+    } else if (dup2(fd, i) == -1) {
+      perror("dup2 files");
+      ABORT();
+    }
+  }
+}
+
+// Replaces the shell with the program, keeping the redirections in effect.
+// Only returns if it couldn't be run.
+int exec_program(const char *file_path, string_array args, char **envp) {
+  SBO_ARRAY(char *, 8) argv;
+  SBO_ARRAY_INIT(argv);
+  for (size_t i = 0; i < args.size; i ++) {
+    SBO_ARRAY_ADD(argv, args.data[i]);
+  }
+  SBO_ARRAY_ADD(argv, NULL);
+  fflush(NULL);
+  files_make_permanent();
+  spawn_limits_apply(spawn_next != NULL ? spawn_next : &spawn_defaults);
+  struct termios raw;
+  bool restored = old_termios_ptr != NULL && tcgetattr(STDIN_FILENO, &raw) == 0 &&
+    tcsetattr(STDIN_FILENO, TCSANOW, old_termios_ptr) == 0;
+  execve(file_path, argv.data, envp);
+  int code = errno == ENOENT ? 127 : 126;
+  fprintf(stderr, "%s: %s\n", args.data[0], strerror(errno));
+  if (restored) tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  SBO_ARRAY_FREE(argv);
+  return code;
+}
+
+// Runs a command from PATH, or with `replace` execs it in place of the shell
+int execute_program(string_array words, char **envp, bool replace) {
+  char *command = words.data[0];
+  int code = -1;
+  if (strchr(command, '/') != NULL && access(command, R_OK | X_OK) == 0) {
+    struct stat command_stat;
+    if (stat(command, &command_stat) == -1) {
+      perror("stat");
+      ABORT();
+    }
+
+    if ((command_stat.st_mode & S_IFMT) == S_IFDIR) {
+      fprintf(stderr, "%s: is a directory\n", command);
+      code = 126;
+    } else {
+      code = replace ? exec_program(command, words, envp) : run_program(command, words, envp);
+    }
+  } else {
+    const char *file_path = path_hashed(command, true);
+    if (file_path != NULL) code = replace ? exec_program(file_path, words, envp) : run_program(file_path, words, envp);
+
+    if (code == -1) {
+      fprintf(stderr, "%s: command not found\n", command);
+      code = 127;
+    }
+  }
+  return code;
+}
+
+// In -c and script mode the last command is exec'd instead of forked
+bool tail_exec = false;
+// Set for a command that should take over the shell's process if it turns
+// out to be a program, rather than be forked and waited for
+bool exec_replace = false;
+
+// Runs a command that has been expanded into words, with assignments for
+// its environment. Functions come first, then builtins, then PATH.
+int execute_command(string_array words, string_array assigns) {
+  char *command = words.data[0];
+  bool replace = exec_replace;
+  exec_replace = false;
+
+  table_entry *function = table_lookup(&functions, command);
+  if (function != NULL) return function_call(function->value, words, assigns);
+
+  int code = -1;
+  for (size_t i = 0; i < builtins.size; i ++) {
+    if (strcmp(command, builtins.data[i].command) == 0) {
+      // Assignments only last for the builtin
+      SBO_ARRAY(char *, 8) saved;
+      SBO_ARRAY_INIT(saved);
+      for (size_t a = 0; a < assigns.size; a ++) {
+        char *eq = strchr(assigns.data[a], '=');
+        *eq = '\0';
+        char *old = var_get(assigns.data[a]);
+        SBO_ARRAY_ADD(saved, old == NULL ? NULL : strdup(old));
+        var_set(assigns.data[a], eq + 1);
+        *eq = '=';
+      }
+      code = run_builtin(&builtins.data[i], words);
+      for (size_t a = 0; a < assigns.size; a ++) {
+        char *eq = strchr(assigns.data[a], '=');
+        *eq = '\0';
+        if (saved.data[a] == NULL) var_unset(assigns.data[a]);
+        else var_set(assigns.data[a], saved.data[a]);
+        *eq = '=';
+        free(saved.data[a]);
+      }
+      SBO_ARRAY_FREE(saved);
+      break;
+    }
+  }
+  if (code == -1) {
+    char **envp = assigns.size > 0 ? shell_environ_with(assigns) : shell_environ();
+    code = execute_program(words, envp, replace);
+    if (assigns.size > 0) free(envp);
+  }
+  return code;
+}
+
+// Without a command the redirections are kept for the rest of the shell.
+// A script can't carry on when the command can't be run, like other shells.
+int exec_command(string_array args) {
+  size_t i = 1;
+  if (i < args.size && strcmp(args.data[i], "--") == 0) i ++;
+  if (i == args.size) {
+    files_make_permanent();
+    return 0;
+  }
+  string_array words = { .data = args.data + i, .size = args.size - i, .capacity = args.size - i };
+  int code = execute_program(words, shell_environ(), true);
+  if (tail_exec) {
+    cleanup();
+    exit(code);
+  }
+  return code;
+}
+
+// Children started by coproc, talking to the shell over a pair of pipes.
+// The shell's ends are non-blocking and close-on-exec, and are in NAME_0
+// (its output) and NAME_1 (its input), to be used as /dev/fd/N. Once it
+// exits it is reaped from the event loop, or between command lines, and
+// only its output is left open to read what it wrote last.
+typedef struct {
+  char *name;
+  pid_t pid;
+  int pidfd;
+  int fds[2];
+} coprocess;
+ARRAY(coprocess) coprocs = {0};
+
+void coproc_var_set(const char *name, const char *suffix, long value) {
+  char *var = NULL;
+  char *text = NULL;
+  assert(asprintf(&var, "%s_%s", name, suffix) != -1);
+  assert(asprintf(&text, "%ld", value) != -1);
+  var_set(var, text);
+  free(var);
+  free(text);
+}
+
+void coproc_var_unset(const char *name, const char *suffix) {
+  char *var = NULL;
+  assert(asprintf(&var, "%s_%s", name, suffix) != -1);
+  var_unset(var);
+  free(var);
+}
+
+void coproc_exited(coprocess *co) {
+  int wstatus;
+  while (waitpid(co->pid, &wstatus, 0) == -1 && errno == EINTR);
+  if (co->pidfd != -1) {
+    event_source_remove(co->pidfd);
+    close(co->pidfd);
+    co->pidfd = -1;
+  }
+  close(co->fds[1]);
+  co->fds[1] = -1;
+  co->pid = 0;
+  coproc_var_unset(co->name, "PID");
+  coproc_var_unset(co->name, "1");
+}
+
+void coproc_event(int fd) {
+  for (size_t i = 0; i < coprocs.size; i ++) {
+    if (coprocs.data[i].pidfd == fd) {
+      coproc_exited(&coprocs.data[i]);
+      return;
+    }
+  }
+}
+
+// For scripts, which never wait in the event loop
+void coprocs_reap(void) {
+  for (size_t i = 0; i < coprocs.size; i ++) {
+    coprocess *co = &coprocs.data[i];
+    siginfo_t info = {0};
+    if (co->pid > 0 && waitid(P_PID, co->pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == co->pid) {
+      coproc_exited(co);
+    }
+  }
+}
+
+void coprocs_free(void) {
+  for (size_t i = 0; i < coprocs.size; i ++) {
+    coprocess *co = &coprocs.data[i];
+    if (co->pidfd != -1) {
+      event_source_remove(co->pidfd);
+      close(co->pidfd);
+    }
+    if (co->fds[0] != -1) close(co->fds[0]);
+    if (co->fds[1] != -1) close(co->fds[1]);
+    free(co->name);
+  }
+  ARRAY_FREE(coprocs);
+}
+
+// A NAME is only taken as one when it isn't also a command
+bool coproc_is_name(string_array args) {
+  if (args.size < 3 || !is_name(args.data[1], strlen(args.data[1]))) return false;
+  const char *word = args.data[1];
+  if (table_lookup(&functions, word) != NULL) return false;
+  for (size_t i = 0; i < builtins.size; i ++) {
+    if (strcmp(word, builtins.data[i].command) == 0) return false;
+  }
+  return path_hashed(word, false) == NULL;
+}
+
+int coproc_command(string_array args) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+  if (args.size < 2) {
+    fprintf(err, "coproc: usage: coproc [NAME] command [args]\n");
+    return 2;
+  }
+  size_t first = coproc_is_name(args) ? 2 : 1;
+  const char *name = first == 2 ? args.data[1] : "COPROC";
+
+  coprocess *co = NULL;
+  for (size_t i = 0; i < coprocs.size; i ++) {
+    if (strcmp(coprocs.data[i].name, name) == 0) co = &coprocs.data[i];
+  }
+  if (co != NULL && co->pid > 0) {
+    fprintf(err, "coproc: %s: still running as %d\n", name, (int)co->pid);
+    return 1;
+  }
+
+  int in[2];
+  int out[2];
+  if (pipe2(in, O_CLOEXEC) != 0) { perror("coproc pipe"); ABORT(); }
+  if (pipe2(out, O_CLOEXEC) != 0) { perror("coproc pipe"); ABORT(); }
+  fflush(NULL);
+  pid_t pid = fork();
+  switch (pid) {
+    case -1:
+      perror("fork");
+      ABORT();
+      UNREACHABLE();
+      return -1;
+
+    case 0: {
+      if (dup2(in[0], STDIN_FILENO) == -1) { perror("coproc dup2 stdin"); abort(); }
+      if (dup2(out[1], STDOUT_FILENO) == -1) { perror("coproc dup2 stdout"); abort(); }
+      // A builtin or function doesn't exec, so nothing is closed for it: its
+      // input only ends once no other end of it is left open here
+      int ends[4] = { in[0], in[1], out[0], out[1] };
+      for (int i = 0; i < 4; i ++) {
+        if (ends[i] != STDIN_FILENO && ends[i] != STDOUT_FILENO) close(ends[i]);
+      }
+      for (size_t i = 0; i < coprocs.size; i ++) {
+        for (int f = 0; f < 2; f ++) {
+          if (coprocs.data[i].fds[f] > STDOUT_FILENO) close(coprocs.data[i].fds[f]);
+        }
+      }
+      files_make_permanent();
+      stdin_buf = (read_buffer){ .fd = STDIN_FILENO };
+      string_array words = { .data = args.data + first, .size = args.size - first, .capacity = args.size - first };
+      exec_replace = true;
+      int code = execute_command(words, (string_array){0});
+      fflush(NULL);
+      _exit(code);
+    }; break;
+
+    default:
+      break;
+  }
+  close(in[0]);
+  close(out[1]);
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  fcntl(out[0], F_SETFL, O_NONBLOCK);
+
+  if (co == NULL) {
+    ARRAY_ADD(coprocs, ((coprocess){ .name = strdup(name), .pidfd = -1, .fds = { -1, -1 } }));
+    co = &coprocs.data[coprocs.size - 1];
+  } else if (co->fds[0] != -1) {
+    close(co->fds[0]);
+  }
+  co->pid = pid;
+  co->fds[0] = out[0];
+  co->fds[1] = in[1];
+  co->pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (co->pidfd != -1) event_source_add(co->pidfd, coproc_event);
+  coproc_var_set(name, "PID", pid);
+  coproc_var_set(name, "0", out[0]);
+  coproc_var_set(name, "1", in[1]);
+  return 0;
+}
+
+// Command lines are parsed into an AST once and then run from it, so the
+// bodies of loops aren't lexed again on every iteration.
+typedef enum {
+  TOKEN_WORD,
+  TOKEN_OP,
+  TOKEN_NEWLINE,
+  TOKEN_END,
+} token_type;
+
+typedef struct {
+  token_type type;
+  char *text; // raw word or operator
+  bool io_number; // WORD: digits right before < or >, as in 2>
+} token;
+
+typedef enum {
+  REDIRECT_IN,
+  REDIRECT_OUT,
+  REDIRECT_APPEND,
+  REDIRECT_HEREDOC,
+  REDIRECT_HERESTRING,
+} redirect_type;
+
+typedef struct {
+  redirect_type type;
+  long fd;
+  char *word;      // raw file name, here-string or here-document delimiter
+  char *body;      // here-document body, expanded each time it is used
+  size_t body_len;
+  bool quoted;     // the here-document delimiter was quoted, so no expansion
+  bool strip_tabs; // <<-
+} redirect;
+
+typedef enum {
+  NODE_COMMAND,
+  NODE_PIPELINE,
+  NODE_AND,
+  NODE_OR,
+  NODE_NOT,
+  NODE_LIST,
+  NODE_GROUP,
+  NODE_SUBSHELL,
+  NODE_IF,
+  NODE_WHILE,
+  NODE_UNTIL,
+  NODE_FOR,
+  NODE_CASE,
+  NODE_FUNCTION,
+  NODE_ARITH,
+  NODE_ARITH_FOR,
+} node_type;
+
+typedef struct node {
+  node_type type;
+  string_array words;            // COMMAND: raw words, FOR: raw words after `in`, ARITH_FOR: the 3 expressions
+  ARRAY(redirect) redirects;
+  ARRAY(struct node *) children; // IF: condition, body pairs then any else body
+  char *name;                    // FOR: variable, CASE: raw word, FUNCTION: name, ARITH: expression
+  ARRAY(string_array) patterns;  // CASE: raw patterns of each arm, with bodies as the children
+  bool has_in;                   // FOR: has an `in` list
+  bool tail;                     // COMMAND: the last thing a script will run
+  size_t refs;                   // owners other than the parent, eg a function's body
+} node;
+
+node *node_new(node_type type) {
+  node *n = calloc(1, sizeof(node));
+  assert(n != NULL);
+  n->type = type;
+  return n;
+}
+
+void node_free(node *n) {
+  if (n == NULL) return;
+  if (n->refs > 0) {
+    n->refs --;
+    return;
+  }
+  free_string_array(&n->words);
+  for (size_t i = 0; i < n->redirects.size; i ++) {
+    free(n->redirects.data[i].word);
+    free(n->redirects.data[i].body);
+  }
+  ARRAY_FREE(n->redirects);
+  for (size_t i = 0; i < n->children.size; i ++) {
+    node_free(n->children.data[i]);
+  }
+  ARRAY_FREE(n->children);
+  free(n->name);
+  for (size_t i = 0; i < n->patterns.size; i ++) {
+    free_string_array(&n->patterns.data[i]);
+  }
+  ARRAY_FREE(n->patterns);
+  free(n);
+}
+
+void function_body_free(void *body) {
+  node_free(body);
+}
+
+void functions_free(void) {
+  table_clear(&functions, function_body_free);
+  free_string_array(&positional);
+}
+
+typedef struct {
+  node *node;
+  size_t index;
+} pending_heredoc;
+
+typedef struct {
+  token tok;
+  bool peeked;
+  bool error;
+  bool syntax_error;
+  bool newline; // a newline was read, so show PS2 before reading more
+  bool at_eol;  // the last token read ended the line
+  bool io_number; // the last token taken was an io_number word
+  ARRAY(pending_heredoc) heredocs; // bodies are read after the next newline
+} parser;
+
+bool is_operator(const char *text) {
+  static const char *ops[] = {
+    ";", ";;", "&", "&&", "|", "||", "(", ")", "<", "<<", "<<-", "<<<", ">", ">>",
+  };
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i ++) {
+    if (strcmp(text, ops[i]) == 0) return true;
+  }
+  return false;
+}
+
+bool is_redirect_operator(const token *tok) {
+  return tok->type == TOKEN_OP && (tok->text[0] == '<' || tok->text[0] == '>');
+}
+
+void parser_free(parser *p) {
+  if (p->peeked) free(p->tok.text);
+  ARRAY_FREE(p->heredocs);
+}
+
+void parser_syntax_error(parser *p, const token *tok) {
+  if (p->error) return;
+  if (tok->type == TOKEN_END) {
+    fprintf(stderr, "syntax error: unexpected end of file\n");
+  } else {
+    fprintf(stderr, "syntax error near unexpected token `%s'\n", tok->type == TOKEN_NEWLINE ? "newline" : tok->text);
+  }
+  p->error = true;
+  p->syntax_error = true;
+}
+
+void parser_read_heredocs(parser *p) {
+  for (size_t i = 0; i < p->heredocs.size && !p->error; i ++) {
+    redirect *r = &p->heredocs.data[i].node->redirects.data[p->heredocs.data[i].index];
+    char *delim = expand_word_single(r->word);
+    if (delim == NULL) {
+      p->error = true;
+      break;
+    }
+    char_array body = {0};
+    if (!read_heredoc(delim, r->strip_tabs, &body)) p->error = true;
+    free(delim);
+    r->body_len = body.size;
+    ARRAY_ADD(body, '\0');
+    r->body = body.data;
+  }
+  p->heredocs.size = 0;
+}
+
+// Looks at the next token, `command` is whether it is in command position
+token *parser_peek(parser *p, bool command) {
+  if (p->peeked) return &p->tok;
+  p->peeked = true;
+  p->tok = (token){ .type = TOKEN_END };
+  if (p->error) return &p->tok;
+  if (p->newline) {
+    p->newline = false;
+    prompt_ps2(false);
+  }
+  // Tabs complete at the terminal, elsewhere they are blanks
+  const char *delim = input->echo && !input_pasted(input) ? " \n" : " \t\n";
+  while (true) {
+    while (!is_eof(input) && peek_char(input) != '\n' && strchr(delim, peek_char(input)) != NULL) {
+      read_char(input);
+    }
+    if (is_eof(input) || peek_char(input) != '#') break;
+    while (!is_eof(input) && peek_char(input) != '\n') read_char(input);
+  }
+  p->at_eol = true;
+  if (is_eof(input)) return &p->tok;
+  if (peek_char(input) != '\n') {
+    bool quoted, escaped;
+    bool error = false;
+    quote_mode quote = UNQUOTED;
+    char *arg = read_arg(delim, &quoted, &escaped, &quote, &error, command);
+    if (error) {
+      p->error = true;
+      free(arg);
+      return &p->tok;
+    }
+    if (arg != NULL) {
+      p->at_eol = false;
+      p->tok.type = is_operator(arg) ? TOKEN_OP : TOKEN_WORD;
+      p->tok.text = arg;
+      if (p->tok.type == TOKEN_WORD && !quoted && !escaped && !is_eof(input)) {
+        char next = peek_char(input);
+        p->tok.io_number = (next == '<' || next == '>') && strspn(arg, "0123456789") == strlen(arg);
+      }
+      return &p->tok;
+    }
+    // ^D on an empty line, or a newline after tabs
+    if (is_eof(input)) return &p->tok;
+  } else {
+    read_char(input);
+  }
+  p->tok.type = TOKEN_NEWLINE;
+  parser_read_heredocs(p);
+  p->newline = true;
+  return &p->tok;
+}
+
+void parser_skip(parser *p) {
+  p->io_number = false;
+  free(p->tok.text);
+  p->tok.text = NULL;
+  p->peeked = false;
+}
+
+// Takes the text of the peeked token
+char *parser_take(parser *p) {
+  p->io_number = p->tok.io_number;
+  char *text = p->tok.text;
+  p->tok.text = NULL;
+  p->peeked = false;
+  return text;
+}
+
+// Whether the next token is the reserved word `word`
+bool parser_keyword(parser *p, const char *word) {
+  token *tok = parser_peek(p, true);
+  return tok->type == TOKEN_WORD && strcmp(tok->text, word) == 0;
+}
+
+bool parser_op(parser *p, const char *op, bool command) {
+  token *tok = parser_peek(p, command);
+  return tok->type == TOKEN_OP && strcmp(tok->text, op) == 0;
+}
+
+bool parser_expect(parser *p, const char *word) {
+  if (parser_keyword(p, word)) {
+    parser_skip(p);
+    return true;
+  }
+  parser_syntax_error(p, &p->tok);
+  return false;
+}
+
+void parser_newlines(parser *p) {
+  while (!p->error && parser_peek(p, true)->type == TOKEN_NEWLINE) parser_skip(p);
+}
+
+// Whether the next token ends a list, like `fi`, `done` or `;;`
+bool parser_at_terminator(parser *p) {
+  static const char *words[] = { "then", "elif", "else", "fi", "do", "done", "esac", "}" };
+  token *tok = parser_peek(p, true);
+  if (tok->type == TOKEN_END) return true;
+  if (tok->type == TOKEN_OP) return strcmp(tok->text, ")") == 0 || strcmp(tok->text, ";;") == 0;
+  if (tok->type != TOKEN_WORD) return false;
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i ++) {
+    if (strcmp(tok->text, words[i]) == 0) return true;
+  }
+  return false;
+}
+
+node *parse_and_or(parser *p);
+
+// Commands separated by ; or newlines, up to a terminator
+node *parse_list(parser *p) {
+  node *list = node_new(NODE_LIST);
+  while (!p->error) {
+    parser_newlines(p);
+    if (p->error || parser_at_terminator(p)) break;
+    ARRAY_ADD(list->children, parse_and_or(p));
+    token *tok = parser_peek(p, false);
+    if (tok->type == TOKEN_NEWLINE || (tok->type == TOKEN_OP && strcmp(tok->text, ";") == 0)) {
+      parser_skip(p);
+    } else if (tok->type == TOKEN_OP && strcmp(tok->text, "&") == 0) {
+      fprintf(stderr, "syntax error: background jobs are not supported\n");
+      p->error = true;
+      p->syntax_error = true;
+    } else {
+      break;
+    }
+  }
+  return list;
+}
+
+void parse_redirect(parser *p, node *n) {
+  bool io_number = p->io_number;
+  char *op = parser_take(p);
+  redirect r = {
+    .fd = op[0] == '<' ? STDIN_FILENO : STDOUT_FILENO,
+  };
+  if (strcmp(op, "<") == 0) r.type = REDIRECT_IN;
+  else if (strcmp(op, "<<<") == 0) r.type = REDIRECT_HERESTRING;
+  else if (op[0] == '<') r.type = REDIRECT_HEREDOC;
+  else r.type = op[1] == '>' ? REDIRECT_APPEND : REDIRECT_OUT;
+  r.strip_tabs = strcmp(op, "<<-") == 0;
+  free(op);
+  if (io_number && !redirect_fd(&n->words, &r.fd)) {
+    p->error = true;
+    return;
+  }
+  token *tok = parser_peek(p, false);
+  if (tok->type != TOKEN_WORD) {
+    parser_syntax_error(p, tok);
+    return;
+  }
+  r.word = parser_take(p);
+  // Any quoting of the delimiter means the body is taken literally
+  if (r.type == REDIRECT_HEREDOC) r.quoted = strpbrk(r.word, "'\"\\") != NULL;
+  ARRAY_ADD(n->redirects, r);
+  if (r.type == REDIRECT_HEREDOC) {
+    ARRAY_ADD(p->heredocs, ((pending_heredoc){ .node = n, .index = n->redirects.size - 1 }));
+  }
+}
+
+node *parse_command(parser *p);
+
+// name() compound-command, with the name already read into n
+node *parse_function(parser *p, node *n) {
+  n->type = NODE_FUNCTION;
+  n->name = n->words.data[0];
+  n->words.size = 0;
+  if (!is_name(n->name, strlen(n->name))) {
+    parser_syntax_error(p, parser_peek(p, false));
+    return n;
+  }
+  if (parser_op(p, "(", false)) {
+    parser_skip(p);
+    if (!parser_op(p, ")", false)) {
+      parser_syntax_error(p, &p->tok);
+      return n;
+    }
+    parser_skip(p);
+  }
+  parser_newlines(p);
+  if (p->error) return n;
+  node *body = parse_command(p);
+  if (body != NULL) ARRAY_ADD(n->children, body);
+  if (!p->error && (body == NULL || body->type == NODE_COMMAND)) {
+    parser_syntax_error(p, &p->tok);
+  }
+  return n;
+}
+
+node *parse_simple(parser *p) {
+  node *n = node_new(NODE_COMMAND);
+  while (!p->error) {
+    token *tok = parser_peek(p, n->words.size == 0);
+    if (tok->type == TOKEN_WORD) {
+      ARRAY_ADD(n->words, parser_take(p));
+      if (n->words.size == 1 && n->redirects.size == 0 && parser_op(p, "(", false)) {
+        return parse_function(p, n);
+      }
+    } else if (is_redirect_operator(tok)) {
+      parse_redirect(p, n);
+    } else {
+      break;
+    }
+  }
+  if (!p->error && n->words.size == 0 && n->redirects.size == 0) parser_syntax_error(p, &p->tok);
+  return n;
+}
+
+node *parse_if(parser *p) {
+  node *n = node_new(NODE_IF);
+  parser_skip(p);
+  ARRAY_ADD(n->children, parse_list(p));
+  if (!parser_expect(p, "then")) return n;
+  ARRAY_ADD(n->children, parse_list(p));
+  while (!p->error && parser_keyword(p, "elif")) {
+    parser_skip(p);
+    ARRAY_ADD(n->children, parse_list(p));
+    if (!parser_expect(p, "then")) return n;
+    ARRAY_ADD(n->children, parse_list(p));
+  }
+  if (!p->error && parser_keyword(p, "else")) {
+    parser_skip(p);
+    ARRAY_ADD(n->children, parse_list(p));
+  }
+  parser_expect(p, "fi");
+  return n;
+}
+
+// while and until: the condition, then the body
+node *parse_loop(parser *p, node_type type) {
+  node *n = node_new(type);
+  parser_skip(p);
+  ARRAY_ADD(n->children, parse_list(p));
+  if (!parser_expect(p, "do")) return n;
+  ARRAY_ADD(n->children, parse_list(p));
+  parser_expect(p, "done");
+  return n;
+}
+
+// Reads the rest of ((...)) after its first ( has been peeked, giving the
+// raw expression
+bool parser_read_arith(parser *p, char **text) {
+  parser_skip(p);
+  char_array body = {0};
+  if (!_read_balanced(&body, '(', ')')) {
+    ARRAY_FREE(body);
+    p->error = true;
+    return false;
+  }
+  if (is_eof(input) || peek_char(input) != ')') {
+    ARRAY_FREE(body);
+    fprintf(stderr, "syntax error: expected `))'\n");
+    p->error = true;
+    p->syntax_error = true;
+    return false;
+  }
+  read_char(input);
+  p->at_eol = false;
+  *text = strndup(body.data + 1, body.size - 2);
+  ARRAY_FREE(body);
+  return true;
+}
+
+// Whether the peeked token is the start of ((
+bool parser_at_arith(parser *p) {
+  return parser_op(p, "(", true) && !is_eof(input) && peek_char(input) == '(';
+}
+
+// for ((init; condition; step)), with the expressions split at the top
+// level semicolons
+node *parse_arith_for(parser *p, node *n) {
+  n->type = NODE_ARITH_FOR;
+  char *text = NULL;
+  if (!parser_read_arith(p, &text)) return n;
+  int depth = 0;
+  const char *start = text;
+  for (const char *c = text; ; c ++) {
+    if (*c == '(') depth ++;
+    else if (*c == ')') depth --;
+    else if ((*c == ';' && depth == 0) || *c == '\0') {
+      ARRAY_ADD(n->words, strndup(start, c - start));
+      start = c + 1;
+    }
+    if (*c == '\0') break;
+  }
+  free(text);
+  if (n->words.size != 3) {
+    fprintf(stderr, "syntax error: for ((init; condition; step)) expected\n");
+    p->error = true;
+    p->syntax_error = true;
+    return n;
+  }
+  if (parser_op(p, ";", false)) parser_skip(p);
+  parser_newlines(p);
+  if (!parser_expect(p, "do")) return n;
+  ARRAY_ADD(n->children, parse_list(p));
+  parser_expect(p, "done");
+  return n;
+}
+
+node *parse_for(parser *p) {
+  node *n = node_new(NODE_FOR);
+  parser_skip(p);
+  if (parser_at_arith(p)) return parse_arith_for(p, n);
+  token *tok = parser_peek(p, false);
+  if (tok->type != TOKEN_WORD || !is_name(tok->text, strlen(tok->text))) {
+    parser_syntax_error(p, tok);
+    return n;
+  }
+  n->name = parser_take(p);
+  parser_newlines(p);
+  if (parser_keyword(p, "in")) {
+    parser_skip(p);
+    n->has_in = true;
+    while (!p->error && parser_peek(p, false)->type == TOKEN_WORD) {
+      ARRAY_ADD(n->words, parser_take(p));
+    }
+    tok = parser_peek(p, false);
+    if (tok->type == TOKEN_NEWLINE || (tok->type == TOKEN_OP && strcmp(tok->text, ";") == 0)) {
+      parser_skip(p);
+    } else {
+      parser_syntax_error(p, tok);
+      return n;
+    }
+  } else if (parser_op(p, ";", false)) {
+    parser_skip(p);
+  }
+  parser_newlines(p);
+  if (!parser_expect(p, "do")) return n;
+  ARRAY_ADD(n->children, parse_list(p));
+  parser_expect(p, "done");
+  return n;
+}
+
+node *parse_case(parser *p) {
+  node *n = node_new(NODE_CASE);
+  parser_skip(p);
+  token *tok = parser_peek(p, false);
+  if (tok->type != TOKEN_WORD) {
+    parser_syntax_error(p, tok);
+    return n;
+  }
+  n->name = parser_take(p);
+  parser_newlines(p);
+  if (!parser_expect(p, "in")) return n;
+  parser_newlines(p);
+  while (!p->error && !parser_keyword(p, "esac")) {
+    if (parser_op(p, "(", true)) parser_skip(p);
+    string_array patterns = {0};
+    while (!p->error) {
+      tok = parser_peek(p, false);
+      if (tok->type != TOKEN_WORD) {
+        parser_syntax_error(p, tok);
+        break;
+      }
+      ARRAY_ADD(patterns, parser_take(p));
+      if (!parser_op(p, "|", false)) break;
+      parser_skip(p);
+    }
+    ARRAY_ADD(n->patterns, patterns);
+    if (p->error) break;
+    if (!parser_op(p, ")", false)) {
+      parser_syntax_error(p, &p->tok);
+      break;
+    }
+    parser_skip(p);
+    ARRAY_ADD(n->children, parse_list(p));
+    if (parser_op(p, ";;", true)) {
+      parser_skip(p);
+    } else if (!parser_keyword(p, "esac")) {
+      parser_syntax_error(p, &p->tok);
+      break;
+    }
+    parser_newlines(p);
+  }
+  parser_expect(p, "esac");
+  return n;
+}
+
+node *parse_command(parser *p) {
+  token *tok = parser_peek(p, true);
+  node *n = NULL;
+  if (tok->type == TOKEN_WORD) {
+    if (strcmp(tok->text, "if") == 0) {
+      n = parse_if(p);
+    } else if (strcmp(tok->text, "while") == 0) {
+      n = parse_loop(p, NODE_WHILE);
+    } else if (strcmp(tok->text, "until") == 0) {
+      n = parse_loop(p, NODE_UNTIL);
+    } else if (strcmp(tok->text, "for") == 0) {
+      n = parse_for(p);
+    } else if (strcmp(tok->text, "case") == 0) {
+      n = parse_case(p);
+    } else if (strcmp(tok->text, "function") == 0) {
+      parser_skip(p);
+      tok = parser_peek(p, false);
+      if (tok->type != TOKEN_WORD) {
+        parser_syntax_error(p, tok);
+        return NULL;
+      }
+      n = node_new(NODE_COMMAND);
+      ARRAY_ADD(n->words, parser_take(p));
+      // Any redirects after the body have been taken by it
+      return parse_function(p, n);
+    } else if (strcmp(tok->text, "{") == 0) {
+      n = node_new(NODE_GROUP);
+      parser_skip(p);
+      ARRAY_ADD(n->children, parse_list(p));
+      parser_expect(p, "}");
+    } else if (parser_at_terminator(p)) {
+      parser_syntax_error(p, tok);
+      return NULL;
+    }
+  } else if (parser_at_arith(p)) {
+    n = node_new(NODE_ARITH);
+    parser_read_arith(p, &n->name);
+  } else if (tok->type == TOKEN_OP && strcmp(tok->text, "(") == 0) {
+    n = node_new(NODE_SUBSHELL);
+    parser_skip(p);
+    ARRAY_ADD(n->children, parse_list(p));
+    if (parser_op(p, ")", true)) parser_skip(p);
+    else parser_syntax_error(p, &p->tok);
+  } else if (!is_redirect_operator(tok)) {
+    parser_syntax_error(p, tok);
+    return NULL;
+  }
+  if (n == NULL) return parse_simple(p);
+  // Redirects of a compound command
+  while (!p->error && is_redirect_operator(parser_peek(p, false))) parse_redirect(p, n);
+  return n;
+}
+
+node *parse_pipeline(parser *p) {
+  bool negate = false;
+  if (parser_keyword(p, "!")) {
+    parser_skip(p);
+    negate = true;
+  }
+  node *ret = parse_command(p);
+  if (!p->error && parser_op(p, "|", false)) {
+    node *pipeline = node_new(NODE_PIPELINE);
+    ARRAY_ADD(pipeline->children, ret);
+    while (!p->error && parser_op(p, "|", false)) {
+      parser_skip(p);
+      parser_newlines(p);
+      ARRAY_ADD(pipeline->children, parse_command(p));
+    }
+    ret = pipeline;
+  }
+  if (negate) {
+    node *n = node_new(NODE_NOT);
+    ARRAY_ADD(n->children, ret);
+    ret = n;
+  }
+  return ret;
+}
+
+node *parse_and_or(parser *p) {
+  node *left = parse_pipeline(p);
+  while (!p->error) {
+    token *tok = parser_peek(p, false);
+    if (tok->type != TOKEN_OP || (strcmp(tok->text, "&&") != 0 && strcmp(tok->text, "||") != 0)) break;
+    node *n = node_new(tok->text[0] == '&' ? NODE_AND : NODE_OR);
+    parser_skip(p);
+    parser_newlines(p);
+    ARRAY_ADD(n->children, left);
+    ARRAY_ADD(n->children, parse_pipeline(p));
+    left = n;
+  }
+  return left;
+}
+
+// A complete command: everything up to a newline that isn't inside a
+// compound command, reading continuation lines as needed.
+node *parse_line(parser *p) {
+  node *list = node_new(NODE_LIST);
+  while (!p->error) {
+    token *tok = parser_peek(p, true);
+    if (tok->type == TOKEN_NEWLINE) {
+      parser_skip(p);
+      break;
+    }
+    if (tok->type == TOKEN_END) break;
+    ARRAY_ADD(list->children, parse_and_or(p));
+    if (p->error) break;
+    tok = parser_peek(p, false);
+    if (tok->type == TOKEN_OP && strcmp(tok->text, ";") == 0) {
+      parser_skip(p);
+    } else if (tok->type == TOKEN_OP && strcmp(tok->text, "&") == 0) {
+      fprintf(stderr, "syntax error: background jobs are not supported\n");
+      p->error = true;
+      p->syntax_error = true;
+    } else if (tok->type != TOKEN_NEWLINE && tok->type != TOKEN_END) {
+      parser_syntax_error(p, tok);
+    }
+  }
+  return list;
+}
+
+void redirects_restore(node *n, file_array *saved);
+
+// Opens the redirects of a node into files, keeping what they replace in
+// `saved` for redirects_restore()
+bool redirects_apply(node *n, file_array *saved) {
+  for (size_t i = 0; i < n->redirects.size; i ++) {
+    redirect *r = &n->redirects.data[i];
+    FILE *f = NULL;
+    switch (r->type) {
+      case REDIRECT_IN:
+      case REDIRECT_OUT:
+      case REDIRECT_APPEND: {
+        char *file_path = expand_word_single(r->word);
+        if (file_path == NULL) break;
+        if (r->type == REDIRECT_IN) {
+          int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+          f = fd == -1 ? NULL : fdopen(fd, "r");
+          if (f == NULL) {
+            fprintf(stderr, "%s: %s\n", file_path, strerror(errno));
+            if (fd != -1) close(fd);
+          }
+        } else {
+          f = fopen(file_path, r->type == REDIRECT_APPEND ? "ae" : "we");
+          if (f == NULL) fprintf(stderr, "output error, could not open `%s` for opening\n", file_path);
+        }
+        free(file_path);
+      }; break;
+
+      case REDIRECT_HEREDOC: {
+        const char *body = r->body == NULL ? "" : r->body;
+        if (r->quoted) {
+          f = heredoc_open(body, r->body_len);
+          break;
+        }
+        char *text = heredoc_expand(body, r->body_len);
+        if (text == NULL) break;
+        f = heredoc_open(text, strlen(text));
+        free(text);
+      }; break;
+
+      case REDIRECT_HERESTRING: {
+        char *text = expand_word_single(r->word);
+        if (text == NULL) break;
+        size_t len = strlen(text);
+        text = realloc(text, len + 2);
+        assert(text != NULL);
+        text[len ++] = '\n';
+        text[len] = '\0';
+        f = heredoc_open(text, len);
+        free(text);
+      }; break;
+    }
+    if (f == NULL) {
+      redirects_restore(n, saved);
+      return false;
+    }
+    ARRAY_ENSURE_CAPACITY(files, (size_t)r->fd + 1);
+    if ((size_t)r->fd >= files.size) files.size = (size_t)r->fd + 1;
+    ARRAY_ADD(*saved, files.data[r->fd]);
+    files.data[r->fd] = f;
+  }
+  return true;
+}
+
+void redirects_restore(node *n, file_array *saved) {
+  for (size_t i = saved->size; i > 0; i --) {
+    long fd = n->redirects.data[i - 1].fd;
+    fclose(files.data[fd]);
+    files.data[fd] = saved->data[i - 1];
+  }
+  ARRAY_FREE(*saved);
+}
+
+// Loop control from break and continue, in levels still to unwind
+int loop_depth = 0;
+int loop_break = 0;
+int loop_continue = 0;
+// Set by return, until the function has been left
+bool returning = false;
+
+bool execution_stopped(void) {
+  return loop_break > 0 || loop_continue > 0 || returning || interrupted;
+}
+
+// Loops of builtins never hand the terminal to a child, so look for a ^C
+// between iterations
+void check_interrupt(void) {
+  if (old_termios_ptr == NULL || interrupted || !read_input(&stdin_buf, false)) return;
+  char *c = memchr(stdin_buf.buffer + stdin_buf.offset, CTRL_C, stdin_buf.capacity - stdin_buf.offset);
+  if (c == NULL) return;
+  stdin_buf.offset = c - stdin_buf.buffer + 1;
+  printf("^C\n");
+  interrupted = true;
+  last_status = 130;
+}
+
+// Handles break and continue after a loop body, returns whether to stop
+bool loop_should_stop(void) {
+  if (interrupted || returning) return true;
+  if (loop_break > 0) {
+    loop_break --;
+    return true;
+  }
+  if (loop_continue > 0) {
+    loop_continue --;
+    return loop_continue > 0;
+  }
+  return false;
+}
+
+// break and continue leave the given number of enclosing loops
+int loop_control(string_array args, int *counter) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  long levels = 1;
+  if (args.size > 2) {
+    fprintf(err, "%s: too many arguments\n", args.data[0]);
+    return 1;
+  }
+  if (args.size == 2) {
+    char *end;
+    levels = strtol(args.data[1], &end, 10);
+    if (*end != '\0' || end == args.data[1] || levels < 1) {
+      fprintf(err, "%s: %s: loop count out of range\n", args.data[0], args.data[1]);
+      return 1;
+    }
+  }
+  if (loop_depth == 0) {
+    fprintf(err, "%s: only meaningful in a `for', `while', or `until' loop\n", args.data[0]);
+    return 0;
+  }
+  *counter = levels > loop_depth ? loop_depth : levels;
+  return 0;
+}
+
+int break_command(string_array args) {
+  return loop_control(args, &loop_break);
+}
+
+int continue_command(string_array args) {
+  return loop_control(args, &loop_continue);
+}
+
+int true_command(string_array args) {
+  (void)args;
+  return 0;
+}
+
+int false_command(string_array args) {
+  (void)args;
+  return 1;
+}
+
+void execute_node(node *n);
+
+// Runs a node in a forked subshell with its stdin and stdout replaced
+void subshell_run(node *n, int in_fd, int out_fd) {
+  // The parent shell owns the terminal
+  old_termios_ptr = NULL;
+  if (in_fd != -1) {
+    ARRAY_ENSURE_CAPACITY(files, STDIN_FILENO + 1);
+    if (files.size <= STDIN_FILENO) files.size = STDIN_FILENO + 1;
+    files.data[STDIN_FILENO] = fdopen(in_fd, "r");
+    // Only the first command of a pipeline reads the terminal
+    stdin_buf = read_buffer_string(NULL, 0);
+  }
+  if (out_fd != -1) {
+    ARRAY_ENSURE_CAPACITY(files, STDOUT_FILENO + 1);
+    if (files.size <= STDOUT_FILENO) files.size = STDOUT_FILENO + 1;
+    files.data[STDOUT_FILENO] = fdopen(out_fd, "w");
+    capture = NULL;
+  }
+  execute_node(n);
+  close_open_files();
+  _exit(last_status);
+}
+
+// A stage of a pipeline, run in a subshell, or on a thread of the shell
+// when it is a builtin that allows it
+typedef struct {
+  command_t *builtin;
+  string_array words;
+  file_array files;
+  int in_fd;
+  int out_fd;
+  pid_t pid;
+  pthread_t thread;
+  bool started;
+  int status;
+} pipeline_stage;
+
+// Words that can be expanded ahead of time, with nothing run and nothing
+// assigned, as the shell would see it otherwise
+bool word_is_inert(const char *raw) {
+  if (strchr(raw, '`') != NULL || strstr(raw, "$(") != NULL) return false;
+  if (strstr(raw, "<(") != NULL || strstr(raw, ">(") != NULL) return false;
+  return strstr(raw, "${") == NULL || strpbrk(raw, "=?") == NULL;
+}
+
+// The threaded builtin a stage runs, with its words expanded, or NULL
+command_t *stage_builtin(node *n, string_array *words) {
+  if (n->type != NODE_COMMAND || n->redirects.size > 0 || n->words.size == 0) return NULL;
+  const char *name = n->words.data[0];
+  if (table_lookup(&functions, name) != NULL) return NULL;
+  command_t *cmd = NULL;
+  for (size_t i = 0; i < builtins.size && cmd == NULL; i ++) {
+    if (strcmp(name, builtins.data[i].command) == 0) cmd = &builtins.data[i];
+  }
+  if (cmd == NULL || !cmd->threaded) return NULL;
+  for (size_t i = 0; i < n->words.size; i ++) {
+    if (!word_is_inert(n->words.data[i])) return NULL;
+  }
+  for (size_t i = 0; i < n->words.size; i ++) {
+    if (!expand_word(n->words.data[i], words, 0)) {
+      free_string_array(words);
+      return NULL;
+    }
+  }
+  // run_program() isn't for threads, with its ring, buffers and zygote
+  // channel shared by the shell
+  if (cmd->function == cat_command && cat_option(*words) != NULL) {
+    free_string_array(words);
+    return NULL;
+  }
+  return cmd;
+}
+
+void *stage_thread_main(void *arg) {
+  pipeline_stage *stage = arg;
+  // A write to a reader that has gone fails with EPIPE instead
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  files = stage->files;
+  FILE *in = NULL;
+  FILE *out = NULL;
+  if (stage->in_fd != -1) {
+    ARRAY_ENSURE_CAPACITY(files, STDIN_FILENO + 1);
+    if (files.size <= STDIN_FILENO) files.size = STDIN_FILENO + 1;
+    in = files.data[STDIN_FILENO] = fdopen(stage->in_fd, "r");
+  }
+  if (stage->out_fd != -1) {
+    ARRAY_ENSURE_CAPACITY(files, STDOUT_FILENO + 1);
+    if (files.size <= STDOUT_FILENO) files.size = STDOUT_FILENO + 1;
+    out = files.data[STDOUT_FILENO] = fdopen(stage->out_fd, "w");
+  }
+  stage->status = stage->builtin->function(stage->words);
+  if (in != NULL) fclose(in);
+  // What was still buffered can fail too, for output too small to have
+  // been written before
+  if (out != NULL && fclose(out) != 0 && stage->status == 0) {
+    FILE *err = stderr;
+    if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) err = files.data[STDERR_FILENO];
+    stage->status = write_error(err, stage->builtin->command, errno);
+  }
+  ARRAY_FREE(files);
+  return NULL;
+}
+
+// Runs the stages of a pipeline, each in its own subshell, apart from
+// builtins that can go on a thread. Threads are only started once every
+// subshell has been forked.
+void execute_stages(node **nodes, size_t count) {
+  bool capturing = capture != NULL && !(files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL);
+  int capture_pipe[2] = { -1, -1 };
+  if (capturing && pipe2(capture_pipe, O_CLOEXEC) == -1) { perror("pipe capture"); ABORT(); }
+  for (size_t i = 0; i < files.size; i ++) {
+    if (files.data[i] != NULL) fflush(files.data[i]);
+  }
+  pipeline_stage *stages = calloc(count, sizeof(pipeline_stage));
+  assert(stages != NULL);
+  int in_fd = -1;
+  for (size_t i = 0; i < count; i ++) {
+    int pipe_fds[2] = { -1, -1 };
+    if (i + 1 < count && pipe2(pipe_fds, O_CLOEXEC) == -1) { perror("pipe"); ABORT(); }
+    stages[i].in_fd = in_fd;
+    stages[i].out_fd = i + 1 < count ? pipe_fds[1] : capture_pipe[1];
+    in_fd = pipe_fds[0];
+    stages[i].builtin = stage_builtin(nodes[i], &stages[i].words);
+  }
+  for (size_t i = 0; i < count; i ++) {
+    if (stages[i].builtin != NULL) continue;
+    pid_t pid = fork();
+    if (pid == -1) { perror("fork"); ABORT(); }
+    if (pid == 0) {
+      for (size_t j = 0; j < count; j ++) {
+        if (j == i) continue;
+        if (stages[j].in_fd != -1 && stages[j].in_fd != stages[i].out_fd) close(stages[j].in_fd);
+        if (stages[j].out_fd != -1 && stages[j].out_fd != stages[i].in_fd) close(stages[j].out_fd);
+      }
+      if (capture_pipe[0] != -1) close(capture_pipe[0]);
+      subshell_run(nodes[i], stages[i].in_fd, stages[i].out_fd);
+    }
+    stages[i].pid = pid;
+    if (stages[i].in_fd != -1) close(stages[i].in_fd);
+    if (stages[i].out_fd != -1) close(stages[i].out_fd);
+  }
+  for (size_t i = 0; i < count; i ++) {
+    if (stages[i].builtin == NULL) continue;
+    stages[i].files = (file_array){0};
+    for (size_t f = 0; f < files.size; f ++) ARRAY_ADD(stages[i].files, files.data[f]);
+    if (pthread_create(&stages[i].thread, NULL, stage_thread_main, &stages[i]) != 0) {
+      perror("pipeline pthread_create");
+      ABORT();
+    }
+    stages[i].started = true;
+  }
+  if (capturing) {
+    capture_read(capture_pipe[0], capture, true);
+    close(capture_pipe[0]);
+  }
+  for (size_t i = 0; i < count; i ++) {
+    if (stages[i].started) {
+      pthread_join(stages[i].thread, NULL);
+      free_string_array(&stages[i].words);
+      last_status = stages[i].status;
+      continue;
+    }
+    int wstatus = 0;
+    while (waitpid(stages[i].pid, &wstatus, 0) == -1) {
+      if (errno == EINTR) continue;
+      perror("waitpid");
+      ABORT();
+    }
+    if (WIFEXITED(wstatus)) last_status = WEXITSTATUS(wstatus);
+    else if (WIFSIGNALED(wstatus)) last_status = 128 + WTERMSIG(wstatus);
+  }
+  free(stages);
+  if (last_status == 128 + SIGINT) interrupted = true;
+}
+
+// Nesting of run_line() from $(...) and source, so only whole lines update
+// stats_last
+int run_line_depth = 0;
+
+// Marks the commands that, if run, are the last thing the shell does
+void node_mark_tail(node *n) {
+  if (n == NULL) return;
+  switch (n->type) {
+    case NODE_COMMAND:
+      n->tail = true;
+      break;
+
+    case NODE_LIST:
+    case NODE_GROUP:
+      if (n->children.size > 0) node_mark_tail(n->children.data[n->children.size - 1]);
+      break;
+
+    case NODE_AND:
+    case NODE_OR:
+      node_mark_tail(n->children.data[1]);
+      break;
+
+    case NODE_IF:
+      for (size_t i = 1; i < n->children.size; i += 2) node_mark_tail(n->children.data[i]);
+      if (n->children.size % 2 == 1) node_mark_tail(n->children.data[n->children.size - 1]);
+      break;
+
+    case NODE_CASE:
+      for (size_t i = 0; i < n->children.size; i ++) node_mark_tail(n->children.data[i]);
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Whether a tail command can replace the shell. Not with a timeout, which
+// needs the shell to wait, or with stats still to write on exit.
+bool tail_exec_possible(void) {
+  deadline d;
+  return capture == NULL && run_line_depth == 1 &&
+    stats_exit_path == NULL && !command_deadline(&d);
+}
+
+// The status of the last $(...), for a command that is only assignments
+int substitution_status = -1;
+
+void execute_simple(node *n) {
+  string_array words = {0};
+  string_array assigns = {0};
+  substitution_status = -1;
+
+  // Leading name=value words are assignments, for the shell if there is no
+  // command, or for the environment of the command.
+  size_t assign_count = 0;
+  while (assign_count < n->words.size && is_assignment(n->words.data[assign_count])) {
+    char *raw = n->words.data[assign_count];
+    char *eq = strchr(raw, '=');
+    char *value = expand_word_single(eq + 1);
+    if (value == NULL) {
+      last_status = 1;
+      goto end;
+    }
+    char *assign = NULL;
+    assert(asprintf(&assign, "%.*s=%s", (int)(eq - raw), raw, value) != -1);
+    free(value);
+    ARRAY_ADD(assigns, assign);
+    assign_count ++;
+  }
+  for (size_t i = assign_count; i < n->words.size; i ++) {
+    if (!expand_word(n->words.data[i], &words, 0)) {
+      last_status = 1;
+      goto end;
+    }
+  }
+
+  if (words.size == 0) {
+    for (size_t i = 0; i < assigns.size; i ++) {
+      char *eq = strchr(assigns.data[i], '=');
+      *eq = '\0';
+      var_set(assigns.data[i], eq + 1);
+      *eq = '=';
+    }
+    last_status = substitution_status == -1 ? 0 : substitution_status;
+    goto end;
+  }
+  exec_replace = n->tail && tail_exec_possible();
+  last_status = execute_command(words, assigns);
+  exec_replace = false;
+end:
+  free_string_array(&words);
+  free_string_array(&assigns);
+}
+
+void execute_for(node *n) {
+  string_array fields = {0};
+  for (size_t i = 0; i < n->words.size; i ++) {
+    if (!expand_word(n->words.data[i], &fields, 0)) {
+      free_string_array(&fields);
+      last_status = 1;
+      return;
+    }
+  }
+  int status = 0;
+  loop_depth ++;
+  for (size_t i = 0; i < fields.size; i ++) {
+    check_interrupt();
+    if (interrupted) break;
+    var_set(n->name, fields.data[i]);
+    execute_node(n->children.data[0]);
+    status = last_status;
+    if (loop_should_stop()) break;
+  }
+  loop_depth --;
+  free_string_array(&fields);
+  if (!returning) last_status = interrupted ? 130 : status;
+}
+
+void execute_arith_for(node *n) {
+  int64_t value = 0;
+  if (!arith_evaluate(n->words.data[0], &value)) {
+    last_status = 1;
+    return;
+  }
+  int status = 0;
+  loop_depth ++;
+  while (true) {
+    check_interrupt();
+    if (interrupted) break;
+    // An empty condition is always true
+    const char *cond = n->words.data[1];
+    value = 1;
+    if (cond[strspn(cond, " \t\n")] != '\0' && !arith_evaluate(cond, &value)) {
+      status = 1;
+      break;
+    }
+    if (value == 0) break;
+    execute_node(n->children.data[0]);
+    status = last_status;
+    if (loop_should_stop()) break;
+    if (!arith_evaluate(n->words.data[2], &value)) {
+      status = 1;
+      break;
+    }
+  }
+  loop_depth --;
+  if (!returning) last_status = interrupted ? 130 : status;
+}
+
+void execute_case(node *n) {
+  char *word = expand_word_single(n->name);
+  if (word == NULL) {
+    last_status = 1;
+    return;
+  }
+  last_status = 0;
+  for (size_t i = 0; i < n->children.size; i ++) {
+    string_array *patterns = &n->patterns.data[i];
+    for (size_t j = 0; j < patterns->size; j ++) {
+      string_array fields = {0};
+      if (!expand_word(patterns->data[j], &fields, EXPAND_NOSPLIT | EXPAND_PATTERN)) {
+        free_string_array(&fields);
+        free(word);
+        last_status = 1;
+        return;
+      }
+      bool matched = case_match(fields.size > 0 ? fields.data[0] : "", word);
+      free_string_array(&fields);
+      if (matched) {
+        execute_node(n->children.data[i]);
+        free(word);
+        return;
+      }
+    }
+  }
+  free(word);
+}
+
+// Variables as they were before a `local`, restored when the function returns
+typedef struct {
+  char *name;
+  char *value;
+  bool exported;
+} saved_variable;
+
+typedef struct {
+  string_array positional; // of the caller
+  ARRAY(saved_variable) locals;
+  int loop_depth;
+} call_frame;
+
+#define FUNCTION_DEPTH_MAX 1000
+
+ARRAY(call_frame) frames = {0};
+
+// Saves a variable to be restored when the current function returns
+void local_save(const char *name) {
+  call_frame *frame = &frames.data[frames.size - 1];
+  for (size_t i = 0; i < frame->locals.size; i ++) {
+    if (strcmp(frame->locals.data[i].name, name) == 0) return;
+  }
+  variable *var = var_lookup(name);
+  saved_variable saved = {
+    .name = strdup(name),
+    .value = var == NULL || var->value == NULL ? NULL : strdup(var->value),
+    .exported = var != NULL && var->exported,
+  };
+  ARRAY_ADD(frame->locals, saved);
+}
+
+// Runs the body of a function with the words as its positional parameters.
+// Assignments before the call are exported for its duration.
+int function_call(node *body, string_array words, string_array assigns) {
+  if (frames.size >= FUNCTION_DEPTH_MAX) {
+    fprintf(stderr, "%s: maximum function nesting level exceeded (%d)\n", words.data[0], FUNCTION_DEPTH_MAX);
+    return 1;
+  }
+  call_frame frame = {
+    .positional = positional,
+    .loop_depth = loop_depth,
+  };
+  ARRAY_ADD(frames, frame);
+  positional = (string_array){0};
+  for (size_t i = 1; i < words.size; i ++) {
+    ARRAY_ADD(positional, strdup(words.data[i]));
+  }
+  for (size_t a = 0; a < assigns.size; a ++) {
+    char *eq = strchr(assigns.data[a], '=');
+    *eq = '\0';
+    local_save(assigns.data[a]);
+    var_set(assigns.data[a], eq + 1);
+    var_export(assigns.data[a], true);
+    *eq = '=';
+  }
+  loop_depth = 0;
+
+  // The body stays alive even if the function is redefined while it runs
+  body->refs ++;
+  execute_node(body);
+  node_free(body);
+  returning = false;
+
+  call_frame *top = &frames.data[frames.size - 1];
+  for (size_t i = top->locals.size; i > 0; i --) {
+    saved_variable *saved = &top->locals.data[i - 1];
+    if (saved->value == NULL) {
+      var_unset(saved->name);
+    } else {
+      var_set(saved->name, saved->value);
+      var_export(saved->name, saved->exported);
+    }
+    free(saved->name);
+    free(saved->value);
+  }
+  ARRAY_FREE(top->locals);
+  free_string_array(&positional);
+  positional = top->positional;
+  loop_depth = top->loop_depth;
+  frames.size --;
+  if (frames.size == 0) ARRAY_FREE(frames);
+  return last_status;
+}
+
+int local_command(string_array args) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  if (frames.size == 0) {
+    fprintf(err, "%s: can only be used in a function\n", args.data[0]);
+    return 1;
+  }
+  int ret = 0;
+  for (size_t i = 1; i < args.size; i ++) {
+    char *eq = strchr(args.data[i], '=');
+    size_t len = eq == NULL ? strlen(args.data[i]) : (size_t)(eq - args.data[i]);
+    if (!is_name(args.data[i], len)) {
+      fprintf(err, "%s: `%s': not a valid identifier\n", args.data[0], args.data[i]);
+      ret = 1;
+      continue;
+    }
+    if (eq != NULL) *eq = '\0';
+    local_save(args.data[i]);
+    if (eq == NULL) {
+      var_unset(args.data[i]);
+    } else {
+      var_set(args.data[i], eq + 1);
+      *eq = '=';
+    }
+  }
+  return ret;
+}
+
+int return_command(string_array args) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  if (frames.size == 0) {
+    fprintf(err, "%s: can only `return' from a function\n", args.data[0]);
+    return 1;
+  }
+  if (args.size > 2) {
+    fprintf(err, "%s: too many arguments\n", args.data[0]);
+    return 1;
+  }
+  int code = last_status;
+  if (args.size == 2) {
+    char *end;
+    long n = strtol(args.data[1], &end, 10);
+    if (*end != '\0' || end == args.data[1]) {
+      fprintf(err, "%s: %s: numeric argument required\n", args.data[0], args.data[1]);
+      n = 2;
+    }
+    code = n & 0xff;
+  }
+  returning = true;
+  return code;
+}
+
+int shift_command(string_array args) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  long n = 1;
+  if (args.size > 2) {
+    fprintf(err, "%s: too many arguments\n", args.data[0]);
+    return 1;
+  }
+  if (args.size == 2) {
+    char *end;
+    n = strtol(args.data[1], &end, 10);
+    if (*end != '\0' || end == args.data[1] || n < 0) {
+      fprintf(err, "%s: %s: shift count out of range\n", args.data[0], args.data[1]);
+      return 1;
+    }
+  }
+  if ((size_t)n > positional.size) return 1;
+  for (long i = 0; i < n; i ++) free(positional.data[i]);
+  memmove(positional.data, positional.data + n, (positional.size - n) * sizeof(char *));
+  positional.size -= n;
+  return 0;
+}
+
+// Children of <(...) and >(...) in the command being run, closed and waited
+// for once it is done
+typedef struct {
+  pid_t pid;
+  int fd;
+} process_substitution;
+ARRAY(process_substitution) process_substitutions = {0};
+
+// Closes the shell's ends of the substitutions made since `from`, so a
+// >(...) sees the end of its input, and waits for them
+void process_substitutions_finish(size_t from) {
+  while (process_substitutions.size > from) {
+    process_substitution *ps = &process_substitutions.data[-- process_substitutions.size];
+    if ((size_t)ps->fd < files.size && files.data[ps->fd] != NULL) {
+      fclose(files.data[ps->fd]);
+      files.data[ps->fd] = NULL;
+    }
+    while (waitpid(ps->pid, NULL, 0) == -1 && errno == EINTR);
+  }
+}
+
+void execute_node(node *n) {
+  if (n == NULL) return;
+  size_t substitutions = process_substitutions.size;
+  file_array saved = {0};
+  if (!redirects_apply(n, &saved)) {
+    process_substitutions_finish(substitutions);
+    last_status = 1;
+    return;
+  }
+  switch (n->type) {
+    case NODE_COMMAND:
+      execute_simple(n);
+      break;
+
+    case NODE_PIPELINE:
+    case NODE_SUBSHELL:
+      execute_stages(n->children.data, n->children.size);
+      break;
+
+    case NODE_AND:
+    case NODE_OR:
+      execute_node(n->children.data[0]);
+      if (!execution_stopped() && (last_status == 0) == (n->type == NODE_AND)) {
+        execute_node(n->children.data[1]);
+      }
+      break;
+
+    case NODE_NOT:
+      execute_node(n->children.data[0]);
+      last_status = last_status == 0;
+      break;
+
+    case NODE_LIST:
+    case NODE_GROUP:
+      for (size_t i = 0; i < n->children.size && !execution_stopped(); i ++) {
+        execute_node(n->children.data[i]);
+      }
+      break;
+
+    case NODE_IF: {
+      size_t i = 0;
+      int status = 0;
+      for (; i + 1 < n->children.size; i += 2) {
+        execute_node(n->children.data[i]);
+        if (execution_stopped()) break;
+        if (last_status == 0) {
+          execute_node(n->children.data[i + 1]);
+          status = last_status;
+          break;
+        }
+      }
+      if (i + 1 == n->children.size) {
+        execute_node(n->children.data[i]);
+        status = last_status;
+      }
+      if (!execution_stopped()) last_status = status;
+    }; break;
+
+    case NODE_WHILE:
+    case NODE_UNTIL: {
+      int status = 0;
+      loop_depth ++;
+      while (true) {
+        check_interrupt();
+        if (interrupted) break;
+        execute_node(n->children.data[0]);
+        if (execution_stopped()) {
+          if (loop_should_stop()) break;
+          continue;
+        }
+        if ((last_status == 0) != (n->type == NODE_WHILE)) break;
+        execute_node(n->children.data[1]);
+        status = last_status;
+        if (loop_should_stop()) break;
+      }
+      loop_depth --;
+      if (!returning) last_status = interrupted ? 130 : status;
+    }; break;
+
+    case NODE_FOR:
+      execute_for(n);
+      break;
+
+    case NODE_CASE:
+      execute_case(n);
+      break;
+
+    case NODE_ARITH: {
+      int64_t value = 0;
+      last_status = arith_evaluate(n->name, &value) ? value == 0 : 1;
+    }; break;
+
+    case NODE_ARITH_FOR:
+      execute_arith_for(n);
+      break;
+
+    case NODE_FUNCTION: {
+      node *body = n->children.data[0];
+      body->refs ++;
+      table_entry *entry = table_insert(&functions, n->name);
+      node_free(entry->value);
+      entry->value = body;
+      last_status = 0;
+    }; break;
+  }
+  redirects_restore(n, &saved);
+  process_substitutions_finish(substitutions);
+}
+
+// Scripts and rc files are cached in their parsed form, keyed by the path,
+// size and mtime of the file, and mapped on the next run so an unchanged
+// script isn't lexed or parsed again. SHELL_CACHE sets the directory, or
+// turns it off with "off". Numbers are in the byte order of the machine.
+#define SCRIPT_CACHE_MAGIC "shast\001\0\0"
+#define SCRIPT_CACHE_MAGIC_SIZE 8
+#define SCRIPT_CACHE_MAX_DEPTH 1024
+
+typedef ARRAY(node *) node_array;
+
+typedef struct {
+  char *path;         // of the cache file
+  const char *source; // real path of the script
+  struct stat st;
+  char_array nodes;
+  uint32_t count;
+} script_cache;
+
+void cache_put(char_array *out, const void *data, size_t len) {
+  char_array_reserve(out, len);
+  memcpy(out->data + out->size, data, len);
+  out->size += len;
+}
+
+void cache_put_u8(char_array *out, uint8_t value) {
+  cache_put(out, &value, sizeof(value));
+}
+
+void cache_put_u32(char_array *out, uint32_t value) {
+  cache_put(out, &value, sizeof(value));
+}
+
+void cache_put_i64(char_array *out, int64_t value) {
+  cache_put(out, &value, sizeof(value));
+}
+
+// A length then the bytes, or UINT32_MAX for NULL
+void cache_put_string(char_array *out, const char *s, size_t len) {
+  if (s == NULL) {
+    cache_put_u32(out, UINT32_MAX);
+    return;
+  }
+  cache_put_u32(out, (uint32_t)len);
+  cache_put(out, s, len);
+}
+
+void cache_put_strings(char_array *out, string_array *arr) {
+  cache_put_u32(out, (uint32_t)arr->size);
+  for (size_t i = 0; i < arr->size; i ++) {
+    cache_put_string(out, arr->data[i], arr->data[i] == NULL ? 0 : strlen(arr->data[i]));
+  }
+}
+
+void cache_put_node(char_array *out, node *n) {
+  if (n == NULL) {
+    cache_put_u8(out, 0);
+    return;
+  }
+  cache_put_u8(out, 1);
+  cache_put_u8(out, (uint8_t)n->type);
+  cache_put_u8(out, n->has_in);
+  cache_put_strings(out, &n->words);
+  cache_put_u32(out, (uint32_t)n->redirects.size);
+  for (size_t i = 0; i < n->redirects.size; i ++) {
+    redirect *r = &n->redirects.data[i];
+    cache_put_u8(out, (uint8_t)r->type);
+    cache_put_i64(out, r->fd);
+    cache_put_string(out, r->word, r->word == NULL ? 0 : strlen(r->word));
+    cache_put_string(out, r->body, r->body_len);
+    cache_put_u8(out, r->quoted);
+    cache_put_u8(out, r->strip_tabs);
+  }
+  cache_put_string(out, n->name, n->name == NULL ? 0 : strlen(n->name));
+  cache_put_u32(out, (uint32_t)n->patterns.size);
+  for (size_t i = 0; i < n->patterns.size; i ++) cache_put_strings(out, &n->patterns.data[i]);
+  cache_put_u32(out, (uint32_t)n->children.size);
+  for (size_t i = 0; i < n->children.size; i ++) cache_put_node(out, n->children.data[i]);
+}
+
+typedef struct {
+  const char *data;
+  size_t size;
+  size_t offset;
+  bool error; // truncated or not what was written, so the cache is ignored
+} cache_reader;
+
+bool cache_get(cache_reader *r, void *data, size_t len) {
+  if (r->error || len > r->size - r->offset) {
+    r->error = true;
+    memset(data, 0, len);
+    return false;
+  }
+  memcpy(data, r->data + r->offset, len);
+  r->offset += len;
+  return true;
+}
+
+uint8_t cache_get_u8(cache_reader *r) {
+  uint8_t value;
+  cache_get(r, &value, sizeof(value));
+  return value;
+}
+
+uint32_t cache_get_u32(cache_reader *r) {
+  uint32_t value;
+  cache_get(r, &value, sizeof(value));
+  return value;
+}
+
+int64_t cache_get_i64(cache_reader *r) {
+  int64_t value;
+  cache_get(r, &value, sizeof(value));
+  return value;
+}
+
+// A copy of the string, with its length in `len` if given
+char *cache_get_string(cache_reader *r, size_t *len) {
+  uint32_t size = cache_get_u32(r);
+  if (len != NULL) *len = 0;
+  if (r->error || size == UINT32_MAX) return NULL;
+  if (size > r->size - r->offset) {
+    r->error = true;
+    return NULL;
+  }
+  char *s = strndup(r->data + r->offset, size);
+  assert(s != NULL);
+  r->offset += size;
+  if (len != NULL) *len = size;
+  return s;
+}
+
+void cache_get_strings(cache_reader *r, string_array *arr) {
+  uint32_t size = cache_get_u32(r);
+  for (uint32_t i = 0; i < size && !r->error; i ++) {
+    ARRAY_ADD(*arr, cache_get_string(r, NULL));
+  }
+}
+
+node *cache_get_node(cache_reader *r, int depth) {
+  if (cache_get_u8(r) == 0 || r->error) return NULL;
+  if (depth > SCRIPT_CACHE_MAX_DEPTH) {
+    r->error = true;
+    return NULL;
+  }
+  uint8_t type = cache_get_u8(r);
+  if (type > NODE_ARITH_FOR) {
+    r->error = true;
+    return NULL;
+  }
+  node *n = node_new((node_type)type);
+  n->has_in = cache_get_u8(r);
+  cache_get_strings(r, &n->words);
+  uint32_t redirects = cache_get_u32(r);
+  for (uint32_t i = 0; i < redirects && !r->error; i ++) {
+    redirect rd = {0};
+    uint8_t type = cache_get_u8(r);
+    if (type > REDIRECT_HERESTRING) {
+      r->error = true;
+      break;
+    }
+    rd.type = (redirect_type)type;
+    rd.fd = (long)cache_get_i64(r);
+    rd.word = cache_get_string(r, NULL);
+    rd.body = cache_get_string(r, &rd.body_len);
+    rd.quoted = cache_get_u8(r);
+    rd.strip_tabs = cache_get_u8(r);
+    ARRAY_ADD(n->redirects, rd);
+  }
+  n->name = cache_get_string(r, NULL);
+  uint32_t patterns = cache_get_u32(r);
+  for (uint32_t i = 0; i < patterns && !r->error; i ++) {
+    string_array arr = {0};
+    cache_get_strings(r, &arr);
+    ARRAY_ADD(n->patterns, arr);
+  }
+  uint32_t children = cache_get_u32(r);
+  for (uint32_t i = 0; i < children && !r->error; i ++) {
+    ARRAY_ADD(n->children, cache_get_node(r, depth + 1));
+  }
+  return n;
+}
+
+// Where the parsed form of the script at `source` is cached, or NULL when
+// there is nowhere to
+char *script_cache_path(const char *source) {
+  char *dir = var_get("SHELL_CACHE");
+  if (dir != NULL && strcmp(dir, "off") == 0) return NULL;
+  char *base = NULL;
+  if (dir != NULL && *dir != '\0') {
+    base = strdup(dir);
+    assert(base != NULL);
+  } else {
+    char *xdg = var_get("XDG_CACHE_HOME");
+    char *home = var_get("HOME");
+    if (xdg != NULL && *xdg != '\0') {
+      assert(asprintf(&base, "%s/codecrafters-shell", xdg) != -1);
+    } else if (home != NULL && *home != '\0') {
+      char *parent = NULL;
+      assert(asprintf(&parent, "%s/.cache", home) != -1);
+      mkdir(parent, 0700);
+      free(parent);
+      assert(asprintf(&base, "%s/.cache/codecrafters-shell", home) != -1);
+    } else {
+      return NULL;
+    }
+  }
+  mkdir(base, 0700);
+  char *path = NULL;
+  assert(asprintf(&path, "%s/%016" PRIx64 ".ast", base, hash_string(source)) != -1);
+  free(base);
+  return path;
+}
+
+// The header of a cache file, for checking it is of the script as it is now
+void script_cache_header(char_array *out, const char *source, struct stat *st, uint32_t count) {
+  cache_put(out, SCRIPT_CACHE_MAGIC, SCRIPT_CACHE_MAGIC_SIZE);
+  cache_put_i64(out, st->st_size);
+  cache_put_i64(out, st->st_mtim.tv_sec);
+  cache_put_i64(out, st->st_mtim.tv_nsec);
+  cache_put_string(out, source, strlen(source));
+  cache_put_u32(out, count);
+}
+
+// Maps the cache file and reads its nodes, if it is of the script at
+// `source` with the same size and mtime
+bool script_cache_load(const char *path, const char *source, struct stat *st, node_array *out) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  struct stat cache_st;
+  if (fstat(fd, &cache_st) != 0 || cache_st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+  cache_reader r = { .data = map, .size = cache_st.st_size };
+  char magic[SCRIPT_CACHE_MAGIC_SIZE];
+  cache_get(&r, magic, sizeof(magic));
+  bool match = memcmp(magic, SCRIPT_CACHE_MAGIC, sizeof(magic)) == 0
+    && cache_get_i64(&r) == st->st_size
+    && cache_get_i64(&r) == st->st_mtim.tv_sec
+    && cache_get_i64(&r) == st->st_mtim.tv_nsec;
+  if (match) {
+    char *cached_source = cache_get_string(&r, NULL);
+    match = cached_source != NULL && strcmp(cached_source, source) == 0;
+    free(cached_source);
+  }
+  if (match) {
+    uint32_t count = cache_get_u32(&r);
+    for (uint32_t i = 0; i < count && !r.error; i ++) {
+      node *n = cache_get_node(&r, 0);
+      if (n == NULL) r.error = true;
+      ARRAY_ADD(*out, n);
+    }
+    match = !r.error && r.offset == r.size;
+    if (!match) {
+      for (size_t i = 0; i < out->size; i ++) node_free(out->data[i]);
+      out->size = 0;
+    }
+  }
+  munmap(map, cache_st.st_size);
+  return match;
+}
+
+// Written to a temporary file and renamed over the cache file, so a shell
+// running the same script never maps half of one
+void script_cache_write(script_cache *cache) {
+  if (cache->path == NULL) return;
+  char_array header = {0};
+  script_cache_header(&header, cache->source, &cache->st, cache->count);
+  char *tmp = NULL;
+  assert(asprintf(&tmp, "%s.%d.tmp", cache->path, (int)getpid()) != -1);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd != -1) {
+    bool ok = write(fd, header.data, header.size) == (ssize_t)header.size
+      && write(fd, cache->nodes.data, cache->nodes.size) == (ssize_t)cache->nodes.size;
+    if (close(fd) != 0 || !ok || rename(tmp, cache->path) != 0) unlink(tmp);
+  }
+  free(tmp);
+  ARRAY_FREE(header);
+}
+
+// Parses the whole script from `input` into `nodes` before any of it runs,
+// and caches it, so a script that exits early is cached all the same. On a
+// syntax error it stops there, with nothing cached, and returns the status.
+int script_parse(script_cache *cache, node_array *nodes) {
+  while (!is_eof(input)) {
+    parser p = {0};
+    node *n = parse_line(&p);
+    int error = p.error ? (p.syntax_error ? 2 : 1) : 0;
+    if (p.error && !p.at_eol) {
+      // Drop the rest of the line with the error
+      while (!is_eof(input) && read_char(input) != '\n');
+    }
+    parser_free(&p);
+    if (error != 0) {
+      node_free(n);
+      return error;
+    }
+    cache_put_node(&cache->nodes, n);
+    cache->count ++;
+    ARRAY_ADD(*nodes, n);
+  }
+  script_cache_write(cache);
+  return 0;
+}
+
+// Before and after each command line, so stats_last covers a whole line
+void line_begin(uint64_t *start) {
+  memcpy(start, stats, sizeof(stats));
+  coprocs_reap();
+  run_line_depth ++;
+  interrupted = false;
+}
+
+// The files of a line are the command's it is nested in, as for the lines
+// of a sourced script, until the outermost line ends
+void line_end(uint64_t *start) {
+  if (-- run_line_depth == 0) {
+    close_open_files();
+    for (size_t i = 0; i < STAT_COUNT; i ++) stats_last[i] = stats[i] - start[i];
+  }
+}
+
+// Reads a complete command from input, with any continuation lines it needs,
+// and runs it
+void run_line(void) {
+  uint64_t start[STAT_COUNT];
+  line_begin(start);
+  parser p = {0};
+  node *n = parse_line(&p);
+  if (p.error) {
+    last_status = p.syntax_error ? 2 : 1;
+    // Drop the rest of the line with the error
+    if (!p.at_eol) {
+      while (!is_eof(input) && read_char(input) != '\n');
+    }
+  } else {
+    if (input == &stdin_buf) paste_mode(false);
+    if (tail_exec && run_line_depth == 1 && input != &stdin_buf && is_eof(input)) node_mark_tail(n);
+    execute_node(n);
+  }
+  node_free(n);
+  parser_free(&p);
+  line_end(start);
+}
+
+// Runs the script at `path` in this shell, from the cache of its parsed form
+// when the file hasn't changed since it was, or else parsing it and caching
+// that first. Returns -1 with errno set when it can't be opened.
+int run_file(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -1;
+  struct stat st;
+  char *source = realpath(path, NULL);
+  char *cache_path = NULL;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && source != NULL) cache_path = script_cache_path(source);
+  node_array nodes = {0};
+  read_buffer buf = { .fd = fd };
+  read_buffer *saved_input = input;
+  int error = 0;
+  if (cache_path == NULL || !script_cache_load(cache_path, source, &st, &nodes)) {
+    script_cache cache = { .path = cache_path, .source = source, .st = st };
+    input = &buf;
+    error = script_parse(&cache, &nodes);
+    input = saved_input;
+    ARRAY_FREE(cache.nodes);
+  }
+  for (size_t i = 0; i < nodes.size; i ++) {
+    uint64_t start[STAT_COUNT];
+    line_begin(start);
+    if (tail_exec && run_line_depth == 1 && error == 0 && i + 1 == nodes.size) node_mark_tail(nodes.data[i]);
+    execute_node(nodes.data[i]);
+    node_free(nodes.data[i]);
+    nodes.data[i] = NULL;
+    line_end(start);
+  }
+  if (error != 0) {
+    // The lines after a syntax error still run, parsed as they are read
+    last_status = error;
+    input = &buf;
+    while (!is_eof(input)) run_line();
+    input = saved_input;
+  }
+  close(fd);
+  ARRAY_FREE(nodes);
+  free(cache_path);
+  free(source);
+  return last_status;
+}
+
+int source_command(string_array args) {
+  FILE *err = stdout;
+  if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
+    err = files.data[STDERR_FILENO];
+  }
+
+  if (args.size < 2) {
+    fprintf(err, "%s: filename argument required\n", args.data[0]);
+    return 2;
+  }
+  // Any further arguments are the positional parameters while it runs
+  string_array saved = positional;
+  if (args.size > 2) {
+    positional = (string_array){0};
+    for (size_t i = 2; i < args.size; i ++) ARRAY_ADD(positional, strdup(args.data[i]));
+  }
+  int ret = run_file(args.data[1]);
+  if (ret == -1) {
+    fprintf(err, "%s: %s: %s\n", args.data[0], args.data[1], strerror(errno));
+    ret = 1;
+  }
+  if (args.size > 2) {
+    free_string_array(&positional);
+    positional = saved;
+  }
+  return ret;
+}
+
+// Whether a parsed $(...) can run in the shell itself: only builtins that
+// change nothing in it, like echo or pwd, with no assignments and nothing in
+// their words that could assign
+bool substitution_in_shell(node *n) {
+  switch (n->type) {
+    case NODE_COMMAND: {
+      if (n->words.size == 0 || is_assignment(n->words.data[0])) return false;
+      if (table_lookup(&functions, n->words.data[0]) != NULL) return false;
+      command_t *cmd = NULL;
+      for (size_t i = 0; i < builtins.size && cmd == NULL; i ++) {
+        if (strcmp(n->words.data[0], builtins.data[i].command) == 0) cmd = &builtins.data[i];
+      }
+      if (cmd == NULL || !cmd->threaded) return false;
+      for (size_t i = 0; i < n->words.size; i ++) {
+        if (!word_is_inert(n->words.data[i])) return false;
+      }
+      for (size_t i = 0; i < n->redirects.size; i ++) {
+        if (!word_is_inert(n->redirects.data[i].word)) return false;
+      }
+      return true;
+    }
+
+    case NODE_LIST:
+    case NODE_PIPELINE:
+    case NODE_AND:
+    case NODE_OR:
+    case NODE_NOT:
+      for (size_t i = 0; i < n->children.size; i ++) {
+        if (!substitution_in_shell(n->children.data[i])) return false;
+      }
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+// Runs `text` with its stdout captured, for $(...) and `...`. It is parsed
+// first, and anything that could change the shell runs in one subshell.
+char *command_substitute(const char *text, size_t len) {
+  read_buffer buf = read_buffer_string(text, len);
+  read_buffer *saved_input = input;
+  int saved_status = last_status;
+  input = &buf;
+  node_array nodes = {0};
+  bool in_shell = true;
+  int status = 0;
+  while (!is_eof(input)) {
+    parser p = {0};
+    node *n = parse_line(&p);
+    bool error = p.error;
+    if (error) status = p.syntax_error ? 2 : 1;
+    parser_free(&p);
+    if (error) {
+      node_free(n);
+      break;
+    }
+    ARRAY_ADD(nodes, n);
+    in_shell = in_shell && substitution_in_shell(n);
+  }
+  input = saved_input;
+
+  char_array out = {0};
+  if (status != 0) {
+    // The error was already reported, and nothing is run
+  } else if (in_shell) {
+    char_array *saved_capture = capture;
+    file_array saved_files = files;
+    files = (file_array){0};
+    capture = &out;
+    for (size_t i = 0; i < nodes.size; i ++) {
+      uint64_t start[STAT_COUNT];
+      line_begin(start);
+      execute_node(nodes.data[i]);
+      line_end(start);
+    }
+    close_open_files();
+    ARRAY_FREE(files);
+    files = saved_files;
+    capture = saved_capture;
+    status = last_status;
+  } else {
+    int capture_pipe[2];
+    if (pipe2(capture_pipe, O_CLOEXEC) != 0) { perror("pipe capture"); ABORT(); }
+    fflush(NULL);
+    pid_t pid = fork();
+    switch (pid) {
+      case -1:
+        perror("fork");
+        ABORT();
+        UNREACHABLE();
+        return NULL;
+
+      case 0: {
+        close(capture_pipe[0]);
+        if (dup2(capture_pipe[1], STDOUT_FILENO) == -1) { perror("dup2 capture"); abort(); }
+        close(capture_pipe[1]);
+        for (size_t i = 0; i < process_substitutions.size; i ++) close(process_substitutions.data[i].fd);
+        files = (file_array){0};
+        capture = NULL;
+        run_line_depth = 0;
+        tail_exec = true;
+        for (size_t i = 0; i < nodes.size; i ++) {
+          uint64_t start[STAT_COUNT];
+          line_begin(start);
+          if (i + 1 == nodes.size) node_mark_tail(nodes.data[i]);
+          execute_node(nodes.data[i]);
+          line_end(start);
+        }
+        fflush(NULL);
+        _exit(last_status);
+      }; break;
+
+      default:
+        break;
+    }
+    close(capture_pipe[1]);
+    capture_read(capture_pipe[0], &out, true);
+    close(capture_pipe[0]);
+    int wstatus = 0;
+    while (waitpid(pid, &wstatus, 0) == -1) {
+      if (errno == EINTR) continue;
+      perror("waitpid substitution");
+      ABORT();
+    }
+    if (WIFEXITED(wstatus)) status = WEXITSTATUS(wstatus);
+    else if (WIFSIGNALED(wstatus)) status = 128 + WTERMSIG(wstatus);
+  }
+  for (size_t i = 0; i < nodes.size; i ++) node_free(nodes.data[i]);
+  ARRAY_FREE(nodes);
+  // $? stays as it was for the rest of the command line
+  last_status = saved_status;
+  substitution_status = status;
+  while (out.size > 0 && out.data[out.size - 1] == '\n') out.size --;
+  ARRAY_ADD(out, '\0');
+  return out.data;
+}
+
+// Runs `text` in a child with its stdout, or its stdin for >(...), on a
+// pipe, and gives the shell's end as /dev/fd/N. No file is made on disk.
+// The end is put in `files` at N, so run_program() hands it on at N.
+char *process_substitute(const char *text, size_t len, bool output) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) { perror("pipe process substitution"); ABORT(); }
+  int ours = fds[output ? 1 : 0];
+  int theirs = fds[output ? 0 : 1];
+  fflush(NULL);
+  pid_t pid = fork();
+  switch (pid) {
+    case -1:
+      perror("fork");
+      ABORT();
+      UNREACHABLE();
+      return NULL;
+
+    case 0: {
+      close(ours);
+      if (dup2(theirs, output ? STDIN_FILENO : STDOUT_FILENO) == -1) { perror("dup2 process substitution"); abort(); }
+      close(theirs);
+      for (size_t i = 0; i < process_substitutions.size; i ++) close(process_substitutions.data[i].fd);
+      // The files of the command are left to the shell that runs it
+      files = (file_array){0};
+      capture = NULL;
+      if (output) stdin_buf = (read_buffer){ .fd = STDIN_FILENO };
+      read_buffer buf = read_buffer_string(text, len);
+      input = &buf;
+      run_line_depth = 0;
+      tail_exec = true;
+      while (!is_eof(input)) run_line();
+      fflush(NULL);
+      _exit(last_status);
+    }; break;
+
+    default:
+      break;
+  }
+  close(theirs);
+  // Out of the way of a redirection to the same fd
+  if ((size_t)ours < files.size && files.data[ours] != NULL) {
+    int moved = fcntl(ours, F_DUPFD_CLOEXEC, files.size);
+    if (moved == -1) { perror("fcntl process substitution"); ABORT(); }
+    close(ours);
+    ours = moved;
+  }
+  ARRAY_ENSURE_CAPACITY(files, (size_t)ours + 1);
+  if ((size_t)ours >= files.size) files.size = (size_t)ours + 1;
+  files.data[ours] = fdopen(ours, output ? "w" : "r");
+  if (files.data[ours] == NULL) { perror("fdopen process substitution"); ABORT(); }
+  ARRAY_ADD(process_substitutions, ((process_substitution){ .pid = pid, .fd = ours }));
+  char *path = NULL;
+  assert(asprintf(&path, "/dev/fd/%d", ours) != -1);
+  return path;
+}
+
+// Prompt segments that are slow to work out (\g, \G, \c and \L in PS1) are
+// computed by a worker thread and cached by cwd. The prompt is drawn with
+// what is cached, and redrawn in place when the worker has something new.
+#define PROMPT_GIT_BRANCH 1
+#define PROMPT_GIT_STATUS 2
+#define PROMPT_COMPACT_CWD 4
+#define PROMPT_LOAD 8
+
+typedef struct {
+  char *cwd;
+  struct timespec head_mtime;
+  struct timespec index_mtime;
+  bool has_git;
+  char *branch;
+  char *status;
+  char *compact_cwd;
+  char *load;
+} prompt_segments;
+
+#define PROMPT_CACHE_SIZE 16
+
+struct {
+  pthread_t thread;
+  bool started;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // request, owned by the worker once taken
+  char *cwd;
+  char *home;
+  string_array env; // the shell's exported variables, for git
+  int wanted;
+  prompt_segments cache[PROMPT_CACHE_SIZE];
+  size_t next_slot;
+  int notify[2];
+} prompt_worker = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .notify = { -1, -1 },
+};
+
+char_array prompt_shown = {0};
+
+void prompt_segments_free(prompt_segments *seg) {
+  free(seg->cwd);
+  free(seg->branch);
+  free(seg->status);
+  free(seg->compact_cwd);
+  free(seg->load);
+  *seg = (prompt_segments){0};
+}
+
+void prompt_free(void) {
+  ARRAY_FREE(prompt_line);
+  ARRAY_FREE(prompt_shown);
+  ARRAY_FREE(event_sources);
+  ARRAY_FREE(event_pollfds);
+}
+
+// Replaces *dst with src, returning whether it changed
+bool prompt_update(char **dst, char *src) {
+  bool changed = (*dst == NULL) != (src == NULL) || (src != NULL && strcmp(*dst, src) != 0);
+  free(*dst);
+  *dst = src;
+  return changed;
+}
 
-  if (args.size > 2) {
-    fprintf(err, "cd: too many arguments\n");
-    return 1;
+bool find_git_dir(const char *cwd, char_array *git_dir) {
+  char *dir = strdup(cwd);
+  while (true) {
+    git_dir->size = 0;
+    size_t len = strlen(dir);
+    char_array_reserve(git_dir, len + 6);
+    memcpy(git_dir->data, dir, len);
+    memcpy(git_dir->data + len, len > 1 ? "/.git" : ".git", len > 1 ? 6 : 5);
+    git_dir->size = strlen(git_dir->data);
+    struct stat st;
+    if (stat(git_dir->data, &st) == 0) {
+      if (S_ISREG(st.st_mode)) {
+        // worktrees and submodules have a "gitdir: path" file
+        FILE *f = fopen(git_dir->data, "r");
+        char line[4096] = {0};
+        if (f != NULL && fgets(line, sizeof(line), f) != NULL && strncmp(line, "gitdir: ", 8) == 0) {
+          line[strcspn(line, "\n")] = '\0';
+          git_dir->size = 0;
+          char_array_reserve(git_dir, len + strlen(line) + 2);
+          if (line[8] == '/') {
+            strcpy(git_dir->data, line + 8);
+          } else {
+            sprintf(git_dir->data, "%s/%s", dir, line + 8);
+          }
+        }
+        if (f != NULL) fclose(f);
+      }
+      free(dir);
+      return true;
+    }
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL || slash == dir) break;
+    *slash = '\0';
   }
-  if (args.size > 2) {
-    fprintf(err, "cd: too many arguments\n");
-    return 1;
+  free(dir);
+  return false;
+}
+
+char *git_branch(const char *git_dir) {
+  char *path = NULL;
+  assert(asprintf(&path, "%s/HEAD", git_dir) != -1);
+  FILE *f = fopen(path, "r");
+  free(path);
+  if (f == NULL) return NULL;
+  char line[256] = {0};
+  char *ret = NULL;
+  if (fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "ref: refs/heads/", 16) == 0) ret = strdup(line + 16);
+    else ret = strndup(line, 7);
+  }
+  fclose(f);
+  return ret;
+}
+
+// Runs git status with the shell's environment `env`, finding git on its
+// PATH, as other commands the shell runs are
+char *git_status(const char *cwd, char **env) {
+  const char *path = "";
+  for (char **e = env; *e != NULL; e ++) {
+    if (strncmp(*e, "PATH=", 5) == 0) path = *e + 5;
+  }
+  char *git = NULL;
+  while (git == NULL && *path != '\0') {
+    size_t len = strcspn(path, ":");
+    assert(asprintf(&git, "%.*s/git", (int)len, path) != -1);
+    if (access(git, X_OK) != 0) {
+      free(git);
+      git = NULL;
+    }
+    path += len;
+    if (*path == ':') path ++;
+  }
+  if (git == NULL) return NULL;
+  int out[2];
+  if (pipe(out) != 0) {
+    free(git);
+    return NULL;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addclose(&actions, out[0]);
+  posix_spawn_file_actions_addclose(&actions, out[1]);
+  char *argv[] = {
+    "git", "--no-optional-locks", "-C", (char *)cwd, "status", "--porcelain", "--untracked-files=no", NULL,
+  };
+  pid_t pid;
+  int err = posix_spawn(&pid, git, &actions, NULL, argv, env);
+  posix_spawn_file_actions_destroy(&actions);
+  free(git);
+  close(out[1]);
+  if (err != 0) {
+    close(out[0]);
+    return NULL;
   }
+  char buf[4096];
+  bool dirty = false;
+  ssize_t n;
+  while ((n = read(out[0], buf, sizeof(buf))) != 0) {
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) break;
+    dirty = true;
+  }
+  close(out[0]);
+  int wstatus;
+  while (waitpid(pid, &wstatus, 0) == -1 && errno == EINTR);
+  return strdup(dirty ? "*" : "");
+}
 
-  if (args.size == 1) {
-    char *home = getenv("HOME");
-    if (home == NULL) {
-      fprintf(err, "cd: HOME not set\n");
-      return 1;
+// Shortens all but the last directory of cwd to its shortest unique prefix
+char *compact_cwd(const char *cwd, const char *home) {
+  char_array ret = {0};
+  const char *p = cwd;
+  size_t home_len = home == NULL ? 0 : strlen(home);
+  if (home_len > 1 && strncmp(cwd, home, home_len) == 0 && (cwd[home_len] == '/' || cwd[home_len] == '\0')) {
+    ARRAY_ADD(ret, '~');
+    p += home_len;
+  }
+  while (*p == '/') {
+    const char *name = p + 1;
+    size_t len = strcspn(name, "/");
+    ARRAY_ADD(ret, '/');
+    size_t keep = len;
+    if (name[len] == '/') {
+      // unique among the entries of its parent directory
+      char *parent = strndup(cwd, p - cwd);
+      DIR *dir = opendir(*parent == '\0' ? "/" : parent);
+      free(parent);
+      keep = len > 0 ? 1 : 0;
+      struct dirent *entry;
+      while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (strlen(entry->d_name) == len && strncmp(entry->d_name, name, len) == 0) continue;
+        while (keep < len && strncmp(entry->d_name, name, keep) == 0) keep ++;
+      }
+      if (dir != NULL) closedir(dir);
     }
-    return cd(home);
+    char_array_reserve(&ret, keep);
+    memcpy(ret.data + ret.size, name, keep);
+    ret.size += keep;
+    p = name + len;
   }
+  if (ret.size == 0) ARRAY_ADD(ret, '/');
+  ARRAY_ADD(ret, '\0');
+  return ret.data;
+}
 
-  return cd(args.data[1]);
+char *load_average(void) {
+  FILE *f = fopen("/proc/loadavg", "r");
+  if (f == NULL) return NULL;
+  char load[32] = {0};
+  char *ret = fscanf(f, "%31s", load) == 1 ? strdup(load) : NULL;
+  fclose(f);
+  return ret;
 }
 
-int main(int argc, char **argv) {
-  struct termios old_termios;
-  if (tcgetattr(STDIN_FILENO, &old_termios) == 0) {
-    old_termios_ptr = &old_termios;
-    struct termios term;
-    term = old_termios;
-    term.c_lflag &= ~(ICANON|ISIG|ECHO);
-    term.c_cc[VTIME] = 0;
-    term.c_cc[VMIN] = 0;
-    if (tcsetattr(STDIN_FILENO, TCSANOW, &term) != 0) {
-      perror("tcsetattr");
-      ABORT();
+bool timespec_equal(struct timespec a, struct timespec b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+void *prompt_worker_main(void *arg) {
+  (void)arg;
+  char_array git_dir = {0};
+  pthread_mutex_lock(&prompt_worker.lock);
+  while (true) {
+    while (prompt_worker.cwd == NULL) pthread_cond_wait(&prompt_worker.cond, &prompt_worker.lock);
+    char *cwd = prompt_worker.cwd;
+    char *home = prompt_worker.home;
+    string_array env = prompt_worker.env;
+    int wanted = prompt_worker.wanted;
+    prompt_worker.cwd = NULL;
+    prompt_worker.home = NULL;
+    prompt_worker.env = (string_array){0};
+
+    prompt_segments *seg = NULL;
+    for (size_t i = 0; i < PROMPT_CACHE_SIZE && seg == NULL; i ++) {
+      if (prompt_worker.cache[i].cwd != NULL && strcmp(prompt_worker.cache[i].cwd, cwd) == 0) seg = &prompt_worker.cache[i];
+    }
+    bool fresh = seg == NULL;
+    struct timespec head_mtime = {0};
+    struct timespec index_mtime = {0};
+    pthread_mutex_unlock(&prompt_worker.lock);
+
+    // The expensive part happens without the lock held
+    bool has_git = (wanted & (PROMPT_GIT_BRANCH | PROMPT_GIT_STATUS)) && find_git_dir(cwd, &git_dir);
+    if (has_git) {
+      struct stat st;
+      char *path = NULL;
+      assert(asprintf(&path, "%s/HEAD", git_dir.data) != -1);
+      if (stat(path, &st) == 0) head_mtime = st.st_mtim;
+      free(path);
+      assert(asprintf(&path, "%s/index", git_dir.data) != -1);
+      if (stat(path, &st) == 0) index_mtime = st.st_mtim;
+      free(path);
+    }
+    // The branch only changes with HEAD, but editing any tracked file can
+    // change the status, so that is asked for every prompt
+    bool git_stale = fresh || seg->has_git != has_git ||
+      !timespec_equal(seg->head_mtime, head_mtime) || !timespec_equal(seg->index_mtime, index_mtime);
+    char *branch = git_stale && has_git ? git_branch(git_dir.data) : NULL;
+    bool want_status = has_git && (wanted & PROMPT_GIT_STATUS) && env.size > 0;
+    char *status = want_status ? git_status(cwd, env.data) : NULL;
+    free_string_array(&env);
+    char *compact = (wanted & PROMPT_COMPACT_CWD) && (fresh || seg->compact_cwd == NULL) ? compact_cwd(cwd, home) : NULL;
+    char *load = (wanted & PROMPT_LOAD) ? load_average() : NULL;
+
+    pthread_mutex_lock(&prompt_worker.lock);
+    if (fresh) {
+      seg = &prompt_worker.cache[prompt_worker.next_slot];
+      prompt_worker.next_slot = (prompt_worker.next_slot + 1) % PROMPT_CACHE_SIZE;
+      prompt_segments_free(seg);
+      seg->cwd = strdup(cwd);
+    }
+    bool changed = fresh;
+    if (git_stale) {
+      seg->has_git = has_git;
+      seg->head_mtime = head_mtime;
+      seg->index_mtime = index_mtime;
+      changed |= prompt_update(&seg->branch, branch);
+    }
+    if (want_status || git_stale) changed |= prompt_update(&seg->status, status);
+    if (compact != NULL) changed |= prompt_update(&seg->compact_cwd, compact);
+    if (load != NULL) changed |= prompt_update(&seg->load, load);
+    free(cwd);
+    free(home);
+    if (changed) {
+      while (write(prompt_worker.notify[1], "x", 1) == -1 && errno == EINTR);
     }
-  } else {
-    old_termios_ptr = NULL;
   }
+  UNREACHABLE();
+  return NULL;
+}
 
-  ARRAY_ADD(builtins, COMMAND(help, "Displays help about commands."));
-  ARRAY_ADD(builtins, COMMAND(exit, "Exit the shell, with optional code."));
-  ARRAY_ADD(builtins, COMMAND(echo, "Prints any arguments to stdout."));
-  ARRAY_ADD(builtins, COMMAND(type, "Prints the type of command arguments."));
-  ARRAY_ADD(builtins, COMMAND(pwd, "Prints current working directory."));
-  ARRAY_ADD(builtins, COMMAND(cd, "Change current working directory."));
+void prompt_redraw(int fd);
 
-  // Flush after every printf
-  setbuf(stdout, NULL);
+void prompt_request(const char *cwd, int wanted) {
+  pthread_mutex_lock(&prompt_worker.lock);
+  if (!prompt_worker.started) {
+    if (pipe(prompt_worker.notify) != 0) {
+      perror("prompt pipe");
+      ABORT();
+    }
+    fcntl(prompt_worker.notify[0], F_SETFD, FD_CLOEXEC);
+    fcntl(prompt_worker.notify[1], F_SETFD, FD_CLOEXEC);
+    if (pthread_create(&prompt_worker.thread, NULL, prompt_worker_main, NULL) != 0) {
+      perror("prompt pthread_create");
+      ABORT();
+    }
+    pthread_detach(prompt_worker.thread);
+    prompt_worker.started = true;
+    event_source_add(prompt_worker.notify[0], prompt_redraw);
+  }
+  free(prompt_worker.cwd);
+  free(prompt_worker.home);
+  free_string_array(&prompt_worker.env);
+  if (wanted & PROMPT_GIT_STATUS) {
+    char **env = shell_environ();
+    for (size_t i = 0; env[i] != NULL; i ++) ARRAY_ADD(prompt_worker.env, strdup(env[i]));
+    ARRAY_ADD(prompt_worker.env, NULL);
+  }
+  prompt_worker.cwd = strdup(cwd);
+  char *home = var_get("HOME");
+  prompt_worker.home = home == NULL ? NULL : strdup(home);
+  prompt_worker.wanted = wanted;
+  pthread_cond_signal(&prompt_worker.cond);
+  pthread_mutex_unlock(&prompt_worker.lock);
+}
 
-  if (argc > 1) {
-    fprintf(stderr, "%s: no arguments supported\n", argv[0]);
-    return 1;
+// Appends text to a raw prompt, escaped so expansion leaves it alone
+void prompt_append(char_array *out, const char *text) {
+  for (; text != NULL && *text != '\0'; text ++) {
+    if (strchr("\\$`\"'", *text) != NULL) ARRAY_ADD(*out, '\\');
+    ARRAY_ADD(*out, *text);
   }
+}
 
-  // FIXME read PS1
-  printf("$ ");
-  do {
+// Decodes the backslash escapes of PS1/PS2 and then expands the result.
+// Returns the async segments that were used in *wanted.
+char *render_prompt(const char *ps, int *wanted, bool request) {
+  char_array raw = {0};
+  char *cwd = shell_getcwd();
+  char *home = var_get("HOME");
+  prompt_segments *seg = NULL;
+  bool locked = false;
+  *wanted = 0;
+  for (const char *p = ps; *p != '\0'; p ++) {
+    if (*p != '\\' || p[1] == '\0') {
+      ARRAY_ADD(raw, *p);
+      continue;
+    }
+    char buf[256] = {0};
+    switch (*++ p) {
+      case 'u': {
+        struct passwd *pw = getpwuid(geteuid());
+        prompt_append(&raw, pw != NULL ? pw->pw_name : var_get("USER"));
+      }; break;
 
-    char *delim = " \n";
-    string_array args = {0};
-    bool error = false;
-    quote_mode quote = UNQUOTED;
-    char *arg;
-    bool quoted;
-    bool escaped;
-    bool first = true;
-    while ((arg = read_arg(delim, &quoted, &escaped, &quote, &error, first)) != NULL) {
-      first = false;
-      if (!quoted && !escaped && (strcmp(arg, ">") == 0 || strcmp(arg, ">>") == 0)) {
-        long fd = STDOUT_FILENO;
-        if (args.size > 0) {
-          char *end;
-          long test = strtol(args.data[args.size - 1], &end, 0);
-          if (arg != end && *end == '\0') {
-            fd = test;
-            args.size --;
-            free(args.data[args.size]);
-            args.data[args.size] = NULL;
-          }
+      case 'h':
+      case 'H':
+        if (gethostname(buf, sizeof(buf) - 1) == 0) {
+          if (*p == 'h') buf[strcspn(buf, ".")] = '\0';
+          prompt_append(&raw, buf);
         }
-        bool append = arg[1] == '>';
-        free(arg);
-        if (fd < 0) {
-          fprintf(stderr, "redirection error, negative file descriptor\n");
-          error = true;
+        break;
+
+      case 'w':
+      case 'W': {
+        if (cwd == NULL) break;
+        size_t home_len = home == NULL ? 0 : strlen(home);
+        bool in_home = home_len > 1 && strncmp(cwd, home, home_len) == 0 && (cwd[home_len] == '/' || cwd[home_len] == '\0');
+        if (*p == 'W') {
+          char *base = strrchr(cwd, '/');
+          prompt_append(&raw, in_home && cwd[home_len] == '\0' ? "~" : base[1] == '\0' ? "/" : base + 1);
           break;
         }
+        const char *dir = in_home ? cwd + home_len : cwd;
+        if (in_home) ARRAY_ADD(raw, '~');
+        // PROMPT_DIRTRIM keeps only that many trailing directories
+        char *trim = var_get("PROMPT_DIRTRIM");
+        long keep = trim == NULL ? 0 : strtol(trim, NULL, 10);
+        if (keep > 0) {
+          const char *start = dir + strlen(dir);
+          long count = 0;
+          while (start > dir && count < keep) {
+            start --;
+            if (*start == '/') count ++;
+          }
+          if (start > dir) {
+            prompt_append(&raw, in_home ? "/..." : "...");
+            dir = start;
+          }
+        }
+        prompt_append(&raw, dir);
+      }; break;
 
-        arg = read_arg(delim, &quoted, &escaped, &quote, &error, false);
-        if (error || arg == NULL) {
-          fprintf(stderr, "syntax error, missing filename of redirect\n");
-          error = true;
-          break;
+      case 'g':
+      case 'G':
+      case 'c':
+      case 'L': {
+        int segment = *p == 'g' ? PROMPT_GIT_BRANCH : *p == 'G' ? PROMPT_GIT_STATUS : *p == 'c' ? PROMPT_COMPACT_CWD : PROMPT_LOAD;
+        *wanted |= segment;
+        if (cwd == NULL) break;
+        if (!locked) {
+          pthread_mutex_lock(&prompt_worker.lock);
+          locked = true;
+          for (size_t i = 0; i < PROMPT_CACHE_SIZE && seg == NULL; i ++) {
+            if (prompt_worker.cache[i].cwd != NULL && strcmp(prompt_worker.cache[i].cwd, cwd) == 0) seg = &prompt_worker.cache[i];
+          }
         }
-        if (error) goto cont;
-
-        ARRAY_ENSURE_CAPACITY(files, (size_t)fd + 1);
-        if ((size_t)fd >= files.size) files.size = (size_t)fd + 1;
-        files.data[fd] = fopen(arg, append ? "a" : "w");
-        if (files.data[fd] == NULL) {
-          fprintf(stderr, "output error, could not open `%s` for opening\n", arg);
-          error = true;
-          free(arg);
-          break;
+        if (seg == NULL) break;
+        switch (segment) {
+          case PROMPT_GIT_BRANCH: prompt_append(&raw, seg->branch); break;
+          case PROMPT_GIT_STATUS: prompt_append(&raw, seg->status); break;
+          case PROMPT_COMPACT_CWD: prompt_append(&raw, seg->compact_cwd); break;
+          case PROMPT_LOAD: prompt_append(&raw, seg->load); break;
         }
-        free(arg);
-      } else {
-        ARRAY_ADD(args, arg);
+      }; break;
+
+      case 't':
+      case 'd': {
+        time_t now = time(NULL);
+        strftime(buf, sizeof(buf), *p == 't' ? "%H:%M:%S" : "%a %b %d", localtime(&now));
+        prompt_append(&raw, buf);
+      }; break;
+
+      case 's': {
+        char *slash = strrchr(shell_name, '/');
+        prompt_append(&raw, slash == NULL ? shell_name : slash + 1);
+      }; break;
+
+      case '$':
+        prompt_append(&raw, geteuid() == 0 ? "#" : "$");
+        break;
+
+      case 'n': prompt_append(&raw, "\n"); break;
+      case 'r': prompt_append(&raw, "\r"); break;
+      case 'e': prompt_append(&raw, "\033"); break;
+      case 'a': prompt_append(&raw, "\a"); break;
+      case '\\': prompt_append(&raw, "\\"); break;
+      case '[': case ']': break;
+
+      default:
+        ARRAY_ADD(raw, '\\');
+        ARRAY_ADD(raw, *p);
+        break;
+    }
+  }
+  if (locked) pthread_mutex_unlock(&prompt_worker.lock);
+  if (request && *wanted != 0 && cwd != NULL) prompt_request(cwd, *wanted);
+  ARRAY_ADD(raw, '\0');
+  char *ret = expand_word_single(raw.data);
+  ARRAY_FREE(raw);
+  return ret == NULL ? strdup("") : ret;
+}
+
+void prompt1(void) {
+  paste_mode(true);
+  char *ps1 = var_get("PS1");
+  int wanted;
+  char *prompt = ps1 == NULL ? strdup("$ ") : render_prompt(ps1, &wanted, true);
+  printf("%s", prompt);
+  prompt_shown.size = 0;
+  char_array_reserve(&prompt_shown, strlen(prompt) + 1);
+  strcpy(prompt_shown.data, prompt);
+  prompt_shown.size = strlen(prompt);
+  prompt_line.size = 0;
+  prompt_active = true;
+  free(prompt);
+}
+
+void prompt_ps2(bool newline) {
+  prompt_active = false;
+  // A paste is echoed as it was, without prompts within it
+  if (!input->echo || input_pasting(input)) return;
+  char *ps2 = var_get("PS2");
+  int wanted;
+  char *prompt = ps2 == NULL ? strdup("> ") : render_prompt(ps2, &wanted, false);
+  printf("%s%s", newline ? "\n" : "", prompt);
+  free(prompt);
+}
+
+void prompt2(void) {
+  prompt_ps2(true);
+}
+
+// The worker has new segments, draw the prompt again if it's still there
+void prompt_redraw(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) == -1 && errno == EINTR);
+  if (!prompt_active) return;
+  char *ps1 = var_get("PS1");
+  if (ps1 == NULL) return;
+  int wanted;
+  char *prompt = render_prompt(ps1, &wanted, false);
+  if (prompt_shown.size == strlen(prompt) && strncmp(prompt_shown.data, prompt, prompt_shown.size) == 0) {
+    free(prompt);
+    return;
+  }
+  size_t lines = 0;
+  for (size_t i = 0; i < prompt_shown.size; i ++) {
+    if (prompt_shown.data[i] == '\n') lines ++;
+  }
+  printf("\r");
+  if (lines > 0) printf("\033[%zuA", lines);
+  printf("\033[J%s%.*s", prompt, (int)prompt_line.size, prompt_line.data == NULL ? "" : prompt_line.data);
+  prompt_shown.size = 0;
+  char_array_reserve(&prompt_shown, strlen(prompt) + 1);
+  strcpy(prompt_shown.data, prompt);
+  prompt_shown.size = strlen(prompt);
+  free(prompt);
+}
+
+// Server mode: a warm shell listens on a unix socket and runs the command
+// lines clients send it. Clients pass their stdin/stdout/stderr with
+// SCM_RIGHTS, so output goes straight to them. Each request runs in a fork
+// of the server, at most `max_jobs` at a time, and the exit code is sent
+// back as a 4 byte int.
+volatile sig_atomic_t server_stopping = 0;
+
+void server_stop(int sig) {
+  (void)sig;
+  server_stopping = 1;
+}
+
+bool read_full(int fd, void *buf, size_t size) {
+  while (size > 0) {
+    ssize_t n = read(fd, buf, size);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    buf = (char *)buf + n;
+    size -= n;
+  }
+  return true;
+}
+
+bool write_full(int fd, const void *buf, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, buf, size);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    buf = (const char *)buf + n;
+    size -= n;
+  }
+  return true;
+}
+
+// The connection of the request this process runs, and the pid that owns
+// it, so a subshell exiting doesn't answer for it
+int server_conn = -1;
+pid_t server_conn_pid = 0;
+
+// Sends the exit code back to the client, once
+void server_reply(int status) {
+  if (server_conn == -1 || server_conn_pid != getpid()) return;
+  int32_t code = status;
+  write_full(server_conn, &code, sizeof(code));
+  server_conn = -1;
+}
+
+// Runs one request on a connection, in a fork of the server
+int server_handle(int conn) {
+  uint32_t len = 0;
+  int fds[3] = { -1, -1, -1 };
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {
+    .iov_base = &len,
+    .iov_len = sizeof(len),
+  };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  ssize_t n;
+  while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+  if (n != sizeof(len)) {
+    fprintf(stderr, "server: bad request\n");
+    return 1;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    fprintf(stderr, "server: request is missing stdin/stdout/stderr\n");
+    return 1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  char *command = malloc(len + 1);
+  assert(command != NULL);
+  if (!read_full(conn, command, len)) {
+    fprintf(stderr, "server: truncated request\n");
+    return 1;
+  }
+  command[len] = '\0';
+  for (int i = 0; i < 3; i ++) {
+    if (dup2(fds[i], i) == -1) { perror("server dup2"); return 1; }
+    close(fds[i]);
+  }
+
+  stdin_buf = (read_buffer){ .fd = STDIN_FILENO };
+  read_buffer buf = read_buffer_string(command, len);
+  input = &buf;
+  server_conn = conn;
+  server_conn_pid = getpid();
+  while (!is_eof(input)) {
+    run_line();
+  }
+  server_reply(last_status);
+  free(command);
+  return last_status;
+}
+
+int server_main(const char *path, long max_jobs) {
+  struct sockaddr_un addr = {
+    .sun_family = AF_UNIX,
+  };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "server: socket path too long: %s\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1) { perror("server socket"); return 1; }
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) { perror("server bind"); return 1; }
+  if (listen(sock, 128) == -1) { perror("server listen"); return 1; }
+
+  struct sigaction sa = {
+    .sa_handler = server_stop,
+  };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  long active = 0;
+  while (!server_stopping) {
+    // Reap finished requests, waiting for one when at the limit
+    while (active > 0) {
+      pid_t pid = waitpid(-1, NULL, active >= max_jobs ? 0 : WNOHANG);
+      if (pid > 0) {
+        active --;
+        continue;
       }
+      if (pid == -1 && errno == EINTR && !server_stopping) continue;
+      break;
     }
-    if (error) goto cont;
-    if (args.size == 0) goto cont;
-    char *command = args.data[0];
+    if (server_stopping) break;
+    int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+      if (errno != EINTR) perror("server accept");
+      continue;
+    }
+    pid_t pid = fork();
+    switch (pid) {
+      case -1:
+        perror("server fork");
+        close(conn);
+        break;
 
-    int code = -1;
-    for (size_t i = 0; i < builtins.size; i ++) {
-      if (strcmp(command, builtins.data[i].command) == 0) {
-        // FIXME store return value
-        code = builtins.data[i].function(args);
+      case 0:
+        close(sock);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        _exit(server_handle(conn));
+
+      default:
+        close(conn);
+        active ++;
         break;
+    }
+  }
+  close(sock);
+  unlink(path);
+  while (active > 0 && (waitpid(-1, NULL, 0) > 0 || errno == EINTR)) active --;
+  cleanup();
+  return 0;
+}
+
+// --replay drives a shell through a pseudo-terminal with the input of a
+// --record session and measures how long it takes to respond. Each read is
+// written once the previous one has been answered and its recorded gap has
+// passed (divided by the speed, 0 for no gaps). Reads ending in a newline
+// wait for the prompt again, anything else for its echo.
+typedef struct {
+  uint64_t at;
+  char_array bytes;
+} recorded_read;
+
+typedef ARRAY(recorded_read) recorded_reads;
+typedef ARRAY(uint64_t) latency_array;
+
+bool replay_load(const char *path, recorded_reads *reads) {
+  FILE *f = fopen(path, "re");
+  if (f == NULL) {
+    fprintf(stderr, "replay: %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  char *line = NULL;
+  size_t line_cap = 0;
+  size_t line_no = 0;
+  bool ok = true;
+  while (ok && getline(&line, &line_cap, f) != -1) {
+    line_no ++;
+    char *end;
+    recorded_read r = { .at = strtoull(line, &end, 10) };
+    if (end == line || *end != ' ') ok = false;
+    for (char *hex = end + 1; ok && isxdigit((unsigned char)hex[0]); hex += 2) {
+      unsigned int byte;
+      if (!isxdigit((unsigned char)hex[1]) || sscanf(hex, "%2x", &byte) != 1) ok = false;
+      else ARRAY_ADD(r.bytes, (char)byte);
+    }
+    if (!ok || r.bytes.size == 0) {
+      fprintf(stderr, "replay: %s:%zu: not a recorded read\n", path, line_no);
+      ARRAY_FREE(r.bytes);
+      ok = false;
+      break;
+    }
+    ARRAY_ADD(*reads, r);
+  }
+  free(line);
+  fclose(f);
+  return ok;
+}
+
+// Reads what the shell has written, for up to `timeout_ms`. Returns false
+// once it has gone away.
+bool replay_read(int fd, char_array *out, int timeout_ms) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  int p;
+  while ((p = poll(&pfd, 1, timeout_ms)) == -1 && errno == EINTR);
+  if (p <= 0) return p == 0;
+  char buf[4096];
+  ssize_t n = read(fd, buf, sizeof(buf));
+  // EIO is how a pty reports the other side closing
+  if (n <= 0) return false;
+  char_array_reserve(out, n);
+  memcpy(out->data + out->size, buf, n);
+  out->size += n;
+  return true;
+}
+
+bool ends_with(const char_array *out, const char *suffix) {
+  size_t len = strlen(suffix);
+  return out->size >= len && memcmp(out->data + out->size - len, suffix, len) == 0;
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+void latency_print(const char *name, latency_array *lat, size_t missed) {
+  printf("%-18s n=%zu", name, lat->size);
+  if (lat->size > 0) {
+    qsort(lat->data, lat->size, sizeof(lat->data[0]), compare_u64);
+    const int percentiles[] = { 50, 90, 99 };
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i ++) {
+      size_t rank = (lat->size * percentiles[i] + 99) / 100;
+      printf(" p%d=%.3fms", percentiles[i], lat->data[rank > 0 ? rank - 1 : 0] / 1000.0);
+    }
+    printf(" max=%.3fms", lat->data[lat->size - 1] / 1000.0);
+  }
+  if (missed > 0) printf(" missed=%zu", missed);
+  printf("\n");
+}
+
+int replay_main(const char *path, double speed, char **cmd) {
+  recorded_reads reads = {0};
+  if (!replay_load(path, &reads)) {
+    for (size_t i = 0; i < reads.size; i ++) ARRAY_FREE(reads.data[i].bytes);
+    ARRAY_FREE(reads);
+    return 1;
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+    perror("replay pty");
+    return 1;
+  }
+  struct winsize size = { .ws_row = 24, .ws_col = 80 };
+  ioctl(master, TIOCSWINSZ, &size);
+  pid_t pid = fork();
+  switch (pid) {
+    case -1:
+      perror("replay fork");
+      return 1;
+
+    case 0: {
+      setsid();
+      int slave = open(ptsname(master), O_RDWR);
+      if (slave == -1) { perror("replay open pty"); _exit(127); }
+      ioctl(slave, TIOCSCTTY, 0);
+      for (int fd = 0; fd < 3; fd ++) dup2(slave, fd);
+      if (slave > 2) close(slave);
+      execvp(cmd[0], cmd);
+      perror(cmd[0]);
+      _exit(127);
+    }; break;
+
+    default:
+      break;
+  }
+
+  // The first prompt tells us what a prompt looks like
+  char_array out = {0};
+  while (replay_read(master, &out, out.size == 0 ? 5000 : 200) && out.size > 0) {
+    struct pollfd pfd = { .fd = master, .events = POLLIN };
+    if (poll(&pfd, 1, 200) == 0) break;
+  }
+  size_t line = out.size;
+  while (line > 0 && out.data[line - 1] != '\n') line --;
+  char *prompt = strndup(out.data + line, out.size - line);
+
+  latency_array echo = {0};
+  latency_array enter = {0};
+  size_t echo_missed = 0;
+  size_t enter_missed = 0;
+  bool alive = true;
+  struct timespec last;
+  clock_gettime(CLOCK_MONOTONIC, &last);
+  for (size_t i = 0; i < reads.size && alive; i ++) {
+    recorded_read *r = &reads.data[i];
+    if (speed > 0 && i > 0) {
+      uint64_t gap = (uint64_t)((r->at - reads.data[i - 1].at) / speed);
+      uint64_t spent = usec_since(&last);
+      if (gap > spent) {
+        struct timespec wait = { .tv_sec = (gap - spent) / 1000000, .tv_nsec = (gap - spent) % 1000000 * 1000 };
+        while (nanosleep(&wait, &wait) == -1 && errno == EINTR);
       }
     }
-    if (code == -1) {
-      if (strchr(command, '/') != NULL && access(command, R_OK | X_OK) == 0) {
-        struct stat command_stat;
-        if (stat(command, &command_stat) == -1) {
-          perror("stat");
-          ABORT();
-        }
+    out.size = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    if (!write_full(master, r->bytes.data, r->bytes.size)) break;
+    bool is_enter = r->bytes.data[r->bytes.size - 1] == '\n' || r->bytes.data[r->bytes.size - 1] == '\r';
+    bool answered = false;
+    // Commands can take a while, an echo shouldn't
+    uint64_t limit = is_enter ? 10000000 : 1000000;
+    while (!answered && usec_since(&last) < limit) {
+      alive = replay_read(master, &out, 10);
+      if (!alive) break;
+      answered = is_enter ? prompt[0] != '\0' && ends_with(&out, prompt) : out.size > 0;
+    }
+    latency_array *lat = is_enter ? &enter : &echo;
+    if (answered) ARRAY_ADD(*lat, usec_since(&last));
+    else if (is_enter) enter_missed ++;
+    else echo_missed ++;
+  }
 
-        if ((command_stat.st_mode & S_IFMT) == S_IFDIR) {
-          fprintf(stderr, "%s: is a directory\n", command);
-        } else {
-          code = run_program(command, args);
-        }
-        goto cont;
-      } else {
-        char *path = getenv("PATH");
-        if (path != NULL) {
-          char *p = path;
-          while (*p != '\0') {
-            while (*p != '\0' && *p != ':') p ++;
-            char *file_path = NULL;
-            char *path_name = strndup(path, (int)(p - path));
-            assert(asprintf(&file_path, "%s/%s", path_name, command) != 0);
-            free(path_name);
-            if (access(file_path, R_OK | X_OK) == 0) {
-              code = run_program(file_path, args);
-              free(file_path);
-              break;
-            }
-            if (*p != '\0') path = ++p;
-            free(file_path);
-          }
-        }
+  close(master);
+  int wstatus = 0;
+  for (int tries = 0; waitpid(pid, &wstatus, WNOHANG) == 0; tries ++) {
+    if (tries == 100) kill(pid, SIGKILL);
+    struct timespec wait = { .tv_nsec = 10000000 };
+    nanosleep(&wait, NULL);
+  }
+
+  if (speed > 0) printf("replayed %zu reads of %s at %gx recorded speed\n", reads.size, path, speed);
+  else printf("replayed %zu reads of %s at full speed\n", reads.size, path);
+  latency_print("keystroke-to-echo", &echo, echo_missed);
+  latency_print("enter-to-prompt", &enter, enter_missed);
+
+  free(prompt);
+  ARRAY_FREE(out);
+  ARRAY_FREE(echo);
+  ARRAY_FREE(enter);
+  for (size_t i = 0; i < reads.size; i ++) ARRAY_FREE(reads.data[i].bytes);
+  ARRAY_FREE(reads);
+  return 0;
+}
+
+// Sends `command` to a server with our stdin/stdout/stderr, returns its code
+int client_main(const char *path, const char *command) {
+  struct sockaddr_un addr = {
+    .sun_family = AF_UNIX,
+  };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "client: socket path too long: %s\n", path);
+    return 255;
+  }
+  strcpy(addr.sun_path, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror("client connect");
+    return 255;
+  }
+  uint32_t len = strlen(command);
+  int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {
+    .iov_base = &len,
+    .iov_len = sizeof(len),
+  };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  ssize_t n;
+  while ((n = sendmsg(sock, &msg, 0)) == -1 && errno == EINTR);
+  if (n != sizeof(len) || !write_full(sock, command, len)) {
+    perror("client send");
+    return 255;
+  }
+  int32_t status;
+  if (!read_full(sock, &status, sizeof(status))) {
+    fprintf(stderr, "client: server closed the connection\n");
+    return 255;
+  }
+  close(sock);
+  return status;
+}
+
+void usage(FILE *out) {
+  fprintf(out, "Usage: %s [SCRIPT [ARG...]]\n", shell_name);
+  fprintf(out, "       %s -c COMMAND [NAME [ARG...]]\n", shell_name);
+  fprintf(out, "       %s --server SOCKET [--jobs N]\n", shell_name);
+  fprintf(out, "       %s --client SOCKET COMMAND...\n", shell_name);
+  fprintf(out, "       %s --record FILE\n", shell_name);
+  fprintf(out, "       %s --replay FILE [--speed N] [SHELL [ARG...]]\n", shell_name);
+}
+
+int main(int argc, char **argv) {
+  char *spawn = getenv("SHELL_SPAWN");
+  if (spawn != NULL && strcmp(spawn, "zygote") == 0) zygote_start();
+
+  ARRAY_ADD(builtins, THREADED_COMMAND(help, "Displays help about commands."));
+  ARRAY_ADD(builtins, COMMAND(exit, "Exit the shell, with optional code."));
+  ARRAY_ADD(builtins, COMMAND(exec, "Replace the shell with a command, or keep redirections."));
+  ARRAY_ADD(builtins, COMMAND(source, "Run the commands of a file in the shell."));
+  ARRAY_ADD(builtins, ((command_t){ .command = ".", .description = "Run the commands of a file in the shell.", .function = source_command }));
+  ARRAY_ADD(builtins, COMMAND(coproc, "Start a command connected to the shell by pipes."));
+  ARRAY_ADD(builtins, THREADED_COMMAND(echo, "Prints any arguments to stdout."));
+  ARRAY_ADD(builtins, COMMAND(read, "Read a line of input into variables."));
+  ARRAY_ADD(builtins, THREADED_COMMAND(cat, "Prints files, or input, to stdout."));
+  ARRAY_ADD(builtins, THREADED_COMMAND(tee, "Copies input to files and to stdout."));
+  ARRAY_ADD(builtins, PURE_COMMAND(shellstats, "Show allocation and syscall counts."));
+  ARRAY_ADD(builtins, PURE_COMMAND(type, "Prints the type of command arguments."));
+  ARRAY_ADD(builtins, THREADED_COMMAND(pwd, "Prints current working directory."));
+  ARRAY_ADD(builtins, COMMAND(cd, "Change current working directory."));
+  ARRAY_ADD(builtins, COMMAND(pushd, "Push a directory onto the directory stack."));
+  ARRAY_ADD(builtins, COMMAND(popd, "Pop a directory off the directory stack."));
+  ARRAY_ADD(builtins, THREADED_COMMAND(dirs, "Prints the directory stack."));
+  ARRAY_ADD(builtins, COMMAND(run, "Run a command with cpu, priority and memory limits."));
+  ARRAY_ADD(builtins, COMMAND(ulimit, "Get or set resource limits of the shell."));
+  ARRAY_ADD(builtins, COMMAND(timeout, "Run a command with a time limit."));
+  // Control flow has to happen in the shell running it, even within $(...)
+  ARRAY_ADD(builtins, PURE_COMMAND(break, "Exit from for, while or until loops."));
+  ARRAY_ADD(builtins, PURE_COMMAND(continue, "Resume the next iteration of for, while or until loops."));
+  ARRAY_ADD(builtins, PURE_COMMAND(return, "Return from a function, with optional code."));
+  ARRAY_ADD(builtins, PURE_COMMAND(local, "Declare variables local to a function."));
+  ARRAY_ADD(builtins, PURE_COMMAND(shift, "Shift positional parameters to the left."));
+  ARRAY_ADD(builtins, PURE_COMMAND(let, "Evaluate arithmetic expressions."));
+  ARRAY_ADD(builtins, THREADED_COMMAND(true, "Does nothing, successfully."));
+  ARRAY_ADD(builtins, THREADED_COMMAND(false, "Does nothing, unsuccessfully."));
+  ARRAY_ADD(builtins, ((command_t){ .command = ":", .description = "Does nothing, successfully.", .function = true_command, .pure = true, .threaded = true }));
+  ARRAY_ADD(builtins, COMMAND(export, "Export variables to the environment of commands."));
+  ARRAY_ADD(builtins, COMMAND(unset, "Unset variables or functions."));
+  ARRAY_ADD(builtins, COMMAND(hash, "Remember or forget the paths of commands."));
+
+  shell_name = argv[0];
+  vars_import(environ);
+  shell_getcwd();
 
-        if (code == -1) {
-          fprintf(stderr, "%s: command not found\n", command);
+  // Flush after every printf
+  setbuf(stdout, NULL);
+
+  if (argc == 3 && strcmp(argv[1], "--record") == 0) {
+    record_file = fopen(argv[2], "we");
+    if (record_file == NULL) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], argv[2], strerror(errno));
+      return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &record_start);
+  }
+
+  if (argc > 1 && record_file == NULL) {
+    if (strcmp(argv[1], "--replay") == 0 && argc >= 3) {
+      double speed = 1;
+      int i = 3;
+      if (argc >= 5 && strcmp(argv[3], "--speed") == 0) {
+        char *end;
+        speed = strtod(argv[4], &end);
+        if (*end != '\0' || end == argv[4] || speed < 0) {
+          usage(stderr);
+          return 1;
         }
+        i = 5;
       }
+      char *self[] = { "/proc/self/exe", NULL };
+      int code = replay_main(argv[2], speed, i < argc ? argv + i : self);
+      cleanup();
+      return code;
+    }
+    if (strcmp(argv[1], "--server") == 0 && (argc == 3 || (argc == 5 && strcmp(argv[3], "--jobs") == 0))) {
+      long max_jobs = argc == 5 ? strtol(argv[4], NULL, 10) : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+      if (max_jobs <= 0) max_jobs = 1;
+      return server_main(argv[2], max_jobs);
     }
-cont:
-    for (size_t i = 0; i < files.size; i ++ ) {
-      if (files.data[i] != NULL) {
-        fflush(files.data[i]);
+    if (strcmp(argv[1], "--client") == 0 && argc >= 4) {
+      char_array command = {0};
+      for (int i = 3; i < argc; i ++) {
+        if (i > 3) ARRAY_ADD(command, ' ');
+        char_array_reserve(&command, strlen(argv[i]));
+        memcpy(command.data + command.size, argv[i], strlen(argv[i]));
+        command.size += strlen(argv[i]);
       }
+      ARRAY_ADD(command, '\0');
+      int code = client_main(argv[2], command.data);
+      ARRAY_FREE(command);
+      cleanup();
+      return code;
     }
-    if (files.size > STDIN_FILENO && files.data[STDIN_FILENO] != NULL) {
-      fclose(files.data[STDIN_FILENO]);
-      files.data[STDIN_FILENO] = NULL;
+    if (strcmp(argv[1], "-c") == 0 && argc >= 3) {
+      if (argc > 3) shell_name = argv[3];
+      for (int i = 4; i < argc; i ++) ARRAY_ADD(positional, strdup(argv[i]));
+      read_buffer buf = read_buffer_string(argv[2], strlen(argv[2]));
+      stdin_buf.echo = false;
+      input = &buf;
+      tail_exec = true;
+      while (!is_eof(input)) run_line();
+      cleanup();
+      return last_status;
     }
-    if (files.size > STDOUT_FILENO && files.data[STDOUT_FILENO] != NULL) {
-      fclose(files.data[STDOUT_FILENO]);
-      files.data[STDOUT_FILENO] = NULL;
+    if (argv[1][0] != '-') {
+      shell_name = argv[1];
+      for (int i = 2; i < argc; i ++) ARRAY_ADD(positional, strdup(argv[i]));
+      stdin_buf.echo = false;
+      tail_exec = true;
+      if (run_file(argv[1]) == -1) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+        cleanup();
+        return 127;
+      }
+      cleanup();
+      return last_status;
     }
-    if (files.size > STDERR_FILENO && files.data[STDERR_FILENO] != NULL) {
-      fclose(files.data[STDERR_FILENO]);
-      files.data[STDERR_FILENO] = NULL;
+    usage(stderr);
+    return 1;
+  }
+
+  // Startup commands of an interactive shell
+  char *home = var_get("HOME");
+  if (home != NULL && *home != '\0') {
+    char *rc = NULL;
+    assert(asprintf(&rc, "%s/.shellrc", home) != -1);
+    if (run_file(rc) == -1 && errno != ENOENT) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], rc, strerror(errno));
     }
-    for (size_t i = 0; i < args.size; i ++) {
-      free(args.data[i]);
-      args.data[i] = NULL;
+    free(rc);
+  }
+
+  struct termios old_termios;
+  if (tcgetattr(STDIN_FILENO, &old_termios) == 0) {
+    old_termios_ptr = &old_termios;
+    struct termios term;
+    term = old_termios;
+    term.c_lflag &= ~(ICANON|ISIG|ECHO);
+    term.c_cc[VTIME] = 0;
+    term.c_cc[VMIN] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &term) != 0) {
+      perror("tcsetattr");
+      ABORT();
     }
-    ARRAY_FREE(args);
-    // FIXME read PS1
-    if (!stdin_buf.eof) printf("$ ");
+  } else {
+    old_termios_ptr = NULL;
+  }
+
+  prompt1();
+  do {
+    run_line();
+    if (!stdin_buf.eof && !input_pasting(&stdin_buf)) prompt1();
   } while (!is_eof(&stdin_buf));
 
   cleanup();
@@ -21,7 +21,7 @@ set -e # Exit early if any commands fail
   done
   echo "cc = ${cc:-cc}" >&2
   CFLAGS="-Wall -Wextra -Wpedantic -Werror"
-  CFLAGS="$CFLAGS -ggdb"
+  CFLAGS="$CFLAGS -ggdb -pthread"
   CFLAGS="$CFLAGS -lcurl -lcrypto"
   CFLAGS="$CFLAGS -Wno-gnu-zero-variadic-macro-arguments"
   tmpdir=$(mktemp -d)